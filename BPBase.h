@@ -21,6 +21,7 @@ const int RC_END_OF_TREE         = -1013;
 const int RC_INVALID_ATTRIBUTE   = -1014;
 
 const int RC_FILE_READ_ONLY = -1015;
+const int RC_UNSUPPORTED_MODE = -1016;
 
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
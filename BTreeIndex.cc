@@ -1,22 +1,49 @@
 #include "BTreeIndex.h"
 #include <queue>
 #include <string.h>
+#include <limits.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <atomic>
+#include <thread>
 using namespace std;
 
+// the Bloom filter of an index lives in this file next to it
+static const char* BLOOM_SUFFIX = ".blm";
+
 static PageId getRootPid(const char* page);
 static void setRootPid(char* page, PageId pid);
 
 static int getTreeHeight(const char* page);
 static void setTreeHeight(char* page, int height);
 
+static int getIndexOptions(const char* page);
+static void setIndexOptions(char* page, int options);
+
+static bool getTreeStats(const char* page, TreeStats& stats);
+static void setTreeStats(char* page, const TreeStats& stats);
+
+static PageId getFreeListHead(const char* page);
+static void setFreeListHead(char* page, PageId pid);
+
+// # entries removeRange() collects before removing them
+static const int REMOVE_BATCH = 1024;
+
 /*
  * BTreeIndex constructor
  */
 BTreeIndex::BTreeIndex() 
 {
-    newPid = 0;
     rootPid = -1;
     treeHeight = -1;
+    options = 0;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.cache = &cache;
+    ctx.inner = &inner;
+    rootDirty = false;
+    buffersFlushed = false;
+    defragPos = 0;
 }
 
 /*
@@ -33,18 +60,30 @@ RC BTreeIndex::open(const string& indexname, char mode)
 
   // open the page file
   if ((rc = pf.open(indexname, mode)) < 0) return rc;
+  indexName = indexname;
   readOnlyMode = ((mode == 'r' || mode == 'R'))?true:false;//read only mode, file can not be changed.
   
   //
   // in the rest of this function, we set the rootPid and  treeHeight
   //
 
-  newPid = pf.endPid();
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.newPid = pf.endPid();
+  ctx.cache = &cache;
+  ctx.inner = &inner;
+  rootNode.pid = -1;
+  rootDirty = false;
+  buffersFlushed = false;
+  defragPos = 0;
+  bloom.clear();
+  learned.clear();
+  inner.clear();
   // if the end pid is zero, the file is empty.
   // set the end record id to (0, 0).
   if (pf.endPid() == 0) {
     rootPid = -1;
     treeHeight = 0;
+    options = 0;
     return 0;
   }
 
@@ -59,6 +98,25 @@ RC BTreeIndex::open(const string& indexname, char mode)
   // get rootPid and treeHeight in the first page
   rootPid = getRootPid(page);
   treeHeight = getTreeHeight(page);
+  options = getIndexOptions(page);
+
+  // index files written before the statistics were kept in the header
+  // page get them computed once by walking the tree
+  if (!getTreeStats(page, ctx.stats) && (rc = computeStats()) < 0) {
+    pf.close();
+    return rc;
+  }
+  ctx.freeHead = getFreeListHead(page);
+
+  // load the Bloom filter if the index has one. A filter that missed
+  // some inserts (e.g. the index was not closed) is built again.
+  // Removed keys stay in the filter, so it may count more keys.
+  if (bloom.load(indexName + BLOOM_SUFFIX) == 0 &&
+      bloom.getKeyCount() < ctx.stats.entryCount &&
+      (rc = buildBloomFilter(ctx.stats.entryCount, bloom.getBitsPerKey())) < 0) {
+    pf.close();
+    return rc;
+  }
 
   return 0;
 
@@ -74,19 +132,31 @@ RC BTreeIndex::close()
   if(!readOnlyMode)
   {
 	  char page[PageFile::PAGE_SIZE];
+	  if ((rc = writeRoot()) < 0) return rc;
 	  memset(page,0,PageFile::PAGE_SIZE);
 	  //sprintf(page,"%d %d\n",rootPid,treeHeight);
 	  setRootPid(page, rootPid);
 	  setTreeHeight(page, treeHeight);
+	  setIndexOptions(page, options);
+	  setTreeStats(page, ctx.stats);
+	  setFreeListHead(page, ctx.freeHead);
+	  // an index closed before its first insert is just the header page
+	  if (ctx.newPid == 0) ctx.newPid = 1;
 	  if ((rc = pf.write(0, page)) < 0) return rc;
+	  if (bloom.isEnabled() && (rc = bloom.save(indexName + BLOOM_SUFFIX)) < 0) return rc;
 
-	  if ( newPid != pf.endPid() ){
+	  if ( ctx.newPid != pf.endPid() ){
 		  printf("newPid != pf.endPid() error!\n");
 		  rc = -1;
 	  }
   }
   rootPid = 0;
   treeHeight = 0;
+  rootNode.pid = -1;
+  bloom.clear();
+  cache.clear();
+  learned.clear();
+  inner.clear();
   pf.close();
   return rc;
 }
@@ -102,65 +172,27 @@ RC BTreeIndex::insert(KeyType key, const RecordId& rid)
 {
   if(readOnlyMode)
 	  return RC_FILE_READ_ONLY;
+  // a clustered index stores values, see insert(key, value)
+  if(options & BTNode::NODE_CLUSTERED)
+	  return RC_UNSUPPORTED_MODE;
 
   RC   rc;
-  //PageId pid;
-  //char page[PageFile::PAGE_SIZE];
-  BTNode root;
+  learned.clear();
   //printf("\n***************Insert key:"ANSI_COLOR_RED"%d"ANSI_COLOR_RESET" into Tree ******************\n",key);
   DEBUG('i',"\n************* Insert key:%d into Tree , RecordId={pid:%d, sid:%d} ******\n",key, rid.pid, rid.sid);
   if( rootPid == -1){
-      BTNode lnode,rnode;
-      lnode.isLeaf = rnode.isLeaf = true;
-      root.initializeRoot(2,key,3);
-      lnode.setNextNodePtr(3);
-      rnode.setNextNodePtr(-1);
-
-      rc = root.write(1,pf);
-      if(rc != 0) goto ERROR;
-      rc = lnode.write(2,pf);
+      rc = createTree(key);
       if(rc != 0) goto ERROR;
-      rc = rnode.write(3,pf);
-      if(rc != 0) goto ERROR;
-      
-      rnode.insertNonFull(key, rid, newPid, pf);
-      rnode.write(pf);
-
-      rootPid = 1; 
-      treeHeight = 1;
-      newPid = 4; 
-      if(pf.endPid() != 4){
-          printf("error: pf.endPid() = %d\n",pf.endPid());
-          return -1;
-      }
-      return 0;
-  }
-  
-  rc = root.read(rootPid, pf);
+      // the first entry goes straight to its leaf, even in a buffered tree
+      rc = insertEntry(key, rid);
+  }else if(options & BTNode::NODE_BUFFERED)
+      rc = bufferEntry(key, rid);
+  else
+      rc = insertEntry(key, rid);
+  if(rc != 0) goto ERROR;
+
+  rc = addKey(key);
   if(rc != 0) goto ERROR;
-  
-  if( root.n == 2*root.getT() - 1){
-      DEBUG('i',"New root:%d, height=%d\n",newPid, treeHeight + 1);
-      //new root
-      BTNode s;
-      s.isLeaf = false;
-      s.n = 0;
-      s.pids[0] = rootPid;
-      rootPid = s.pid = newPid;
-      newPid++;
-      rc = s.splitChild(0,newPid, pf);
-      newPid ++;
-      if(rc != 0) goto ERROR;
-      rc = s.insertNonFull(key, rid, newPid, pf);
-      if(rc != 0) goto ERROR;
-      rc = s.write(rootPid,pf); 
-      if(rc != 0) goto ERROR;
-      treeHeight ++;
-      
-      if(DebugIsEnabled('i'))   printTree();
-  }else{
-      root.insertNonFull(key, rid, newPid, pf);
-  }
   
   DEBUG('i',"\n**************** Insert Key End *************************\n\n",key, rid.pid, rid.sid);
   return 0;
@@ -169,6 +201,574 @@ ERROR:
   return -1;
 }
 
+/*
+ * Insert (key, value) pair to a clustered index, or replace the value.
+ * @param key[IN] the key
+ * @param value[IN] the value stored with the key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::insert(KeyType key, const string& value)
+{
+  RC   rc;
+  BTNode root;
+  bool replaced;
+
+  if(readOnlyMode) return RC_FILE_READ_ONLY;
+  if(!(options & BTNode::NODE_CLUSTERED)) return RC_UNSUPPORTED_MODE;
+  learned.clear();
+  DEBUG('i',"\n************* Insert key:%d into Tree , value:%d bytes ******\n",key, (int)value.size());
+  if(rootPid == -1 && (rc = createTree(key)) != 0) goto ERROR;
+  if((rc = readRoot(root, true)) != 0) goto ERROR;
+  if((rc = root.insertValue(key, value, ctx, pf, replaced)) != 0) goto ERROR;
+  if(replaced) return 0;
+  if((rc = addKey(key)) != 0) goto ERROR;
+  return 0;
+ERROR:
+  printf("insert error %d\n",rc);
+  return rc;
+}
+
+/*
+ * Set up the tree for its first key: a root with an empty leaf left of
+ * key and an empty leaf for key and the keys after it.
+ * @param key[IN] the first key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::createTree(KeyType key)
+{
+  RC rc;
+  BTNode root, lnode, rnode;
+
+  lnode.isLeaf = rnode.isLeaf = true;
+  root.setFormat(options);
+  lnode.setFormat(options);
+  rnode.setFormat(options);
+  root.initializeRoot(2,key,3);
+  lnode.setNextNodePtr(3);
+  rnode.setNextNodePtr(-1);
+
+  if((rc = root.write(1,pf)) != 0) return rc;
+  inner.update(root);
+  if((rc = lnode.write(2,pf)) != 0) return rc;
+  if((rc = rnode.write(3,pf)) != 0) return rc;
+
+  rootPid = 1; 
+  treeHeight = 1;
+  ctx.newPid = 4; 
+  ctx.stats.entryCount = 0;
+  ctx.stats.levelPages[0] = 2;
+  ctx.stats.levelPages[1] = 1;
+  if(pf.endPid() != 4){
+      printf("error: pf.endPid() = %d\n",pf.endPid());
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Count a new key in the statistics and the Bloom filter.
+ * @param key[IN] the key inserted
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::addKey(KeyType key)
+{
+  RC rc = 0;
+
+  if(ctx.stats.entryCount == 0 || key < ctx.stats.minKey) ctx.stats.minKey = key;
+  if(ctx.stats.entryCount == 0 || key > ctx.stats.maxKey) ctx.stats.maxKey = key;
+  ctx.stats.entryCount++;
+
+  if(bloom.isEnabled()){
+      // a filter filled beyond its capacity loses its accuracy,
+      // so it is rebuilt twice as large
+      if(bloom.getKeyCount() >= bloom.getCapacity())
+          rc = buildBloomFilter(2 * ctx.stats.entryCount, bloom.getBitsPerKey());
+      else
+          bloom.add(key);
+  }
+  return rc;
+}
+
+/*
+ * Read the root node. With split set, a full root is split first and
+ * the tree grows by one level, so that the root can take one more key.
+ * @param root[OUT] the root node
+ * @param split[IN] whether a full root should be split
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readRoot(BTNode& root, bool split)
+{
+  RC rc;
+  if((rc = root.read(rootPid, pf)) != 0) return rc;
+  root.level = treeHeight;
+  if(!split || root.n < 2*root.getT() - 1) return 0;
+
+  //new root
+  BTNode s;
+  s.isLeaf = false;
+  s.setFormat(root.format);
+  s.n = 0;
+  s.pids[0] = rootPid;
+  s.level = treeHeight + 1;
+  if((rc = BTNode::allocPage(ctx, pf, s.pid)) != 0) return rc;
+  rootPid = s.pid;
+  DEBUG('i',"New root:%d, height=%d\n",rootPid, treeHeight + 1);
+  if(s.level < MAX_TREE_HEIGHT) ctx.stats.levelPages[s.level] = 1;
+  if((rc = s.splitChild(0, ctx, pf)) != 0) return rc;
+  treeHeight ++;
+
+  if(DebugIsEnabled('i'))   printTree();
+  if((rc = root.read(rootPid, pf)) != 0) return rc;
+  root.level = treeHeight;
+  return 0;
+}
+
+/*
+ * Insert (key, rid) into its leaf, splitting the full nodes on the way down.
+ * @param key[IN] the key to insert
+ * @param rid[IN] the RecordId to insert
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::insertEntry(KeyType key, const RecordId& rid)
+{
+  RC rc;
+  BTNode root;
+  if((rc = readRoot(root, true)) != 0) return rc;
+  return root.insertNonFull(key, rid, ctx, pf);
+}
+
+/*
+ * Insert (key, rid) as a message into the buffer of the root node.
+ * Only when the root buffer is full, a batch of messages is flushed one
+ * level down, so most inserts write the root page only.
+ * @param key[IN] the key to insert
+ * @param rid[IN] the RecordId to insert
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::bufferEntry(KeyType key, const RecordId& rid)
+{
+  RC rc;
+  if(rootNode.pid != rootPid && (rc = readRoot(rootNode, false)) != 0) return rc;
+  while(rootNode.m >= BTNode::MESSAGES_PER_PAGE){
+      // flush() may have to split a child, which needs room in the root
+      if(rootNode.n == 2*rootNode.getT() - 1){
+          if((rc = rootNode.write(pf)) != 0) return rc;
+          if((rc = readRoot(rootNode, true)) != 0) return rc;
+      }
+      // flush() writes the root page as well
+      if((rc = rootNode.flush(ctx, pf)) != 0) return rc;
+      rootDirty = false;
+  }
+  rootNode.msgs[rootNode.m].key = key;
+  rootNode.msgs[rootNode.m].rid = rid;
+  rootNode.msgs[rootNode.m].op = BTNode::MSG_INSERT;
+  rootNode.m++;
+  rootDirty = true;
+  buffersFlushed = false;
+  return 0;
+}
+
+/*
+ * Write the cached root node of a buffered tree back to its page.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::writeRoot()
+{
+  RC rc;
+  if(rootNode.pid != rootPid || !rootDirty) return 0;
+  if((rc = rootNode.write(pf)) != 0) return rc;
+  rootDirty = false;
+  return 0;
+}
+
+// orders messages by key only, so that stable_sort keeps their age order
+static bool messageKeyLess(const BTMessage& a, const BTMessage& b)
+{
+  return a.key < b.key;
+}
+
+/*
+ * Apply all pending messages to the leaves.
+ * Messages for one key always sit on one root-to-leaf path, and a message
+ * deeper in the tree is older than one above it. So we collect them from
+ * the lowest non leaf level up, sort them by key keeping that order, and
+ * insert them with the normal top-down insert.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::flushBuffers()
+{
+    RC rc = 0;
+    vector< vector<BTMessage> > levels;
+    vector<BTMessage> all;
+    vector<PageId> level, next;
+    int h, i;
+
+    if(readOnlyMode) return RC_FILE_READ_ONLY;
+    if(!(options & BTNode::NODE_BUFFERED) || rootPid == -1) return 0;
+
+    // the inserts below change the root page behind the cached copy
+    if((rc = writeRoot()) != 0) goto ERROR;
+    rootNode.pid = -1;
+
+    level.push_back(rootPid);
+    for(h = treeHeight; h >= 1; h--){
+        levels.push_back(vector<BTMessage>());
+        next.clear();
+        for(size_t j = 0; j < level.size(); j++){
+            BTNode node;
+            if((rc = node.read(level[j], pf)) != 0) goto ERROR;
+            if(node.m > 0){
+                levels.back().insert(levels.back().end(), node.msgs, node.msgs + node.m);
+                node.m = 0;
+                if((rc = node.write(pf)) != 0) goto ERROR;
+            }
+            if(h > 1)
+                next.insert(next.end(), node.pids, node.pids + node.n + 1);
+        }
+        level.swap(next);
+    }
+
+    for(i = (int)levels.size() - 1; i >= 0; i--)
+        all.insert(all.end(), levels[i].begin(), levels[i].end());
+    stable_sort(all.begin(), all.end(), messageKeyLess);
+    for(size_t j = 0; j < all.size(); j++){
+        if((rc = insertEntry(all[j].key, all[j].rid)) != 0) goto ERROR;
+    }
+    buffersFlushed = true;
+    return 0;
+ERROR:
+    printf("flushBuffers error %d\n",rc);
+    return rc;
+}
+
+/*
+ * Remove the entry (key, rid) from the index.
+ * @param key[IN] the key of the entry
+ * @param rid[IN] the RecordId of the entry
+ * @return error code. RC_NO_SUCH_RECORD if there is no such entry
+ */
+RC BTreeIndex::remove(KeyType key, const RecordId& rid)
+{
+    RC rc;
+    BTNode root;
+    bool found;
+
+    if(readOnlyMode) return RC_FILE_READ_ONLY;
+    if(rootPid == -1) return RC_NO_SUCH_RECORD;
+    learned.clear();
+    // deletes are not buffered: the pending inserts are pushed down to
+    // the leaves first, where remove() can find them
+    if((options & BTNode::NODE_BUFFERED) && !buffersFlushed && (rc = flushBuffers()) != 0) return rc;
+
+    DEBUG('i',"\n************* Remove key:%d from Tree , RecordId={pid:%d, sid:%d} ******\n",key, rid.pid, rid.sid);
+    if((rc = readRoot(root, false)) != 0) return rc;
+    if((rc = root.remove(key, rid, ctx, pf, found)) != 0) return rc;
+    if(!found) return RC_NO_SUCH_RECORD;
+
+    // a root left with a single child is replaced by that child,
+    // but the tree keeps at least one non leaf level
+    while(root.n == 0 && treeHeight > 1){
+        PageId child = root.pids[0];
+        if((rc = BTNode::freePage(rootPid, ctx, pf)) != 0) return rc;
+        if(treeHeight < MAX_TREE_HEIGHT) ctx.stats.levelPages[treeHeight] = 0;
+        rootPid = child;
+        treeHeight--;
+        if((rc = readRoot(root, false)) != 0) return rc;
+    }
+
+    ctx.stats.entryCount--;
+    if(key == ctx.stats.minKey || key == ctx.stats.maxKey)
+        return updateMinMax();
+    return 0;
+}
+
+/*
+ * Remove all entries with lo <= key <= hi, a batch at a time.
+ * @param lo[IN] the smallest key to remove
+ * @param hi[IN] the largest key to remove
+ * @param count[OUT] the # entries removed
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::removeRange(KeyType lo, KeyType hi, int& count)
+{
+    RC rc;
+    IndexCursor cursor;
+    KeyType key;
+    RecordId rid;
+    vector<KeyType> keys;
+    vector<RecordId> rids;
+
+    count = 0;
+    if(readOnlyMode) return RC_FILE_READ_ONLY;
+    if(rootPid == -1 || lo > hi) return 0;
+    if((options & BTNode::NODE_BUFFERED) && !buffersFlushed && (rc = flushBuffers()) != 0) return rc;
+
+    for(;;){
+        keys.clear();
+        rids.clear();
+        if(ctx.stats.entryCount == 0) break;
+        if((rc = locate(lo, cursor)) != 0) return rc;
+        while(cursor.pid != -1 && (int)keys.size() < REMOVE_BATCH){
+            if((rc = readForward(cursor, key, rid)) != 0) return rc;
+            if(key > hi) break;
+            keys.push_back(key);
+            rids.push_back(rid);
+        }
+        if(keys.empty()) break;
+        for(size_t i = 0; i < keys.size(); i++){
+            if((rc = remove(keys[i], rids[i])) != 0) return rc;
+            count++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read the smallest and the largest key again after one of them was
+ * removed: the first entry of the leaf chain and the last entry of the
+ * right most leaf. Both are 0 once the tree is empty.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::updateMinMax()
+{
+    RC rc;
+    BTNode node;
+    IndexCursor cursor;
+    KeyType key;
+    RecordId rid;
+
+    // an empty tree has no keys; both go back to 0, as in a new index
+    if(ctx.stats.entryCount == 0){
+        ctx.stats.minKey = 0;
+        ctx.stats.maxKey = 0;
+        return 0;
+    }
+    if((rc = locate(INT_MIN, cursor)) != 0) return rc;
+    if(cursor.pid != -1){
+        if((rc = readForward(cursor, key, rid)) != 0) return rc;
+        ctx.stats.minKey = key;
+    }
+
+    if((rc = node.read(rootPid, pf)) != 0) return rc;
+    while(!node.isLeaf){
+        if((rc = node.read(node.pids[node.n], pf)) != 0) return rc;
+    }
+    if(node.n > 0) ctx.stats.maxKey = node.getKey(node.n - 1);
+    return 0;
+}
+
+/*
+ * A node of the tree in the key order of a defragment() pass.
+ */
+typedef struct {
+    PageId pid;     // the page of the node, -1 once compactLeaves() freed it
+    int    parent;  // the index of the parent node, -1 for the root
+    int    slot;    // pids[slot] of the parent points to the node
+    int    prev;    // the index of the leaf before it in the chain, -1 if none
+} DefragNode;
+
+/*
+ * State of one defragment() step: all nodes in key order, the leaves
+ * first, the node on every page, and the nodes changed by the step.
+ * A changed node is kept in memory until the end of the step, so a page
+ * on disk always holds the node of its last owner.
+ */
+typedef struct {
+    PageFile*          pf;
+    TreeContext*       ctx;
+    PageId*            rootPid;
+    int                leaves;  // order[0 .. leaves-1] are the leaves
+    vector<DefragNode> order;
+    map<PageId, int>   owner;
+    map<int, BTNode>   nodes;   // index in order -> changed node
+} DefragJob;
+
+/*
+ * List the nodes level by level from the root down; every level comes
+ * out in key order. Only the non leaf nodes are read.
+ */
+static RC defragPlan(DefragJob& job, PageId rootPid, int treeHeight)
+{
+    RC rc;
+    vector< vector<DefragNode> > levels(treeHeight + 1);
+    DefragNode root = { rootPid, -1, 0, -1 };
+    size_t base = 0, up;
+
+    levels[treeHeight].push_back(root);
+    for(int h = treeHeight; h >= 1; h--){
+        for(size_t j = 0; j < levels[h].size(); j++){
+            BTNode node;
+            if((rc = node.read(levels[h][j].pid, *job.pf)) != 0) return rc;
+            if(node.isLeaf) return RC_INVALID_FILE_FORMAT;
+            for(int i = 0; i <= node.n; i++){
+                DefragNode d = { node.pids[i], (int)j, i, -1 };
+                levels[h-1].push_back(d);
+            }
+        }
+    }
+
+    // parent indexes into the level above become indexes into order
+    job.leaves = (int)levels[0].size();
+    for(int h = 0; h <= treeHeight; h++){
+        up = base + levels[h].size();
+        for(size_t j = 0; j < levels[h].size(); j++){
+            DefragNode d = levels[h][j];
+            if(d.parent >= 0) d.parent += (int)up;
+            if(h == 0 && j > 0) d.prev = (int)j - 1;
+            job.owner[d.pid] = (int)job.order.size();
+            job.order.push_back(d);
+        }
+        base = up;
+    }
+    return 0;
+}
+
+static RC defragLoad(DefragJob& job, int i, BTNode*& node)
+{
+    RC rc;
+    map<int, BTNode>::iterator it = job.nodes.find(i);
+    if(it == job.nodes.end()){
+        it = job.nodes.insert(make_pair(i, BTNode())).first;
+        if((rc = it->second.read(job.order[i].pid, *job.pf)) != 0) return rc;
+    }
+    node = &it->second;
+    return 0;
+}
+
+/*
+ * Move node i to page t, and the node on page t to the old page of
+ * node i. Their parents and the leaves before them are pointed to the
+ * new pages.
+ */
+static RC defragSwap(DefragJob& job, int i, PageId t)
+{
+    RC rc;
+    BTNode* node;
+    PageId a = job.order[i].pid;
+    int x[2] = { i, job.owner[t] };
+
+    for(int k = 0; k < 2; k++){
+        if((rc = defragLoad(job, x[k], node)) != 0) return rc;
+        node->pid = job.order[x[k]].pid = (k == 0) ? t : a;
+        job.owner[node->pid] = x[k];
+    }
+    for(int k = 0; k < 2; k++){
+        const DefragNode& d = job.order[x[k]];
+        if(d.parent < 0){
+            *job.rootPid = d.pid;
+        }else{
+            if((rc = defragLoad(job, d.parent, node)) != 0) return rc;
+            node->pids[d.slot] = d.pid;
+        }
+        if(d.prev >= 0){
+            if((rc = defragLoad(job, d.prev, node)) != 0) return rc;
+            node->setNextNodePtr(d.pid);
+        }
+    }
+    if(job.ctx->cache){
+        job.ctx->cache->invalidate(a);
+        job.ctx->cache->invalidate(t);
+    }
+    return 0;
+}
+
+static RC defragWriteBack(DefragJob& job)
+{
+    RC rc;
+    for(map<int, BTNode>::iterator it = job.nodes.begin(); it != job.nodes.end(); ++it)
+        if((rc = it->second.write(job.order[it->first].pid, *job.pf)) != 0) return rc;
+    job.nodes.clear();
+    return 0;
+}
+
+/*
+ * One step of a defragment() pass. The nodes before defragPos were put
+ * in place by the earlier steps and took the smallest pages, so the next
+ * node gets the smallest page after them. The plan is made again in
+ * every step, as the tree may have changed between two steps; nodes a
+ * change moved away from their place are fixed by the next pass.
+ * @param fillFactor[IN] the fill of repacked leaves, 0 < fillFactor <= 1
+ * @param maxPages[IN] about the # pages the step may move
+ * @param done[OUT] whether the pass is over
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::defragment(double fillFactor, int maxPages, bool& done)
+{
+    RC rc;
+    DefragJob job;
+    set<PageId> pages;
+    set<PageId>::iterator it;
+    PageId last = 0;
+    int i, k, oldN, freed, placed = 0, moved = 0;
+
+    done = false;
+    if(readOnlyMode) return RC_FILE_READ_ONLY;
+    if(fillFactor <= 0 || fillFactor > 1) return RC_INVALID_ATTRIBUTE;
+    learned.clear();
+    if(rootPid == -1){
+        done = true;
+        return 0;
+    }
+    // the leaves are repacked with all their entries, and the root may
+    // move away from under the cached root node
+    if((options & BTNode::NODE_BUFFERED) && !buffersFlushed && (rc = flushBuffers()) != 0) return rc;
+    if((rc = writeRoot()) != 0) return rc;
+    rootNode.pid = -1;
+
+    job.pf = &pf;
+    job.ctx = &ctx;
+    job.rootPid = &rootPid;
+    if((rc = defragPlan(job, rootPid, treeHeight)) != 0) goto ERROR;
+    for(i = 0; i < (int)job.order.size(); i++)
+        pages.insert(job.order[i].pid);
+
+    for(k = 0; k < (int)job.order.size(); k++){
+        if(job.order[k].pid == -1) continue;
+        bool first = k < job.leaves && job.order[k].slot == 0;
+        if(placed >= defragPos){
+            // a step ends at the first leaf of a parent, so that the
+            // leaves of one parent are repacked all together
+            if(maxPages > 0 && moved >= maxPages && (first || k >= job.leaves)) break;
+            if(first && !(options & (BTNode::NODE_POSTING | BTNode::NODE_CLUSTERED))){
+                BTNode parent;
+                if((rc = defragWriteBack(job)) != 0) goto ERROR;
+                if((rc = parent.read(job.order[job.order[k].parent].pid, pf)) != 0) goto ERROR;
+                oldN = parent.n;
+                if((rc = parent.compactLeaves(fillFactor, ctx, pf, freed)) != 0) goto ERROR;
+                // the first children keep their pages, the others are free now
+                for(i = oldN + 1 - freed; i <= oldN; i++){
+                    pages.erase(job.order[k + i].pid);
+                    job.owner.erase(job.order[k + i].pid);
+                    job.order[k + i].pid = -1;
+                }
+                if(freed > 0 && k + oldN + 1 < job.leaves)
+                    job.order[k + oldN + 1].prev = k + oldN - freed;
+                if(freed > 0) moved += oldN + 2 - freed;
+            }
+        }
+        it = pages.upper_bound(last);
+        if(it == pages.end()) break;
+        if(placed >= defragPos && *it != job.order[k].pid){
+            if((rc = defragSwap(job, k, *it)) != 0) goto ERROR;
+            moved += 2;
+        }
+        last = *it;
+        placed++;
+    }
+    if((rc = defragWriteBack(job)) != 0) goto ERROR;
+
+    done = (k == (int)job.order.size());
+    defragPos = done ? 0 : placed;
+    // the swapped pages are not seen by the resident copy
+    if(inner.isEnabled() && (rc = inner.load(rootPid, treeHeight, pf)) != 0) goto ERROR;
+    DEBUG('i',"defragment: %d of %d nodes in place, %d pages moved\n",placed, (int)job.order.size(), moved);
+    return 0;
+ERROR:
+    inner.clear();
+    printf("defragment error %d\n",rc);
+    return rc;
+}
+
 /*
  * Find the leaf-node index entry whose key value is larger than or 
  * equal to searchKey, and output the location of the entry in IndexCursor.
@@ -199,6 +799,16 @@ RC BTreeIndex::locate(KeyType searchKey, IndexCursor& cursor) const
         printf("Empty Tree.\n");
         goto ERROR;
     }
+    if(learned.isEnabled()){
+        rc = learned.locate(searchKey, pf, cursor);
+        if(rc != 0) goto ERROR;
+        return 0;
+    }
+    if(inner.isEnabled()){
+        rc = inner.locate(searchKey, rootPid, treeHeight, pf, cursor);
+        if(rc != 0) goto ERROR;
+        return 0;
+    }
     rc = root.read(rootPid, pf);
     if(rc != 0) goto ERROR;
     rc = root.locate(searchKey, pf, cursor);
@@ -212,6 +822,266 @@ ERROR:
     return rc;
 }
 
+/*
+ * Point lookup: find the first index entry whose key equals searchKey.
+ * @param searchKey[IN] the key to find
+ * @param cursor[OUT] the cursor pointing to the first entry with the key
+ * @param rid[OUT] the RecordId of that entry
+ * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+ */
+RC BTreeIndex::find(KeyType searchKey, IndexCursor& cursor, RecordId& rid) const
+{
+    RC rc;
+    BTNode root;
+    IndexCursor next;
+    KeyType key;
+
+    cursor.pid = -1;
+    cursor.eid = -1;
+    if(rootPid == -1) return RC_NO_SUCH_RECORD;
+    if(bloom.isEnabled() && !bloom.mayContain(searchKey)) return RC_NO_SUCH_RECORD;
+    if(cache.isEnabled() && cache.lookup(searchKey, cursor, rid)) return 0;
+
+    if(learned.isEnabled()){
+        if((rc = learned.locate(searchKey, pf, cursor)) != 0) return rc;
+    }else if(inner.isEnabled()){
+        if((rc = inner.locate(searchKey, rootPid, treeHeight, pf, cursor)) != 0) return rc;
+    }else{
+        if((rc = root.read(rootPid, pf)) != 0) return rc;
+        root.level = treeHeight;
+        if((rc = root.locate(searchKey, pf, cursor)) != 0) return rc;
+    }
+    if(cursor.pid != -1){
+        next = cursor;
+        if((rc = readForward(next, key, rid)) != 0) return rc;
+        if(key == searchKey){
+            if(cache.isEnabled()) cache.put(searchKey, cursor, rid);
+            return 0;
+        }
+    }
+    cursor.pid = -1;
+    cursor.eid = -1;
+
+    // the key may still wait in a message buffer on its way down.
+    // The cached root holds messages not written to the root page yet.
+    if(options & BTNode::NODE_BUFFERED){
+        BTNode top(rootNode.pid == rootPid ? rootNode : root);
+        BTMessage msg;
+        bool found;
+        top.level = treeHeight;
+        if((rc = top.findMessage(searchKey, pf, msg, found)) != 0) return rc;
+        if(found && msg.op == BTNode::MSG_INSERT){
+            rid = msg.rid;
+            return 0;
+        }
+    }
+    return RC_NO_SUCH_RECORD;
+}
+
+/*
+ * Point lookup in a clustered index: find() gives the leaf entry of the
+ * key, and the value is read from the same leaf.
+ * @param searchKey[IN] the key to find
+ * @param value[OUT] the value of the key
+ * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+ */
+RC BTreeIndex::find(KeyType searchKey, string& value) const
+{
+    RC rc;
+    IndexCursor cursor;
+    RecordId rid;
+    KeyType key;
+
+    if(!(options & BTNode::NODE_CLUSTERED)) return RC_UNSUPPORTED_MODE;
+    if((rc = find(searchKey, cursor, rid)) != 0) return rc;
+    return readForward(cursor, key, value);
+}
+
+/*
+ * Read the rids of all entries with the key searchKey.
+ * A NODE_POSTING index keeps them together with the key in one leaf, or
+ * in the overflow pages of the key; other indexes scan the leaves.
+ * @param searchKey[IN] the key to find
+ * @param rids[OUT] the RecordIds of all entries with the key
+ * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+ */
+RC BTreeIndex::findAll(KeyType searchKey, vector<RecordId>& rids) const
+{
+    RC rc;
+    BTNode root, leaf;
+    IndexCursor cursor;
+    KeyType key;
+    RecordId rid;
+    int s;
+
+    rids.clear();
+    if(rootPid == -1) return RC_NO_SUCH_RECORD;
+    if(bloom.isEnabled() && !bloom.mayContain(searchKey)) return RC_NO_SUCH_RECORD;
+    if(learned.isEnabled()){
+        if((rc = learned.locate(searchKey, pf, cursor)) != 0) return rc;
+    }else if(inner.isEnabled()){
+        if((rc = inner.locate(searchKey, rootPid, treeHeight, pf, cursor)) != 0) return rc;
+    }else{
+        if((rc = root.read(rootPid, pf)) != 0) return rc;
+        if((rc = root.locate(searchKey, pf, cursor)) != 0) return rc;
+    }
+
+    if(options & BTNode::NODE_POSTING){
+        if(cursor.pid == -1) return RC_NO_SUCH_RECORD;
+        if((rc = leaf.read(cursor.pid, pf)) != 0) return rc;
+        for(s = 0; s < leaf.n && leaf.getKey(s) < searchKey; s++);
+        if(s == leaf.n || leaf.getKey(s) != searchKey) return RC_NO_SUCH_RECORD;
+        return leaf.readPostings(s, pf, rids);
+    }
+
+    while(cursor.pid != -1){
+        if((rc = readForward(cursor, key, rid)) != 0) return rc;
+        if(key != searchKey) break;
+        rids.push_back(rid);
+    }
+    return rids.empty() ? RC_NO_SUCH_RECORD : 0;
+}
+
+/*
+ * Build a Bloom filter over all keys of the index.
+ * @param bitsPerKey[IN] memory per key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::enableBloomFilter(int bitsPerKey)
+{
+    // leave room for inserts before the first rebuild
+    return buildBloomFilter(2 * ctx.stats.entryCount, bitsPerKey);
+}
+
+/*
+ * (Re)build the Bloom filter by walking the leaf chain from the left
+ * most leaf, reading every leaf once. In a NODE_BUFFERED tree the keys
+ * still waiting in the message buffers are added first: the non leaf
+ * levels are walked from the cached root, whose messages may not be
+ * on its page yet.
+ * @param capacity[IN] the number of keys to size the filter for
+ * @param bitsPerKey[IN] memory per key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::buildBloomFilter(int capacity, int bitsPerKey)
+{
+    RC rc;
+    BTNode node;
+    PageId pid = rootPid;
+    vector<PageId> level, next;
+    size_t j;
+    int i;
+
+    if(capacity < 1024) capacity = 1024;
+    if((rc = bloom.init(capacity, bitsPerKey)) != 0) return rc;
+    if(rootPid == -1) return 0;
+
+    if(options & BTNode::NODE_BUFFERED){
+        level.push_back(rootPid);
+        while(!level.empty()){
+            next.clear();
+            for(j = 0; j < level.size(); j++){
+                const BTNode* inner = &node;
+                if(level[j] == rootPid && rootNode.pid == rootPid) inner = &rootNode;
+                else if((rc = node.read(level[j], pf)) != 0) goto ERROR;
+                if(inner->isLeaf) break;
+                for(i = 0; i < inner->m; i++)
+                    bloom.add(inner->msgs[i].key);
+                for(i = 0; i <= inner->n; i++)
+                    next.push_back(inner->pids[i]);
+            }
+            if(j < level.size()) break;
+            level.swap(next);
+        }
+    }
+
+    do{
+        if((rc = node.read(pid, pf)) != 0) goto ERROR;
+        pid = node.pids[0];
+    }while(!node.isLeaf);
+
+    for(;;){
+        for(i = 0; i < node.n; i++)
+            bloom.add(node.getKey(i));
+        if((pid = node.getNextNodePtr()) == -1) break;
+        if((rc = node.read(pid, pf)) != 0) goto ERROR;
+    }
+    return 0;
+ERROR:
+    bloom.clear();
+    printf("buildBloomFilter error %d\n",rc);
+    return rc;
+}
+
+/*
+ * Walk the leaf chain once for the last key and page of every non-empty
+ * leaf, then fit the layer with error bounds 1, 2, 4, ... leaves until
+ * the model fits the budget. The runs of consecutive leaf pages do not
+ * shrink with the error bound, so they alone may be too big.
+ * @param budget[IN] memory budget of the model in bytes, 0 disables it
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::enableLearnedLayer(size_t budget)
+{
+    RC rc;
+    BTNode node;
+    PageId pid = rootPid;
+    vector<KeyType> lastKeys;
+    vector<PageId> pids;
+    int epsilon;
+
+    learned.clear();
+    if(budget == 0 || rootPid == -1) return 0;
+    // buffered inserts wait in the non leaf nodes the layer skips
+    if((options & BTNode::NODE_BUFFERED) && !buffersFlushed) return RC_UNSUPPORTED_MODE;
+
+    do{
+        if((rc = node.read(pid, pf)) != 0) return rc;
+        pid = node.pids[0];
+    }while(!node.isLeaf);
+    for(;;){
+        if(node.n > 0){
+            lastKeys.push_back(node.getKey(node.n - 1));
+            pids.push_back(node.pid);
+        }
+        if((pid = node.getNextNodePtr()) == -1) break;
+        if((rc = node.read(pid, pf)) != 0) return rc;
+    }
+    if(lastKeys.empty()) return 0;
+
+    for(epsilon = 1; ; epsilon *= 2){
+        learned.build(lastKeys, pids, epsilon);
+        if(learned.getMemoryBytes() <= budget) return 0;
+        if(learned.getSegmentCount() == 1) break;
+    }
+    printf("enableLearnedLayer: %d leaf runs do not fit in %d bytes, defragment() first\n",
+           learned.getRunCount(), (int)budget);
+    learned.clear();
+    return RC_UNSUPPORTED_MODE;
+}
+
+/*
+ * Read the non leaf levels into memory. The BTNode code hands every
+ * later write of a non leaf node to the copy through ctx.inner.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::enableInnerLevels()
+{
+    if(options & BTNode::NODE_BUFFERED) return RC_UNSUPPORTED_MODE;
+    return inner.load(rootPid, treeHeight, pf);
+}
+
+/*
+ * Keep the results of find() in an LRU cache.
+ * @param budget[IN] memory budget of the cache in bytes, 0 disables it
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::enableKeyCache(size_t budget)
+{
+    cache.init(budget);
+    return 0;
+}
+
 /*
  * Read the (key, rid) pair at the location specified by the index cursor,
  * and move foward the cursor to the next entry.
@@ -224,13 +1094,67 @@ RC BTreeIndex::readForward(IndexCursor& cursor, KeyType& key, RecordId& rid) con
 {
     RC rc;
     BTNode node;
+    PageId overflow;
     rc = node.read(cursor.pid, pf);
     if(rc != 0) goto ERROR;
 
+    // the rids of a hot key of a NODE_POSTING leaf are read from its
+    // overflow pages, after the last one the cursor goes to the next key
+    if(node.isLeaf && (overflow = node.getOverflowPage(cursor.eid)) != -1){
+        cursor.pid = overflow;
+        cursor.eid = 0;
+        rc = node.read(cursor.pid, pf);
+        if(rc != 0) goto ERROR;
+    }
+    if(node.format & BTNode::NODE_OVERFLOW){
+        if(cursor.eid < 0 || cursor.eid >= node.n) { rc = RC_INVALID_CURSOR; goto ERROR; }
+        key = node.pkeys[0];
+        rid = node.prids[0][cursor.eid];
+        cursor.eid ++;
+        if(cursor.eid >= node.n){
+            cursor.pid = node.getNextNodePtr();
+            cursor.eid = 0;
+            if(cursor.pid == -1 && key < INT_MAX && (rc = locate(key + 1, cursor)) != 0) goto ERROR;
+        }
+        return 0;
+    }
+
     if(!node.isLeaf) goto ERROR;
     rc = node.readEntry( cursor.eid, key, rid);
     if(rc != 0) goto ERROR;
 
+    cursor.eid ++;
+    if(cursor.eid >= node.getPositionCount()){
+        cursor.pid = node.getNextNodePtr();
+        cursor.eid = 0;
+    }
+    return 0;
+ERROR:
+    printf("readForward error\n");
+    return rc;
+}
+
+/*
+ * Read the (key, value) pair at the location specified by the index
+ * cursor of a clustered index, and move foward the cursor to the next entry.
+ * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+ * @param key[OUT] the key stored at the index cursor location.
+ * @param value[OUT] the value stored with the key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::readForward(IndexCursor& cursor, KeyType& key, string& value) const
+{
+    RC rc;
+    BTNode node;
+
+    if(!(options & BTNode::NODE_CLUSTERED)) return RC_UNSUPPORTED_MODE;
+    rc = node.read(cursor.pid, pf);
+    if(rc != 0) goto ERROR;
+    if(!node.isLeaf || cursor.eid < 0 || cursor.eid >= node.n) { rc = RC_INVALID_CURSOR; goto ERROR; }
+    key = node.getKey(cursor.eid);
+    rc = node.readValue(cursor.eid, pf, value);
+    if(rc != 0) goto ERROR;
+
     cursor.eid ++;
     if(cursor.eid >= node.n){
         cursor.pid = node.getNextNodePtr();
@@ -242,28 +1166,377 @@ ERROR:
     return rc;
 }
 
+/*
+ * Set the format options of a new index.
+ * @param options[IN] the BTNode::NODE_* format flags
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::setOptions(int opts)
+{
+    if(readOnlyMode) return RC_FILE_READ_ONLY;
+    // the format of the existing nodes cannot be changed
+    if(rootPid != -1) return RC_UNSUPPORTED_MODE;
+    if(opts & ~(BTNode::NODE_COUNTED | BTNode::NODE_BUFFERED | BTNode::NODE_POSTING | BTNode::NODE_CLUSTERED)) return RC_UNSUPPORTED_MODE;
+    // the subtree counts would not see the messages still in the buffers
+    if((opts & BTNode::NODE_COUNTED) && (opts & BTNode::NODE_BUFFERED)) return RC_UNSUPPORTED_MODE;
+    // posting leaves have no fixed entry slots to count or to buffer for
+    if((opts & BTNode::NODE_POSTING) && (opts & (BTNode::NODE_COUNTED | BTNode::NODE_BUFFERED))) return RC_UNSUPPORTED_MODE;
+    // clustered leaves hold every key once, so an insert may replace a
+    // value instead of adding an entry, and a buffered value has no leaf
+    if((opts & BTNode::NODE_CLUSTERED) && (opts & (BTNode::NODE_COUNTED | BTNode::NODE_BUFFERED | BTNode::NODE_POSTING))) return RC_UNSUPPORTED_MODE;
+    // the buffered root is not written through, see enableInnerLevels()
+    if((opts & BTNode::NODE_BUFFERED) && inner.isEnabled()) return RC_UNSUPPORTED_MODE;
+    options = opts;
+    return 0;
+}
+
+/*
+ * Compress the pages of a new index.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::enableCompression()
+{
+    if(readOnlyMode) return RC_FILE_READ_ONLY;
+    if(rootPid != -1) return RC_UNSUPPORTED_MODE;
+    return pf.enableCompression();
+}
+
+/*
+ * Count the entries with key < searchKey.
+ * @param searchKey[IN] the key to rank
+ * @param rank[OUT] the number of entries with a smaller key
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::rank(KeyType searchKey, int& rank) const
+{
+    RC rc;
+    BTNode root;
+    rank = 0;
+    if(rootPid == -1) return 0;
+    if(!(options & BTNode::NODE_COUNTED)) return RC_UNSUPPORTED_MODE;
+    if((rc = root.read(rootPid, pf)) != 0) return rc;
+    return root.rank(searchKey, false, pf, rank);
+}
+
+/*
+ * Find the k-th entry (counting from 0) in key order.
+ * @param k[IN] the position of the entry
+ * @param cursor[OUT] the cursor pointing to the entry
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::select(int k, IndexCursor& cursor) const
+{
+    RC rc;
+    BTNode root;
+    cursor.pid = -1;
+    cursor.eid = -1;
+    if(rootPid == -1) return 0;
+    if(!(options & BTNode::NODE_COUNTED)) return RC_UNSUPPORTED_MODE;
+    if((rc = root.read(rootPid, pf)) != 0) return rc;
+    return root.select(k, pf, cursor);
+}
+
+/*
+ * Count the entries with lo <= key <= hi as the difference of two ranks.
+ * @param lo[IN] the smallest key to count
+ * @param hi[IN] the largest key to count
+ * @param count[OUT] the number of entries in range
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::countRange(KeyType lo, KeyType hi, int& count) const
+{
+    RC rc;
+    BTNode root;
+    int below = 0, upto = 0;
+    count = 0;
+    if(rootPid == -1 || lo > hi) return 0;
+    if(!(options & BTNode::NODE_COUNTED)) return RC_UNSUPPORTED_MODE;
+    if((rc = root.read(rootPid, pf)) != 0) return rc;
+    if((rc = root.rank(lo, false, pf, below)) != 0) return rc;
+    if((rc = root.rank(hi, true, pf, upto)) != 0) return rc;
+    count = upto - below;
+    return 0;
+}
+
 KeyType BTreeIndex::getMinimumKey()
 {
-	BTNode btnode;
-	btnode.read(rootPid, pf);
-	while(!btnode.isLeaf)
-	{
-		PageId pid = btnode.pids[0];
-		btnode.read(pid, pf);
-	}
-	return btnode.keys[0];
+	return ctx.stats.minKey;
 }
 
 KeyType BTreeIndex::getMaximumKey()
 {
-	BTNode btnode;
-	btnode.read(rootPid, pf);
-	while(!btnode.isLeaf)
-	{
-		PageId pid = btnode.pids[btnode.n];
-		btnode.read(pid, pf);
-	}
-	return btnode.keys[btnode.n-1];
+	return ctx.stats.maxKey;
+}
+
+/*
+ * Rebuild the statistics by reading every node of the tree, level by level.
+ * Only needed for index files that do not have them in the header page.
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::computeStats()
+{
+    RC rc = 0;
+    vector<PageId> level, next;
+    int h, i;
+    bool first = true;
+    int freePages = ctx.stats.freePages;
+
+    memset(&ctx.stats, 0, sizeof(ctx.stats));
+    ctx.stats.freePages = freePages;
+    if(rootPid == -1) return 0;
+    level.push_back(rootPid);
+    for(h = treeHeight; h >= 0 && !level.empty(); h--){
+        next.clear();
+        if(h < MAX_TREE_HEIGHT) ctx.stats.levelPages[h] = level.size();
+        for(size_t j = 0; j < level.size(); j++){
+            BTNode node;
+            rc = node.read(level[j], pf);
+            if(rc != 0) goto ERROR;
+            if(!node.isLeaf){
+                for(i = 0; i <= node.n; i++)
+                    next.push_back(node.pids[i]);
+                continue;
+            }
+            // the leaves of a level are visited in key order
+            if(node.n == 0) continue;
+            if(first) ctx.stats.minKey = node.getKey(0);
+            ctx.stats.maxKey = node.getKey(node.n - 1);
+            ctx.stats.entryCount += node.getEntryCount();
+            first = false;
+        }
+        level.swap(next);
+    }
+    return 0;
+ERROR:
+    printf("computeStats error %d\n",rc);
+    return rc;
+}
+
+/*
+ * Cut [lo, hi] into at most parts sub-ranges at separator keys of the
+ * internal levels. bounds[j] is the first key of the j-th sub-range;
+ * the j-th sub-range ends right before bounds[j+1] (or at hi).
+ * We only go down one more level while the current level does not have
+ * enough separators, so at most a few internal pages are read.
+ * @param lo[IN] the smallest key of the range
+ * @param hi[IN] the largest key of the range
+ * @param parts[IN] the maximum number of sub-ranges
+ * @param bounds[OUT] the first key of every sub-range, bounds[0] == lo
+ * @return error code. 0 if no error
+ */
+RC BTreeIndex::partitionRange(KeyType lo, KeyType hi, int parts, vector<KeyType>& bounds) const
+{
+    RC rc = 0;
+    vector<PageId> level;    // the nodes of the current level overlapping [lo, hi]
+    vector<KeyType> seps;    // the separators in (lo, hi] of the current level
+    int i, h;
+
+    bounds.clear();
+    bounds.push_back(lo);
+    if(rootPid == -1 || parts <= 1) return 0;
+
+    level.push_back(rootPid);
+    for(h = 0; h < treeHeight; h++){
+        vector<PageId> next;
+        seps.clear();
+        for(size_t j = 0; j < level.size(); j++){
+            BTNode node;
+            rc = node.read(level[j], pf);
+            if(rc != 0) goto ERROR;
+            if(node.isLeaf) break;
+            for(i = 0; i <= node.n; i++){
+                // child i holds the keys between keys[i-1] and keys[i]
+                if(i > 0 && node.getKey(i-1) > hi) break;
+                if(i < node.n && node.getKey(i) < lo) continue;
+                next.push_back(node.pids[i]);
+                if(i < node.n && node.getKey(i) > lo && node.getKey(i) <= hi)
+                    seps.push_back(node.getKey(i));
+            }
+        }
+        // the children of the last internal level are leaves
+        if((int)seps.size() + 1 >= parts || h + 1 == treeHeight) break;
+        level.swap(next);
+    }
+
+    // duplicate keys may repeat a separator on the same level
+    seps.erase(unique(seps.begin(), seps.end()), seps.end());
+    if((int)seps.size() < parts){
+        bounds.insert(bounds.end(), seps.begin(), seps.end());
+    }else{
+        // pick parts-1 evenly spaced separators
+        for(i = 1; i < parts; i++)
+            bounds.push_back(seps[(size_t)i * seps.size() / parts]);
+    }
+    return 0;
+ERROR:
+    printf("partitionRange error %d\n",rc);
+    return rc;
+}
+
+/*
+ * Shared state of the workers of one parallel scan.
+ */
+typedef struct {
+    const string*          indexName;
+    PageId                 rootPid;
+    const vector<KeyType>* bounds;
+    KeyType                hi;
+    ScanCallback           callback;
+    void*                  arg;
+    vector<ScanBatch>*     batches;   // NULL when results go to callback
+    atomic<int>            nextPart;  // the next partition to hand out
+    atomic<bool>           stop;      // set when a worker fails or callback says stop
+    atomic<int>            rc;        // the first error code
+} ScanJob;
+
+/*
+ * Scan one partition, [lo, hi) or [lo, hi] if last, with a private
+ * PageFile. Every leaf page is read once.
+ */
+static bool scanEntry(ScanJob* job, ScanBatch* batch, int worker, KeyType key, const RecordId& rid)
+{
+    if(batch){
+        batch->keys.push_back(key);
+        batch->rids.push_back(rid);
+    }else if(job->callback(worker, key, rid, job->arg) != 0){
+        job->stop = true;
+        return false;
+    }
+    return true;
+}
+
+static RC scanPartition(ScanJob* job, const PageFile& pf, int worker, int part)
+{
+    RC rc;
+    BTNode node;
+    IndexCursor cursor;
+    KeyType key;
+    RecordId rid;
+    bool last = (part + 1 == (int)job->bounds->size());
+    KeyType lo = (*job->bounds)[part];
+    KeyType hi = last ? job->hi : (*job->bounds)[part+1];
+    ScanBatch* batch = job->batches ? &(*job->batches)[part] : NULL;
+
+    if(batch) batch->lo = lo;
+    if((rc = node.read(job->rootPid, pf)) != 0) return rc;
+    if((rc = node.locate(lo, pf, cursor)) != 0) return rc;
+
+    while(cursor.pid != -1){
+        if(job->stop) return 0;
+        if((rc = node.read(cursor.pid, pf)) != 0) return rc;
+        if(node.format & BTNode::NODE_POSTING){
+            // all rids of a key at once, from the leaf or its overflow pages
+            vector<RecordId> rids;
+            for(int s = 0; s < node.n; s++){
+                key = node.getKey(s);
+                if(key < lo) continue;
+                if(key > hi || (!last && key == hi)) return 0;
+                if((rc = node.readPostings(s, pf, rids)) != 0) return rc;
+                for(size_t j = 0; j < rids.size(); j++)
+                    if(!scanEntry(job, batch, worker, key, rids[j])) return 0;
+            }
+        }else{
+            for(; cursor.eid < node.n; cursor.eid++){
+                if((rc = node.readEntry(cursor.eid, key, rid)) != 0) return rc;
+                if(key > hi || (!last && key == hi)) return 0;
+                if(!scanEntry(job, batch, worker, key, rid)) return 0;
+            }
+        }
+        cursor.pid = node.getNextNodePtr();
+        cursor.eid = 0;
+    }
+    return 0;
+}
+
+/*
+ * Worker thread body: take partitions until none is left.
+ * PageFile::read seeks and reads on the file descriptor, so every
+ * worker needs its own handle on the index file.
+ */
+static void scanWorker(ScanJob* job, int worker)
+{
+    RC rc;
+    PageFile pf;
+    int part;
+
+    if((rc = pf.open(*job->indexName, 'r')) != 0){
+        job->rc = rc;
+        job->stop = true;
+        return;
+    }
+    while(!job->stop && (part = job->nextPart++) < (int)job->bounds->size()){
+        if((rc = scanPartition(job, pf, worker, part)) != 0){
+            job->rc = rc;
+            job->stop = true;
+        }
+    }
+    pf.close();
+}
+
+static RC runParallelScan(ScanJob* job, int workers)
+{
+    vector<thread> pool;
+    int i;
+    for(i = 0; i < workers; i++)
+        pool.push_back(thread(scanWorker, job, i));
+    for(i = 0; i < workers; i++)
+        pool[i].join();
+    return job->rc;
+}
+
+/*
+ * Scan all entries with lo <= key <= hi using several threads.
+ * We make a few more partitions than workers, so that a worker that
+ * finishes early can take over a partition another one has not started.
+ */
+RC BTreeIndex::parallelScan(KeyType lo, KeyType hi, int workers, ScanCallback callback, void* arg) const
+{
+    RC rc;
+    vector<KeyType> bounds;
+    ScanJob job;
+
+    if(rootPid == -1 || lo > hi) return 0;
+    if(workers <= 0) workers = max(1, (int)thread::hardware_concurrency());
+    if((rc = partitionRange(lo, hi, workers * 4, bounds)) != 0) return rc;
+    workers = min(workers, (int)bounds.size());
+
+    job.indexName = &indexName;
+    job.rootPid = rootPid;
+    job.bounds = &bounds;
+    job.hi = hi;
+    job.callback = callback;
+    job.arg = arg;
+    job.batches = NULL;
+    job.nextPart = 0;
+    job.stop = false;
+    job.rc = 0;
+    return runParallelScan(&job, workers);
+}
+
+RC BTreeIndex::parallelScan(KeyType lo, KeyType hi, int workers, vector<ScanBatch>& batches) const
+{
+    RC rc;
+    vector<KeyType> bounds;
+    ScanJob job;
+
+    batches.clear();
+    if(rootPid == -1 || lo > hi) return 0;
+    if(workers <= 0) workers = max(1, (int)thread::hardware_concurrency());
+    if((rc = partitionRange(lo, hi, workers * 4, bounds)) != 0) return rc;
+    workers = min(workers, (int)bounds.size());
+    batches.resize(bounds.size());
+
+    job.indexName = &indexName;
+    job.rootPid = rootPid;
+    job.bounds = &bounds;
+    job.hi = hi;
+    job.callback = NULL;
+    job.arg = NULL;
+    job.batches = &batches;
+    job.nextPart = 0;
+    job.stop = false;
+    job.rc = 0;
+    return runParallelScan(&job, workers);
 }
 
 RC BTreeIndex::printTree()
@@ -342,3 +1615,62 @@ static void setTreeHeight(char* page, int height)
   memcpy(page+sizeof(PageId), &height, sizeof(int));
 }
 
+
+static int getIndexOptions(const char* page)
+{
+  int options;
+
+  // the third four bytes of a page contains the node format options
+  memcpy(&options, page+sizeof(PageId)+sizeof(int), sizeof(int));
+  return options;
+}
+
+
+static void setIndexOptions(char* page, int options)
+{
+  // the third four bytes of a page contains the node format options
+  memcpy(page+sizeof(PageId)+sizeof(int), &options, sizeof(int));
+}
+
+// the statistics follow a marker, which is missing in older index files
+static const int STATS_MAGIC = 0x53545431;
+
+static bool getTreeStats(const char* page, TreeStats& stats)
+{
+  int magic;
+
+  // the fourth four bytes of a page contains STATS_MAGIC,
+  // followed by the TreeStats structure
+  memcpy(&magic, page+sizeof(PageId)+2*sizeof(int), sizeof(int));
+  if (magic != STATS_MAGIC) return false;
+  memcpy(&stats, page+sizeof(PageId)+3*sizeof(int), sizeof(TreeStats));
+  return true;
+}
+
+
+static void setTreeStats(char* page, const TreeStats& stats)
+{
+  // the fourth four bytes of a page contains STATS_MAGIC,
+  // followed by the TreeStats structure
+  memcpy(page+sizeof(PageId)+2*sizeof(int), &STATS_MAGIC, sizeof(int));
+  memcpy(page+sizeof(PageId)+3*sizeof(int), &stats, sizeof(TreeStats));
+}
+
+
+static PageId getFreeListHead(const char* page)
+{
+  PageId pid;
+
+  // the free list head follows the TreeStats structure.
+  // It is 0 (the header page) if the list is empty, which is also
+  // what older index files hold there.
+  memcpy(&pid, page+sizeof(PageId)+3*sizeof(int)+sizeof(TreeStats), sizeof(PageId));
+  return pid;
+}
+
+
+static void setFreeListHead(char* page, PageId pid)
+{
+  // the free list head follows the TreeStats structure
+  memcpy(page+sizeof(PageId)+3*sizeof(int)+sizeof(TreeStats), &pid, sizeof(PageId));
+}
@@ -5,6 +5,34 @@
 #include "PageFile.h"
 #include "RecordFile.h"
 #include "BTreeNode.h" 
+#include "BloomFilter.h"
+#include "KeyCache.h"
+#include "LearnedLayer.h"
+#include "InnerLevels.h"
+#include <vector>
+
+/**
+ * Callback used by BTreeIndex::parallelScan to hand the (key, rid) pairs
+ * read by a worker to the caller. It is called from the worker threads,
+ * so it must be safe to call concurrently for different worker ids.
+ * Entries of one partition are delivered in key order by a single worker.
+ * @param worker[IN] the id of the worker thread (0 .. workers-1)
+ * @param key[IN] the key of the entry
+ * @param rid[IN] the RecordId of the entry
+ * @param arg[IN] the user argument passed to parallelScan
+ * @return 0 to continue. Any other value stops the whole scan.
+ */
+typedef RC (*ScanCallback)(int worker, KeyType key, const RecordId& rid, void* arg);
+
+/**
+ * The entries of one key range partition of a parallel scan, in key order.
+ */
+typedef struct {
+  KeyType lo;                    // first key of the partition (inclusive)
+  std::vector<KeyType>  keys;
+  std::vector<RecordId> rids;
+} ScanBatch;
+
 /**
  * Implements a B-Tree index for BPBase.
  * 
@@ -36,6 +64,59 @@ class BTreeIndex {
    */
   RC insert(KeyType key, const RecordId& rid);
 
+  /**
+   * Insert (key, value) pair to a BTNode::NODE_CLUSTERED index, or
+   * replace the value if the key is there already. The value is kept in
+   * the leaf of the key, a value longer than BTNode::VALUE_INLINE_BYTES
+   * in a chain of value pages hanging off the leaf, so there is no
+   * record file and no RecordId to follow.
+   * @param key[IN] the key
+   * @param value[IN] the value stored with the key
+   * @return error code. RC_UNSUPPORTED_MODE if the index is not clustered
+   */
+  RC insert(KeyType key, const std::string& value);
+
+  /**
+   * Remove the (key, RecordId) pair from the index.
+   * Nodes are merged lazily: only a node that drops below a quarter full
+   * is merged with a sibling or refilled from it. The pages of merged
+   * nodes go to a free list in the index file and are used again by
+   * later splits. With BTNode::NODE_BUFFERED the pending inserts are
+   * flushed to the leaves first (see flushBuffers()). A
+   * BTNode::NODE_CLUSTERED index removes the key with its value pages
+   * and does not compare the rid.
+   * @param key[IN] the key of the entry to remove
+   * @param rid[IN] the RecordId of the entry to remove
+   * @return error code. RC_NO_SUCH_RECORD if there is no such entry
+   */
+  RC remove(KeyType key, const RecordId& rid);
+
+  /**
+   * Remove all entries with lo <= key <= hi.
+   * @param lo[IN] the smallest key to remove
+   * @param hi[IN] the largest key to remove
+   * @param count[OUT] the number of entries removed
+   * @return error code. 0 if no error
+   */
+  RC removeRange(KeyType lo, KeyType hi, int& count);
+
+  /**
+   * Reorganize the index on disk a step at a time, so that a leaf scan
+   * reads the file forward again. The index can be used as usual between
+   * two steps.
+   * A pass walks the nodes in key order, the leaves first and then the
+   * non leaf levels, and moves the i-th node to the i-th smallest page of
+   * the tree, swapping it with the node found there. Before the leaves
+   * under one bottom non leaf node are moved, they are repacked into
+   * fewer leaves if they are filled below fillFactor (NODE_POSTING leaves
+   * are only moved). Every step reads the non leaf nodes once.
+   * @param fillFactor[IN] the fill of repacked leaves, 0 < fillFactor <= 1
+   * @param maxPages[IN] about the # pages a step may move, <= 0 for the whole pass
+   * @param done[OUT] whether the pass is over; the next call starts a new one
+   * @return error code. 0 if no error
+   */
+  RC defragment(double fillFactor, int maxPages, bool& done);
+
   /**
    * Find the leaf-node index entry whose key value is larger than or
    * equal to searchKey and output its location (i.e., the page id of the node
@@ -51,6 +132,8 @@ class BTreeIndex {
    * associated with the searchKey.
    * Using the returned "IndexCursor", you will have to call readForward()
    * to retrieve the actual (key, rid) pair from the index.
+   * With BTNode::NODE_BUFFERED, entries still waiting in a message buffer
+   * are not seen by the leaf scan; call flushBuffers() first.
    * @param key[IN] the key to find
    * @param cursor[OUT] the cursor pointing to the first index entry
    * with the key value
@@ -58,6 +141,114 @@ class BTreeIndex {
    */
   RC locate(KeyType searchKey, IndexCursor& cursor) const ;
 
+  /**
+   * Point lookup: find the first index entry whose key equals searchKey.
+   * When the Bloom filter is enabled it is checked first, so most
+   * lookups of absent keys return without reading any page. When the
+   * key cache is enabled, a cached key is returned without reading any
+   * page either.
+   * @param searchKey[IN] the key to find
+   * With BTNode::NODE_BUFFERED, the message buffers on the search path
+   * are checked as well.
+   * @param cursor[OUT] the cursor pointing to the first entry with the key,
+   *                    cursor.pid = -1 if the entry is still in a buffer
+   * @param rid[OUT] the RecordId of that entry
+   * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+   */
+  RC find(KeyType searchKey, IndexCursor& cursor, RecordId& rid) const;
+
+  /**
+   * Read the RecordIds of all entries with the key searchKey.
+   * With BTNode::NODE_POSTING they are read from the one leaf holding the
+   * key, or from its overflow pages, in RecordId order.
+   * @param searchKey[IN] the key to find
+   * @param rids[OUT] the RecordIds of all entries with the key
+   * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+   */
+  RC findAll(KeyType searchKey, std::vector<RecordId>& rids) const;
+
+  /**
+   * Point lookup in a BTNode::NODE_CLUSTERED index, like find() above
+   * (Bloom filter, key cache, learned layer and resident non leaf levels
+   * are used the same way), reading the value from the leaf of the key.
+   * @param searchKey[IN] the key to find
+   * @param value[OUT] the value of the key
+   * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+   */
+  RC find(KeyType searchKey, std::string& value) const;
+
+  /**
+   * Push every pending message of a BTNode::NODE_BUFFERED index down to
+   * the leaves, so that locate()/readForward() see all entries.
+   * Note that a buffered index keeps its root node in memory and writes
+   * it back when the root buffer is flushed and on close().
+   * @return error code. 0 if no error
+   */
+  RC flushBuffers();
+
+  /**
+   * Build a Bloom filter over all keys of the index and keep it up to
+   * date on insert. The filter is saved next to the index file
+   * (indexname + ".blm") on close and loaded again by open.
+   * @param bitsPerKey[IN] memory per key, 10 bits give ~1% false positives
+   * @return error code. 0 if no error
+   */
+  RC enableBloomFilter(int bitsPerKey);
+
+  /**
+   * @return the Bloom filter, for its probe and negative counters
+   */
+  const BloomFilter& getBloomFilter() const { return bloom; }
+
+  /**
+   * Cache the results of find() (key -> leaf entry and RecordId) in
+   * memory, for skewed lookup traffic. Entries of a leaf are dropped
+   * when the leaf changes. The cache is not saved on close.
+   * @param budget[IN] memory budget of the cache in bytes, 0 disables it
+   * @return error code. 0 if no error
+   */
+  RC enableKeyCache(size_t budget);
+
+  /**
+   * @return the key cache, for its hit and miss counters
+   */
+  const KeyCache& getKeyCache() const { return cache; }
+
+  /**
+   * Fit a LearnedLayer over the leaves, so that locate(), find() and
+   * findAll() go straight to a leaf instead of reading the non leaf
+   * nodes. The smallest error bound whose model fits the budget is
+   * taken. The layer is read-only: any change to the index drops it,
+   * and it is not saved on close. Best after defragment(), which puts
+   * the leaves on consecutive pages.
+   * @param budget[IN] memory budget of the model in bytes, 0 disables it
+   * @return error code. RC_UNSUPPORTED_MODE if the leaves are too
+   *         scattered over the file for the budget, or if inserts wait
+   *         in the buffers of a NODE_BUFFERED index
+   */
+  RC enableLearnedLayer(size_t budget);
+
+  /**
+   * @return the learned layer, for its size and read counters
+   */
+  const LearnedLayer& getLearnedLayer() const { return learned; }
+
+  /**
+   * Keep all non leaf nodes in memory, with their child PageIds swizzled
+   * into pointers, so that locate(), find() and findAll() read the leaf
+   * only. Unlike the learned layer the copy follows inserts and removes;
+   * the pages are still written as before, so the file is always up to
+   * date. The copy is dropped on close, call this again after open().
+   * @return error code. RC_UNSUPPORTED_MODE for a NODE_BUFFERED index,
+   *         whose root node is written back lazily
+   */
+  RC enableInnerLevels();
+
+  /**
+   * @return the resident non leaf nodes, for their size and read counters
+   */
+  const InnerLevels& getInnerLevels() const { return inner; }
+
   /**
    * Read the (key, rid) pair at the location specified by the index cursor,
    * and move foward the cursor to the next entry.
@@ -67,19 +258,145 @@ class BTreeIndex {
    * @return error code. 0 if no error
    */
   RC readForward(IndexCursor& cursor, KeyType& key, RecordId& rid) const;
+
+  /**
+   * Read the (key, value) pair at the location specified by the index
+   * cursor of a BTNode::NODE_CLUSTERED index, and move foward the cursor
+   * to the next entry. A range scan is locate() and then readForward()
+   * until the key is out of range; the readForward() above gives the
+   * keys only, with rid {-1, -1}.
+   * @param cursor[IN/OUT] the cursor pointing to an leaf-node index entry in the b+tree
+   * @param key[OUT] the key stored at the index cursor location
+   * @param value[OUT] the value stored with the key
+   * @return error code. 0 if no error
+   */
+  RC readForward(IndexCursor& cursor, KeyType& key, std::string& value) const;
   
 
+  /**
+   * Set the format options of a new index: a combination of the
+   * BTNode::NODE_* format flags, e.g. BTNode::NODE_COUNTED to keep the entry
+   * count of every subtree in the non leaf nodes (needed by rank(),
+   * select() and countRange()), BTNode::NODE_BUFFERED for the write
+   * optimized tree whose non leaf nodes buffer inserts (see flushBuffers()),
+   * or BTNode::NODE_POSTING for leaves that store every distinct key once
+   * with its delta encoded rids (for keys with many duplicates; the
+   * entries of one key are then returned in RecordId order), or
+   * BTNode::NODE_CLUSTERED for an index whose leaves store a value with
+   * every key instead of a RecordId (see insert(key, value)).
+   * The options are saved in the header page, so they can only be set
+   * before the first insert.
+   * @param options[IN] the NODE_* format flags
+   * @return error code. 0 if no error
+   */
+  RC setOptions(int options);
+
+  /**
+   * @return the format options of the index
+   */
+  int getOptions() const { return options; }
+
+  /**
+   * Store the pages of a new index compressed, see
+   * PageFile::enableCompression(). Only before the first insert; an
+   * index file that is compressed stays compressed when opened again.
+   * @return error code. 0 if no error
+   */
+  RC enableCompression();
+
+  /**
+   * @return # bytes the index file takes on disk
+   */
+  long long getStoredBytes() const { return pf.getStoredBytes(); }
+
+  /**
+   * Count the entries with key < searchKey in O(height) page reads.
+   * Needs the BTNode::NODE_COUNTED option.
+   * @param searchKey[IN] the key to rank
+   * @param rank[OUT] the number of entries with a smaller key
+   * @return error code. 0 if no error
+   */
+  RC rank(KeyType searchKey, int& rank) const;
+
+  /**
+   * Find the k-th entry (counting from 0) in key order in O(height)
+   * page reads. Use readForward() to read the entry.
+   * Needs the BTNode::NODE_COUNTED option.
+   * @param k[IN] the position of the entry
+   * @param cursor[OUT] the cursor pointing to the entry, cursor.pid = -1
+   *                    if the index has k or less entries
+   * @return error code. 0 if no error
+   */
+  RC select(int k, IndexCursor& cursor) const;
+
+  /**
+   * Count the entries with lo <= key <= hi in O(height) page reads.
+   * Needs the BTNode::NODE_COUNTED option.
+   * @param lo[IN] the smallest key to count
+   * @param hi[IN] the largest key to count
+   * @param count[OUT] the number of entries in range
+   * @return error code. 0 if no error
+   */
+  RC countRange(KeyType lo, KeyType hi, int& count) const;
+
   /**
   *get the value of the minimum key, it is the first key in the left most leafNode.
-  *Design: read the value from disk each time when function is called, to avoid updating when INSERT/DELETE. Here I assume that this function will not be called frequently. 
+  *Design: the value is kept in the header page and updated on every INSERT and REMOVE, so no page is read.
+  *An empty index (also one whose last entry was removed) returns 0.
   */
   KeyType getMinimumKey();
   /**
   *get the value of the maximum key, it is the last key in the right most leafNode.
+  *An empty index returns 0, like getMinimumKey().
   */
   KeyType getMaximumKey();
 
-  int newPid;
+  /**
+   * Return the statistics kept in the header page: min/max key,
+   * # entries, # nodes on every level (levelPages[0] is # leaves) and
+   * # pages on the free list.
+   * No page is read.
+   * @return the statistics of the tree
+   */
+  const TreeStats& getStats() const { return ctx.stats; }
+
+  /**
+   * @return the PageId of the root node, -1 if the index is empty
+   */
+  PageId getRoot() const { return rootPid; }
+
+  /**
+   * @return the # non leaf levels of the tree
+   */
+  int getHeight() const { return treeHeight; }
+
+  /**
+   * Scan all entries with lo <= key <= hi using several threads.
+   * The key range is cut into sub-ranges at the separator keys of the
+   * upper internal levels, so that every sub-range covers roughly the
+   * same number of leaves. The sub-ranges are handed out to a pool of
+   * worker threads; each worker opens its own read handle on the index
+   * file and walks its own segment of the leaf chain.
+   * With BTNode::NODE_BUFFERED, entries still waiting in a message buffer
+   * are not seen by the leaf scan; call flushBuffers() first.
+   * @param lo[IN] the smallest key to scan
+   * @param hi[IN] the largest key to scan
+   * @param workers[IN] the number of worker threads (<= 0: one per core)
+   * @param callback[IN] called for every entry in range, see ScanCallback
+   * @param arg[IN] passed through to callback
+   * @return error code. 0 if no error
+   */
+  RC parallelScan(KeyType lo, KeyType hi, int workers, ScanCallback callback, void* arg) const;
+
+  /**
+   * Same as above, but collects the entries in ordered batches:
+   * batches[0], batches[1], ... concatenated give all entries in range
+   * in key order. As above, call flushBuffers() first with
+   * BTNode::NODE_BUFFERED.
+   * @param batches[OUT] one batch per key range partition
+   */
+  RC parallelScan(KeyType lo, KeyType hi, int workers, std::vector<ScanBatch>& batches) const;
+
   RC printTree();
  private:
   PageFile pf;         /// the PageFile used to store the actual b+tree in disk
@@ -87,14 +404,35 @@ class BTreeIndex {
 
   PageId   rootPid;    /// the PageId of the root node
   int      treeHeight; /// the height of the tree
+  int      options;    /// BTNode::NODE_* format flags of the nodes
+  TreeContext ctx;     /// the next free page id and the tree statistics
+  BloomFilter bloom;   /// filter over all keys, empty when not enabled
+  mutable KeyCache cache; /// find() results, empty when not enabled
+  mutable LearnedLayer learned; /// model of the leaf level, empty when not enabled
+  mutable InnerLevels inner;    /// resident non leaf nodes, empty when not enabled
+  BTNode   rootNode;   /// cached root of a NODE_BUFFERED tree (rootNode.pid == rootPid)
+  bool     rootDirty;  /// rootNode has messages not written to its page yet
+  bool     buffersFlushed; /// no message was buffered since flushBuffers()
+  int      defragPos;  /// # nodes the current defragment() pass has put in place
   int      pageNum;
   PageId   nextPid;
+  std::string indexName; /// the name of the index file, for extra read handles
 
   /// Note that the content of the above two variables will be gone when
   /// this class is destructed. Make sure to store the values of the two 
   /// variables in disk, so that they can be reconstructed when the index
   /// is opened again later.
   RC findLeafNode(KeyType, PageId&);
+  RC computeStats();
+  RC readRoot(BTNode& root, bool split);
+  RC createTree(KeyType key);
+  RC addKey(KeyType key);
+  RC insertEntry(KeyType key, const RecordId& rid);
+  RC bufferEntry(KeyType key, const RecordId& rid);
+  RC writeRoot();
+  RC updateMinMax();
+  RC buildBloomFilter(int capacity, int bitsPerKey);
+  RC partitionRange(KeyType lo, KeyType hi, int parts, std::vector<KeyType>& bounds) const;
 };
 
 #endif /* BTREEINDEX_H */
@@ -1,29 +1,78 @@
 #include "BTreeNode.h"
+#include "KeyCache.h"
+#include "InnerLevels.h"
+#include <vector>
+#include <algorithm>
 
 using namespace std;
+
+// keep the resident copy of a non leaf node in step with its page
+static void updateInner(TreeContext& ctx, BTNode& node)
+{
+    if(ctx.inner && !node.isLeaf) ctx.inner->update(node);
+}
+
 BTNode::BTNode()
 {
     n = 0;
     isLeaf = false;
+    format = 0;
     nextPage = -1;
     pid = -1;
+    level = -1;
+    m = 0;
     memset(buffer,0,PageFile::PAGE_SIZE);
-    keys = (KeyType *)(buffer + sizeof(bool) + sizeof(int) +sizeof(int));
-    rids = (RecordId *)(keys + KEYS_PER_LEAF_PAGE);
-    pids = (PageId *)(keys +  KEYS_PER_NONLEAF_PAGE);
+    setLayout();
 }
 BTNode::BTNode(const BTNode& n)
 {
     this->n = n.n;
     this->isLeaf = n.isLeaf;
+    this->format = n.format;
     this->nextPage = n.nextPage;
     this->pid = n.pid;
+    this->level = n.level;
+    this->m = n.m;
+    this->pkeys = n.pkeys;
+    this->pcounts = n.pcounts;
+    this->prids = n.prids;
+    this->pheads = n.pheads;
+    this->ptails = n.ptails;
+    this->pvalues = n.pvalues;
     memcpy(this->buffer, n.buffer, PageFile::PAGE_SIZE);
+    setLayout();
+
+}
+
+/*
+ * Point the entry arrays into the page buffer.
+ * Leaf: keys[KEYS_PER_LEAF_PAGE], rids[KEYS_PER_LEAF_PAGE]
+ * Non leaf: keys[K], pids[K+1] (and counts[K+1] in NODE_COUNTED format,
+ * or the message count and msgs[MESSAGES_PER_PAGE] in NODE_BUFFERED format)
+ */
+void BTNode::setLayout()
+{
     keys = (KeyType *)(buffer + sizeof(bool) + sizeof(int) +sizeof(int));
     rids = (RecordId *)(keys + KEYS_PER_LEAF_PAGE);
-    pids = (PageId *)(keys +  KEYS_PER_NONLEAF_PAGE);
+    counts = NULL;
+    msgs = NULL;
+    if(format & NODE_COUNTED){
+        pids = (PageId *)(keys + KEYS_PER_COUNTED_NONLEAF_PAGE);
+        counts = (int *)(pids + KEYS_PER_COUNTED_NONLEAF_PAGE + 1);
+    }else if(format & NODE_BUFFERED){
+        pids = (PageId *)(keys + KEYS_PER_BUFFERED_NONLEAF_PAGE);
+        msgs = (BTMessage *)((char *)(pids + KEYS_PER_BUFFERED_NONLEAF_PAGE + 1) + sizeof(int));
+    }else{
+        pids = (PageId *)(keys + KEYS_PER_NONLEAF_PAGE);
+    }
+}
 
+void BTNode::setFormat(unsigned char f)
+{
+    format = f & ~NODE_LEAF;
+    setLayout();
 }
+
 /*
  * Read the content of the node from the page pid in the PageFile pf.
  * @param pid[IN] the PageId to read
@@ -37,10 +86,22 @@ RC BTNode::read(PageId p, const PageFile& pf)
     if ((rc = pf.read(p, buffer)) < 0) return rc;
     this->pid = p;
     
-    // the second four bytes of a page contains # keys in the page
-    memcpy(&isLeaf, buffer, sizeof(bool));
+    // the first byte holds the leaf flag and the format flags,
+    // the next four bytes contains # keys in the page
+    isLeaf = (buffer[0] & NODE_LEAF) != 0;
+    format = buffer[0] & ~NODE_LEAF;
+    setLayout();
+    m = 0;
+    // the message count is stored right before the messages
+    if(!isLeaf && (format & NODE_BUFFERED))
+        memcpy(&m, (char *)msgs - sizeof(int), sizeof(int));
     memcpy(&n, buffer+sizeof(bool), sizeof(int));
     memcpy(&nextPage, buffer+sizeof(bool)+sizeof(int), sizeof(PageId));
+    // the value pages of a NODE_CLUSTERED tree hold raw bytes
+    if(format & NODE_CLUSTERED){
+        if(isLeaf) decodeValues();
+    }else if((isLeaf && (format & NODE_POSTING)) || (format & NODE_OVERFLOW))
+        decodePostings();
     return 0; 
 }
 /*
@@ -54,9 +115,15 @@ RC BTNode::write( PageFile& pf)
     RC rc;
     if(pid == -1 ) return -1;
     // write the page to the disk
-    memcpy(buffer, &isLeaf, sizeof(bool));
+    if(format & NODE_CLUSTERED){
+        if(isLeaf) encodeValues();
+    }else if((isLeaf && (format & NODE_POSTING)) || (format & NODE_OVERFLOW))
+        encodePostings();
+    buffer[0] = (isLeaf ? NODE_LEAF : 0) | format;
     memcpy(buffer+sizeof(bool), &n, sizeof(int));
     memcpy(buffer+sizeof(bool)+sizeof(int), &nextPage, sizeof(PageId));
+    if(!isLeaf && (format & NODE_BUFFERED))
+        memcpy((char *)msgs - sizeof(int), &m, sizeof(int));
     if ((rc = pf.write(this->pid, buffer)) < 0) return rc;
      
     return 0; 
@@ -73,9 +140,15 @@ RC BTNode::write(PageId p,PageFile& pf)
     RC rc;
     // write the page to the disk
     if(this->pid != p)  printf("WARNING:pid[%d] != p[%d]\n",pid,p);
-    memcpy(buffer, &isLeaf, sizeof(bool));
+    if(format & NODE_CLUSTERED){
+        if(isLeaf) encodeValues();
+    }else if((isLeaf && (format & NODE_POSTING)) || (format & NODE_OVERFLOW))
+        encodePostings();
+    buffer[0] = (isLeaf ? NODE_LEAF : 0) | format;
     memcpy(buffer+sizeof(bool), &n, sizeof(int));
     memcpy(buffer+sizeof(bool)+sizeof(int), &nextPage, sizeof(PageId));
+    if(!isLeaf && (format & NODE_BUFFERED))
+        memcpy((char *)msgs - sizeof(int), &m, sizeof(int));
     if ((rc = pf.write(p, buffer)) < 0) return rc;
     this->pid = p;
       
@@ -95,27 +168,21 @@ int BTNode::getKeyCount()
  * Insert a (key, rid) pair to the node.
  * @param key[IN] the key to insert
  * @param rid[IN] the RecordId to insert
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
  * @return 0 if successful. Return an error code if the node is full.
  */
-RC BTNode::insertNonFull(KeyType key, const RecordId& rid, int &newPid, PageFile &pf)
+RC BTNode::insertNonFull(KeyType key, const RecordId& rid, TreeContext &ctx, PageFile &pf)
 { 
     int i = n - 1;
     RC rc = 0;
+    if(isLeaf && (format & NODE_POSTING))
+        return postingInsert(key, rid, ctx, pf);
+    if(isLeaf && (format & NODE_CLUSTERED))
+        return RC_UNSUPPORTED_MODE;  // see insertValue()
     if(isLeaf){
-        while( i>=0 && key< keys[i] ){
-            keys[i + 1] = keys[i];
-            rids[i + 1].pid = rids[i].pid;
-            rids[i + 1].sid = rids[i].sid;
-
-            i--;
-        }
-        keys[i+1] = key;
-        rids[i+1].pid = rid.pid;
-        rids[i+1].sid = rid.sid;
-        
-        n++;
-        DEBUG('i',"insert pid[%d] : key[%d] -> keys[%d]\n",pid, key, i+1);
-        if(DebugIsEnabled('i')) printNode();
+        leafInsert(key, rid);
+        if(ctx.cache) ctx.cache->invalidate(pid);
         rc = write(pf);
         if(rc != 0) goto ERROR;
         return 0;
@@ -128,6 +195,7 @@ RC BTNode::insertNonFull(KeyType key, const RecordId& rid, int &newPid, PageFile
         DEBUG('i',"i:%d\n\n",i);
         rc = node.read(pids[i], pf);
         if(rc != 0) goto ERROR;
+        node.level = level - 1;
         if(node.isLeaf){
             DEBUG('i',"Read Leaf Node page:\n");
         }else{
@@ -135,13 +203,17 @@ RC BTNode::insertNonFull(KeyType key, const RecordId& rid, int &newPid, PageFile
         }
         if(DebugIsEnabled('i')) node.printNode();
 
-        if(node.n == 2*node.getT() - 1){
-            splitChild(i, newPid, pf);
-            newPid++;
+        if(node.isFull()){
+            if( (rc = splitChild(i, ctx, pf)) != 0) goto ERROR;
             if( key >= keys[i])  i++; // insert in to new child node
             node.read(pids[i], pf);
+            node.level = level - 1;
+        }
+        if( (rc = node.insertNonFull(key, rid, ctx, pf)) != 0) goto ERROR;
+        if(format & NODE_COUNTED){
+            counts[i]++;
+            if( (rc = write(pf)) != 0) goto ERROR;
         }
-        if( (rc = node.insertNonFull(key, rid,newPid,  pf)) != 0) goto ERROR;
     }
     return 0;
 ERROR:
@@ -150,40 +222,180 @@ ERROR:
 }
 
 /*
- * Insert the (key, rid) pair to the node
- * and split the node half and half with sibling.
- * The first key of the sibling node is returned in siblingKey.
- * @param key[IN] the key to insert.
- * @param rid[IN] the RecordId to insert.
- * @param sibling[IN] the sibling node to split with. This node MUST be EMPTY when this function is called.
- * @param siblingKey[OUT] the first key in the sibling node after split.
+ * Insert a (key, rid) pair to a leaf node that is not full, in memory.
+ * @param key[IN] the key to insert
+ * @param rid[IN] the RecordId to insert
+ */
+void BTNode::leafInsert(KeyType key, const RecordId& rid)
+{
+    int i = n - 1;
+    while( i>=0 && key< keys[i] ){
+        keys[i + 1] = keys[i];
+        rids[i + 1].pid = rids[i].pid;
+        rids[i + 1].sid = rids[i].sid;
+
+        i--;
+    }
+    keys[i+1] = key;
+    rids[i+1].pid = rid.pid;
+    rids[i+1].sid = rid.sid;
+    
+    n++;
+    DEBUG('i',"insert pid[%d] : key[%d] -> keys[%d]\n",pid, key, i+1);
+    if(DebugIsEnabled('i')) printNode();
+}
+
+/*
+ * Return the index of the child whose subtree holds searchKey.
+ * @param searchKey[IN] the key to route
+ * @return the index into pids
+ */
+int BTNode::searchChild(KeyType searchKey)
+{
+    int i = 0;
+    while( i < n && searchKey > keys[i] ) i++;
+    return i;
+}
+
+/*
+ * Move a batch of pending messages one level down.
+ * Messages are kept oldest first, in this node and in the child, so that
+ * later messages for the same key are applied after earlier ones.
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::flush(TreeContext& ctx, PageFile& pf)
+{
+    RC rc = 0;
+    BTNode child;
+    vector<int> cnt(n + 1, 0);
+    int c = 0, i, j, k;
+
+    if(isLeaf || !(format & NODE_BUFFERED)) { rc = RC_UNSUPPORTED_MODE; goto ERROR; }
+    if(m == 0) return 0;
+
+    // flush to the child that receives the most messages
+    for(j=0; j<m; j++)
+        cnt[searchChild(msgs[j].key)]++;
+    for(i=1; i<=n; i++)
+        if(cnt[i] > cnt[c]) c = i;
+
+    if( (rc = child.read(pids[c], pf)) != 0) goto ERROR;
+    child.level = level - 1;
+    if(child.n == 2*child.getT() - 1){
+        // make room in the child; the split also divides its buffer
+        if(n == 2*getT() - 1) { rc = RC_NODE_FULL; goto ERROR; }
+        if( (rc = splitChild(c, ctx, pf)) != 0) goto ERROR;
+        cnt.assign(n + 1, 0);
+        for(j=0; j<m; j++)
+            cnt[searchChild(msgs[j].key)]++;
+        if(cnt[c+1] > cnt[c]) c++;
+        if( (rc = child.read(pids[c], pf)) != 0) goto ERROR;
+        child.level = level - 1;
+    }
+    if(!child.isLeaf && child.m + cnt[c] > MESSAGES_PER_PAGE){
+        if( (rc = child.flush(ctx, pf)) != 0) goto ERROR;
+    }
+
+    DEBUG('i',"flush pid[%d] : %d messages to child pid[%d]\n",pid, cnt[c], pids[c]);
+    for(j=0, k=0; j<m; j++){
+        bool moved = false;
+        if(searchChild(msgs[j].key) == c){
+            if(child.isLeaf){
+                if(child.n < 2*child.getT() - 1){
+                    child.leafInsert(msgs[j].key, msgs[j].rid);
+                    moved = true;
+                }
+            }else if(child.m < MESSAGES_PER_PAGE){
+                child.msgs[child.m++] = msgs[j];
+                moved = true;
+            }
+        }
+        if(!moved) msgs[k++] = msgs[j];
+    }
+    m = k;
+
+    if(child.isLeaf && ctx.cache) ctx.cache->invalidate(child.pid);
+    if( (rc = child.write(pf)) != 0) goto ERROR;
+    if( (rc = write(pf)) != 0) goto ERROR;
+    return 0;
+ERROR:
+    printf("flush error:%d\n",rc);
+    return rc;
+}
+
+/*
+ * Find the most recent pending message for searchKey on the path from
+ * this node down to the leaf level.
+ * @param searchKey[IN] the key to find
+ * @param pf[IN] the page file
+ * @param msg[OUT] the message found
+ * @param found[OUT] whether a message was found
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::findMessage(KeyType searchKey, const PageFile& pf, BTMessage& msg, bool& found)
+{
+    RC rc;
+    BTNode node;
+    int j;
+
+    found = false;
+    if(isLeaf) return 0;
+    // a message in a node above is newer than any message below it
+    for(j=m-1; j>=0; j--){
+        if(msgs[j].key == searchKey){
+            msg = msgs[j];
+            found = true;
+            return 0;
+        }
+    }
+    if(level <= 1) return 0;
+    if( (rc = node.read(pids[searchChild(searchKey)], pf)) != 0) return rc;
+    node.level = level - 1;
+    return node.findMessage(searchKey, pf, msg, found);
+}
+
+/*
+ * Split the full child pids[i] half and half with a new sibling
+ * taken from allocPage(), and insert the separator key into this node.
+ * @param i[IN] the index of the child to split.
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
  * @return 0 if successful. Return an error code if there is an error.
  */
-RC BTNode::splitChild(int i, PageId newPid, PageFile& pf)
+RC BTNode::splitChild(int i, TreeContext& ctx, PageFile& pf)
 {   
     RC rc = 0;
     int j;
     BTNode newN; //new node
     BTNode oldN; //child node
     int t;
-    DEBUG('i',"Split Child pid:%d  newPid:%d\n",pids[i],newPid);
+    PageId newPid;
     if( this->isLeaf == true ) { rc = -1; goto ERROR; }
     if( (rc = oldN.read(this->pids[i], pf)) != 0) { rc = -2; goto ERROR; } 
+    if( (rc = allocPage(ctx, pf, newPid)) != 0) goto ERROR;
+    DEBUG('i',"Split Child pid:%d  newPid:%d\n",pids[i],newPid);
     newN.isLeaf = oldN.isLeaf;
+    newN.setFormat(oldN.format);
     t = newN.getT();
     newN.pid = newPid;
     if( newN.isLeaf ){
-        newN.n = t;
-        for(j=0; j<=t-1; j++){
-            newN.keys[j] = oldN.keys[j+t-1];
-            newN.rids[j] = oldN.rids[j+t-1];
+        if(oldN.format & (NODE_POSTING | NODE_CLUSTERED)){
+            oldN.splitPostings(newN);
+        }else{
+            newN.n = t;
+            for(j=0; j<=t-1; j++){
+                newN.keys[j] = oldN.keys[j+t-1];
+                newN.rids[j] = oldN.rids[j+t-1];
+            }
+            oldN.n = oldN.n - t;
         }
-        oldN.n = oldN.n - t;
         for(j=n; j>=i+1; j--)
             keys[j] = keys[j-1];
         for(j=n+1; j>=i+2; j--)
             pids[j] = pids[j-1];
-        keys[i] = newN.keys[0];
+        keys[i] = newN.getKey(0);
         pids[i+1] = newN.pid;
         n++;
 
@@ -197,6 +409,7 @@ RC BTNode::splitChild(int i, PageId newPid, PageFile& pf)
         }
         for(j=0; j<=t-1; j++){
             newN.pids[j] = oldN.pids[j+t];
+            if(format & NODE_COUNTED) newN.counts[j] = oldN.counts[j+t];
         }
 
         oldN.n = oldN.n - newN.n - 1;
@@ -207,25 +420,1116 @@ RC BTNode::splitChild(int i, PageId newPid, PageFile& pf)
         keys[i] = oldN.keys[oldN.n];
         pids[i+1] = newN.pid;
         n++;
+
+        if(format & NODE_BUFFERED){
+            // the pending messages follow their keys, as routed by searchChild
+            int k = 0;
+            for(j=0; j<oldN.m; j++){
+                if(oldN.msgs[j].key <= keys[i]) oldN.msgs[k++] = oldN.msgs[j];
+                else newN.msgs[newN.m++] = oldN.msgs[j];
+            }
+            oldN.m = k;
+        }
+    }
+    if(format & NODE_COUNTED){
+        // pids[i+1..n] were shifted right by one above
+        for(j=n; j>=i+2; j--)
+            counts[j] = counts[j-1];
+        counts[i] = oldN.getEntryCount();
+        counts[i+1] = newN.getEntryCount();
     }
     if(DebugIsEnabled('i')){
         this->printNode();
         oldN.printNode();
         newN.printNode();
     }
+    if(oldN.isLeaf && ctx.cache) ctx.cache->invalidate(oldN.pid);
+    if(level > 0 && level <= MAX_TREE_HEIGHT) ctx.stats.levelPages[level-1]++;
     oldN.write( pf );
     this->write( pf );
     newN.write( pf);
+    updateInner(ctx, oldN);
+    updateInner(ctx, newN);
+    updateInner(ctx, *this);
     return 0;
 ERROR:
     printf("error:%d\n",rc);
     return rc;
 }
 
+/*
+ * Remove the entry (key, rid) from the subtree of this node, merging or
+ * refilling the child it was removed from if that became underfull.
+ * @param key[IN] the key of the entry
+ * @param rid[IN] the RecordId of the entry
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
+ * @param found[OUT] whether the entry was found and removed
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::remove(KeyType key, const RecordId& rid, TreeContext& ctx, PageFile& pf, bool& found)
+{
+    RC rc = 0;
+    int i, j;
+    found = false;
+    if(isLeaf && (format & NODE_POSTING))
+        return postingRemove(key, rid, ctx, pf, found);
+    if(isLeaf && (format & NODE_CLUSTERED))
+        return valueRemove(key, ctx, pf, found);
+    if(isLeaf){
+        for(i=0; i<n && keys[i] < key; i++);
+        for(; i<n && keys[i] == key; i++)
+            if(rids[i].pid == rid.pid && rids[i].sid == rid.sid) break;
+        if(i == n || keys[i] != key) return 0;
+        for(j=i; j<n-1; j++){
+            keys[j] = keys[j+1];
+            rids[j] = rids[j+1];
+        }
+        n--;
+        found = true;
+        DEBUG('i',"remove pid[%d] : key[%d] <- keys[%d]\n",pid, key, i);
+        if(ctx.cache) ctx.cache->invalidate(pid);
+        if( (rc = write(pf)) != 0) goto ERROR;
+        return 0;
+    }
+
+    // an equal separator routes left, but equal keys may also be found
+    // in the children right of it
+    for(i = searchChild(key); i <= n; i++){
+        BTNode child;
+        if( (rc = child.read(pids[i], pf)) != 0) goto ERROR;
+        child.level = level - 1;
+        if( (rc = child.remove(key, rid, ctx, pf, found)) != 0) goto ERROR;
+        if(found){
+            bool changed = (format & NODE_COUNTED) != 0;
+            if(format & NODE_COUNTED) counts[i]--;
+            if(n > 0 && child.isUnderfull()){
+                if( (rc = rebalance(i, child, ctx, pf)) != 0) goto ERROR;
+                changed = true;
+            }
+            if(changed && (rc = write(pf)) != 0) goto ERROR;
+            if(changed) updateInner(ctx, *this);
+            return 0;
+        }
+        if(i == n || keys[i] != key) break;
+    }
+    return 0;
+ERROR:
+    printf("remove error:%d\n",rc);
+    return rc;
+}
+
+bool BTNode::isUnderfull()
+{
+    if(isLeaf && (format & (NODE_POSTING | NODE_CLUSTERED))) return postingBytes() < POSTING_BYTES/4;
+    return n < (2*getT() - 1)/4;
+}
+
+bool BTNode::isFull()
+{
+    if(isLeaf && (format & NODE_POSTING)) return postingBytes() > POSTING_BYTES - POSTING_RESERVE;
+    if(isLeaf && (format & NODE_CLUSTERED)) return postingBytes() > POSTING_BYTES - VALUE_RESERVE;
+    return n == 2*getT() - 1;
+}
+
+/*
+ * Merge the underfull child pids[i] with a sibling, or move entries from
+ * the sibling into it if both do not fit into three quarters of a node.
+ * Changes the separator in this node but does not write this node.
+ * @param i[IN] the index of the underfull child
+ * @param child[IN/OUT] the underfull child, as written by remove()
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::rebalance(int i, BTNode& child, TreeContext& ctx, PageFile& pf)
+{
+    RC rc = 0;
+    BTNode sib;
+    int s = (i < n) ? i : i - 1;  // the separator between pids[s] and pids[s+1]
+    int j, total, leftN, leftM = 0, maxN = 2*child.getT() - 1;
+    KeyType sep = 0;
+    bool merge;
+    vector<KeyType> k;
+    vector<RecordId> r;
+    vector<PageId> p;
+    vector<int> c;
+    vector<BTMessage> msg;
+
+    if( (rc = sib.read(pids[s == i ? i + 1 : i - 1], pf)) != 0) goto ERROR;
+    sib.level = child.level;
+    {
+    BTNode& left  = (s == i) ? child : sib;
+    BTNode& right = (s == i) ? sib : child;
+
+    if(child.isLeaf && (child.format & (NODE_POSTING | NODE_CLUSTERED))){
+        // the sizes of the postings and values vary, so both are measured in bytes
+        right.movePostings(left);
+        merge = left.postingBytes() <= POSTING_BYTES*3/4;
+        if(!merge) left.splitPostings(right);
+        DEBUG('i',"%s pid[%d] and pid[%d]\n",merge ? "merge" : "redistribute",left.pid, right.pid);
+        if(ctx.cache){
+            ctx.cache->invalidate(left.pid);
+            ctx.cache->invalidate(right.pid);
+        }
+        goto DONE;
+    }
+
+    // gather the entries of both nodes, and the separator between
+    // them if they are non leaf nodes
+    k.assign(left.keys, left.keys + left.n);
+    if(!child.isLeaf) k.push_back(keys[s]);
+    k.insert(k.end(), right.keys, right.keys + right.n);
+    if(child.isLeaf){
+        r.assign(left.rids, left.rids + left.n);
+        r.insert(r.end(), right.rids, right.rids + right.n);
+    }else{
+        p.assign(left.pids, left.pids + left.n + 1);
+        p.insert(p.end(), right.pids, right.pids + right.n + 1);
+        if(format & NODE_COUNTED){
+            c.assign(left.counts, left.counts + left.n + 1);
+            c.insert(c.end(), right.counts, right.counts + right.n + 1);
+        }
+        if(format & NODE_BUFFERED){
+            msg.assign(left.msgs, left.msgs + left.m);
+            msg.insert(msg.end(), right.msgs, right.msgs + right.m);
+        }
+    }
+    total = (int)k.size();
+
+    merge = total <= maxN*3/4 && (int)msg.size() <= MESSAGES_PER_PAGE;
+    leftN = merge ? total : total/2;
+    sep = merge ? 0 : k[leftN];  // the new separator
+    for(j=0; j<(int)msg.size(); j++)
+        if(merge || msg[j].key <= sep) leftM++;
+    if(leftM > MESSAGES_PER_PAGE || (int)msg.size() - leftM > MESSAGES_PER_PAGE)
+        return 0;  // the buffers do not fit, leave the child underfull
+
+    DEBUG('i',"%s pid[%d] and pid[%d]\n",merge ? "merge" : "redistribute",left.pid, right.pid);
+    left.n = leftN;
+    for(j=0; j<leftN; j++) left.keys[j] = k[j];
+    if(child.isLeaf){
+        for(j=0; j<leftN; j++) left.rids[j] = r[j];
+        right.n = total - leftN;
+        for(j=0; j<right.n; j++){
+            right.keys[j] = k[leftN + j];
+            right.rids[j] = r[leftN + j];
+        }
+        if(ctx.cache){
+            ctx.cache->invalidate(left.pid);
+            ctx.cache->invalidate(right.pid);
+        }
+    }else{
+        for(j=0; j<=leftN; j++){
+            left.pids[j] = p[j];
+            if(format & NODE_COUNTED) left.counts[j] = c[j];
+        }
+        right.n = merge ? 0 : total - leftN - 1;
+        for(j=0; j<right.n; j++) right.keys[j] = k[leftN + 1 + j];
+        for(j=0; !merge && j<=right.n; j++){
+            right.pids[j] = p[leftN + 1 + j];
+            if(format & NODE_COUNTED) right.counts[j] = c[leftN + 1 + j];
+        }
+        left.m = right.m = 0;
+        for(j=0; j<(int)msg.size(); j++){
+            if(merge || msg[j].key <= sep) left.msgs[left.m++] = msg[j];
+            else right.msgs[right.m++] = msg[j];
+        }
+    }
+
+DONE:
+    if(merge){
+        // the right node goes away together with its separator
+        if(child.isLeaf) left.setNextNodePtr(right.getNextNodePtr());
+        for(j=s; j<n-1; j++)
+            keys[j] = keys[j+1];
+        for(j=s+1; j<n; j++){
+            pids[j] = pids[j+1];
+            if(format & NODE_COUNTED) counts[j] = counts[j+1];
+        }
+        n--;
+        if(format & NODE_COUNTED) counts[s] = left.getEntryCount();
+        if(child.level >= 0 && child.level < MAX_TREE_HEIGHT) ctx.stats.levelPages[child.level]--;
+        if( (rc = left.write(pf)) != 0) goto ERROR;
+        updateInner(ctx, left);
+        if( (rc = freePage(right.pid, ctx, pf)) != 0) goto ERROR;
+    }else{
+        keys[s] = child.isLeaf ? right.getKey(0) : sep;
+        if(format & NODE_COUNTED){
+            counts[s] = left.getEntryCount();
+            counts[s+1] = right.getEntryCount();
+        }
+        if( (rc = left.write(pf)) != 0) goto ERROR;
+        if( (rc = right.write(pf)) != 0) goto ERROR;
+        updateInner(ctx, left);
+        updateInner(ctx, right);
+    }
+    }
+    return 0;
+ERROR:
+    printf("rebalance error:%d\n",rc);
+    return rc;
+}
+
+/*
+ * Spread the entries of all leaf children evenly over just enough leaves
+ * to keep them filled at fillFactor. A non leaf node keeps at least two
+ * children, as it needs a separator key.
+ * @param fillFactor[IN] the fill of the repacked leaves, 0 < fillFactor <= 1
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
+ * @param freed[OUT] the # leaves that went away
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::compactLeaves(double fillFactor, TreeContext& ctx, PageFile& pf, int& freed)
+{
+    RC rc = 0;
+    int i, j, from, to, perLeaf = 1, needed, total, c = n + 1;
+    PageId next = -1;
+    vector<KeyType> k;
+    vector<RecordId> r;
+
+    freed = 0;
+    if(isLeaf || c < 3) return 0;
+    for(i=0; i<c; i++){
+        BTNode leaf;
+        if( (rc = leaf.read(pids[i], pf)) != 0) goto ERROR;
+        if(!leaf.isLeaf) return RC_INVALID_FILE_FORMAT;
+        if(leaf.format & (NODE_POSTING | NODE_CLUSTERED)) return 0;
+        k.insert(k.end(), leaf.keys, leaf.keys + leaf.n);
+        r.insert(r.end(), leaf.rids, leaf.rids + leaf.n);
+        perLeaf = (int)(fillFactor * (2*leaf.getT() - 1));
+        next = leaf.getNextNodePtr();
+    }
+    total = (int)k.size();
+    if(perLeaf < 1) perLeaf = 1;
+    needed = (total + perLeaf - 1)/perLeaf;
+    if(needed < 2) needed = 2;
+    if(needed >= c || total == 0) return 0;
+
+    DEBUG('i',"compact pid[%d]: %d leaves -> %d\n",pid, c, needed);
+    for(i=0; i<needed; i++){
+        BTNode leaf;
+        leaf.isLeaf = true;
+        leaf.setFormat(format);
+        leaf.pid = pids[i];
+        from = (int)((long long)total*i/needed);
+        to = (int)((long long)total*(i+1)/needed);
+        leaf.n = to - from;
+        for(j=0; j<leaf.n; j++){
+            leaf.keys[j] = k[from + j];
+            leaf.rids[j] = r[from + j];
+        }
+        leaf.setNextNodePtr(i < needed - 1 ? pids[i+1] : next);
+        if(ctx.cache) ctx.cache->invalidate(leaf.pid);
+        if( (rc = leaf.write(pf)) != 0) goto ERROR;
+        // the separator is the first key of the right node, as in splitChild()
+        if(i > 0) keys[i-1] = k[from];
+        if(format & NODE_COUNTED) counts[i] = leaf.n;
+    }
+    for(i=needed; i<c; i++){
+        if( (rc = freePage(pids[i], ctx, pf)) != 0) goto ERROR;
+        ctx.stats.levelPages[0]--;
+    }
+    freed = c - needed;
+    n = needed - 1;
+    if( (rc = write(pf)) != 0) goto ERROR;
+    updateInner(ctx, *this);
+    return 0;
+ERROR:
+    printf("compactLeaves error:%d\n",rc);
+    return rc;
+}
+
+/*
+ * Take a page for a new node from the free list or the end of the file.
+ * @param ctx[IN/OUT] page allocation of the tree
+ * @param pf[IN] the page file
+ * @param pid[OUT] the page to use
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::allocPage(TreeContext& ctx, const PageFile& pf, PageId& pid)
+{
+    RC rc;
+    BTNode node;
+    if(ctx.freeHead == 0){
+        pid = ctx.newPid++;
+        return 0;
+    }
+    if( (rc = node.read(ctx.freeHead, pf)) != 0) return rc;
+    if(!(node.format & NODE_FREE)) return RC_INVALID_PID;
+    pid = ctx.freeHead;
+    ctx.freeHead = node.getNextNodePtr();
+    ctx.stats.freePages--;
+    return 0;
+}
+
+/*
+ * Put a page on the free list: a NODE_FREE node whose next node pointer
+ * is the old head of the list.
+ * @param pid[IN] the page to free
+ * @param ctx[IN/OUT] page allocation of the tree
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::freePage(PageId pid, TreeContext& ctx, PageFile& pf)
+{
+    RC rc;
+    BTNode node;
+    node.pid = pid;
+    node.setFormat(NODE_FREE);
+    node.setNextNodePtr(ctx.freeHead);
+    if( (rc = node.write(pf)) != 0) return rc;
+    // the cache may still point into the page
+    if(ctx.cache) ctx.cache->invalidate(pid);
+    if(ctx.inner) ctx.inner->drop(pid);
+    ctx.freeHead = pid;
+    ctx.stats.freePages++;
+    return 0;
+}
+
+/*
+ * NODE_POSTING leaves store every distinct key once:
+ *   key (4 bytes), varint (# rids << 1 | 1 if the rids are in overflow pages),
+ *   then either the first and the last overflow page (4 bytes each),
+ *   or the rids in RecordId order, delta encoded: varint pid - previous pid,
+ *   then varint sid - previous sid if the pid is the same, else varint sid.
+ * NODE_OVERFLOW pages store the key and n rids encoded the same way.
+ */
+static int varintSize(unsigned v)
+{
+    int size = 1;
+    while(v >= 0x80){
+        v >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static unsigned char* putVarint(unsigned char* p, unsigned v)
+{
+    while(v >= 0x80){
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static const unsigned char* getVarint(const unsigned char* p, unsigned& v)
+{
+    int shift = 0;
+    v = 0;
+    do{
+        v |= (unsigned)(*p & 0x7f) << shift;
+        shift += 7;
+    }while(*p++ & 0x80);
+    return p;
+}
+
+static int ridListBytes(const vector<RecordId>& rids)
+{
+    int size = 0;
+    unsigned pid = 0, sid = 0;
+    for(size_t j=0; j<rids.size(); j++){
+        unsigned dp = (unsigned)rids[j].pid - pid;
+        size += varintSize(dp);
+        size += varintSize(dp == 0 ? (unsigned)rids[j].sid - sid : (unsigned)rids[j].sid);
+        pid = rids[j].pid;
+        sid = rids[j].sid;
+    }
+    return size;
+}
+
+static unsigned char* putRidList(unsigned char* p, const vector<RecordId>& rids)
+{
+    unsigned pid = 0, sid = 0;
+    for(size_t j=0; j<rids.size(); j++){
+        unsigned dp = (unsigned)rids[j].pid - pid;
+        p = putVarint(p, dp);
+        p = putVarint(p, dp == 0 ? (unsigned)rids[j].sid - sid : (unsigned)rids[j].sid);
+        pid = rids[j].pid;
+        sid = rids[j].sid;
+    }
+    return p;
+}
+
+static const unsigned char* getRidList(const unsigned char* p, int count, vector<RecordId>& rids)
+{
+    unsigned pid = 0, sid = 0, dp, v;
+    rids.resize(count);
+    for(int j=0; j<count; j++){
+        p = getVarint(p, dp);
+        p = getVarint(p, v);
+        pid += dp;
+        sid = (dp == 0) ? sid + v : v;
+        rids[j].pid = (PageId)pid;
+        rids[j].sid = (int)sid;
+    }
+    return p;
+}
+
+/*
+ * Decode the keys and rids of a NODE_POSTING leaf or a NODE_OVERFLOW
+ * page from the page buffer.
+ */
+void BTNode::decodePostings()
+{
+    const unsigned char* p = (const unsigned char *)keys;
+    unsigned v;
+    int s;
+
+    if(format & NODE_OVERFLOW){
+        pkeys.assign(1, 0);
+        pcounts.assign(1, n);
+        pheads.assign(1, -1);
+        ptails.assign(1, -1);
+        prids.resize(1);
+        memcpy(&pkeys[0], p, sizeof(KeyType));
+        getRidList(p + sizeof(KeyType), n, prids[0]);
+        return;
+    }
+    pkeys.resize(n);
+    pcounts.resize(n);
+    pheads.resize(n);
+    ptails.resize(n);
+    prids.resize(n);
+    for(s=0; s<n; s++){
+        memcpy(&pkeys[s], p, sizeof(KeyType));
+        p = getVarint(p + sizeof(KeyType), v);
+        pcounts[s] = (int)(v >> 1);
+        if(v & 1){
+            memcpy(&pheads[s], p, sizeof(PageId));
+            memcpy(&ptails[s], p + sizeof(PageId), sizeof(PageId));
+            p += 2*sizeof(PageId);
+            prids[s].clear();
+        }else{
+            pheads[s] = ptails[s] = -1;
+            p = getRidList(p, pcounts[s], prids[s]);
+        }
+    }
+}
+
+/*
+ * Encode the keys and rids of a NODE_POSTING leaf or a NODE_OVERFLOW
+ * page into the page buffer.
+ */
+void BTNode::encodePostings()
+{
+    unsigned char* p = (unsigned char *)keys;
+    int s;
+
+    if(format & NODE_OVERFLOW){
+        n = (int)prids[0].size();
+        memcpy(p, &pkeys[0], sizeof(KeyType));
+        putRidList(p + sizeof(KeyType), prids[0]);
+        return;
+    }
+    n = (int)pkeys.size();
+    for(s=0; s<n; s++){
+        memcpy(p, &pkeys[s], sizeof(KeyType));
+        p = putVarint(p + sizeof(KeyType), ((unsigned)pcounts[s] << 1) | (pheads[s] != -1 ? 1 : 0));
+        if(pheads[s] != -1){
+            memcpy(p, &pheads[s], sizeof(PageId));
+            memcpy(p + sizeof(PageId), &ptails[s], sizeof(PageId));
+            p += 2*sizeof(PageId);
+        }else{
+            p = putRidList(p, prids[s]);
+        }
+    }
+}
+
+/*
+ * Return the encoded size of the s-th key of a NODE_POSTING or a
+ * NODE_CLUSTERED leaf.
+ */
+int BTNode::slotBytes(int s)
+{
+    int size = sizeof(KeyType) + varintSize(((unsigned)pcounts[s] << 1) | 1);
+    if(format & NODE_CLUSTERED) return size + (pheads[s] != -1 ? (int)sizeof(PageId) : pcounts[s]);
+    if(pheads[s] != -1) return size + 2*sizeof(PageId);
+    return size + ridListBytes(prids[s]);
+}
+
+/*
+ * Return the encoded size of all keys of a NODE_POSTING or a
+ * NODE_CLUSTERED leaf.
+ */
+int BTNode::postingBytes()
+{
+    int s, size = 0;
+    for(s=0; s<(int)pkeys.size(); s++)
+        size += slotBytes(s);
+    return size;
+}
+
+/*
+ * Return the # bytes of the page the node uses, its header included.
+ */
+int BTNode::getUsedBytes()
+{
+    int size = sizeof(bool) + sizeof(int) + sizeof(PageId);
+    if(format & NODE_FREE) return 0;
+    if(format & NODE_CLUSTERED) return size + (isLeaf ? postingBytes() : n);
+    if(format & NODE_OVERFLOW) return size + sizeof(KeyType) + ridListBytes(prids[0]);
+    if(isLeaf && (format & NODE_POSTING)) return size + postingBytes();
+    if(isLeaf) return size + n*(sizeof(KeyType) + sizeof(RecordId));
+    size += n*sizeof(KeyType) + (n+1)*sizeof(PageId);
+    if(format & NODE_COUNTED) size += (n+1)*sizeof(int);
+    if(format & NODE_BUFFERED) size += sizeof(int) + m*sizeof(BTMessage);
+    return size;
+}
+
+/*
+ * Return the index of the first key >= key of a NODE_POSTING or a
+ * NODE_CLUSTERED leaf.
+ */
+int BTNode::findSlot(KeyType key)
+{
+    return (int)(lower_bound(pkeys.begin(), pkeys.end(), key) - pkeys.begin());
+}
+
+/*
+ * Move the upper half (in bytes) of the keys of this NODE_POSTING or
+ * NODE_CLUSTERED leaf to the end of the empty leaf right. Both keep at
+ * least one key.
+ * @param right[IN/OUT] the leaf to the right of this one
+ */
+void BTNode::splitPostings(BTNode& right)
+{
+    int s = 0, size = 0, half = postingBytes()/2;
+    while(s < (int)pkeys.size() - 1 && (s == 0 || size + slotBytes(s) <= half))
+        size += slotBytes(s++);
+
+    right.pkeys.assign(pkeys.begin() + s, pkeys.end());
+    right.pcounts.assign(pcounts.begin() + s, pcounts.end());
+    right.pheads.assign(pheads.begin() + s, pheads.end());
+    right.n = (int)right.pkeys.size();
+    pkeys.resize(s);
+    pcounts.resize(s);
+    pheads.resize(s);
+    n = s;
+    if(format & NODE_CLUSTERED){
+        right.pvalues.assign(pvalues.begin() + s, pvalues.end());
+        pvalues.resize(s);
+        return;
+    }
+    right.prids.assign(prids.begin() + s, prids.end());
+    right.ptails.assign(ptails.begin() + s, ptails.end());
+    prids.resize(s);
+    ptails.resize(s);
+}
+
+/*
+ * Move all keys of this NODE_POSTING or NODE_CLUSTERED leaf to the end
+ * of the leaf to, which is the leaf left of this one.
+ * @param to[IN/OUT] the leaf to the left of this one
+ */
+void BTNode::movePostings(BTNode& to)
+{
+    to.pkeys.insert(to.pkeys.end(), pkeys.begin(), pkeys.end());
+    to.pcounts.insert(to.pcounts.end(), pcounts.begin(), pcounts.end());
+    to.prids.insert(to.prids.end(), prids.begin(), prids.end());
+    to.pheads.insert(to.pheads.end(), pheads.begin(), pheads.end());
+    to.ptails.insert(to.ptails.end(), ptails.begin(), ptails.end());
+    to.pvalues.insert(to.pvalues.end(), pvalues.begin(), pvalues.end());
+    to.n = (int)to.pkeys.size();
+    pkeys.clear();
+    pcounts.clear();
+    prids.clear();
+    pheads.clear();
+    ptails.clear();
+    pvalues.clear();
+    n = 0;
+}
+
+/*
+ * Insert a (key, rid) pair into a NODE_POSTING leaf that is not full.
+ * @param key[IN] the key to insert
+ * @param rid[IN] the RecordId to insert
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::postingInsert(KeyType key, const RecordId& rid, TreeContext& ctx, PageFile& pf)
+{
+    RC rc = 0;
+    int s = findSlot(key);
+
+    if(s == n || pkeys[s] != key){
+        pkeys.insert(pkeys.begin() + s, key);
+        pcounts.insert(pcounts.begin() + s, 0);
+        prids.insert(prids.begin() + s, vector<RecordId>());
+        pheads.insert(pheads.begin() + s, -1);
+        ptails.insert(ptails.begin() + s, -1);
+        n++;
+    }
+    if(pheads[s] != -1){
+        if( (rc = overflowInsert(s, rid, ctx, pf)) != 0) goto ERROR;
+    }else{
+        prids[s].insert(upper_bound(prids[s].begin(), prids[s].end(), rid), rid);
+        if(ridListBytes(prids[s]) > POSTING_INLINE_BYTES && (rc = spillPostings(s, ctx, pf)) != 0) goto ERROR;
+    }
+    pcounts[s]++;
+    DEBUG('i',"insert pid[%d] : key[%d] -> slot[%d] rids:%d\n",pid, key, s, pcounts[s]);
+
+    if(ctx.cache) ctx.cache->invalidate(pid);
+    if( (rc = write(pf)) != 0) goto ERROR;
+    return 0;
+ERROR:
+    printf("postingInsert error:%d\n",rc);
+    return rc;
+}
+
+/*
+ * Remove a (key, rid) pair from a NODE_POSTING leaf. A key without rids
+ * is removed from the leaf.
+ * @param key[IN] the key of the entry
+ * @param rid[IN] the RecordId of the entry
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
+ * @param found[OUT] whether the entry was found and removed
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::postingRemove(KeyType key, const RecordId& rid, TreeContext& ctx, PageFile& pf, bool& found)
+{
+    RC rc = 0;
+    int s = findSlot(key);
+
+    found = false;
+    if(s == n || pkeys[s] != key) return 0;
+    if(pheads[s] != -1){
+        if( (rc = overflowRemove(s, rid, ctx, pf, found)) != 0) goto ERROR;
+    }else{
+        vector<RecordId>::iterator it = lower_bound(prids[s].begin(), prids[s].end(), rid);
+        if(it != prids[s].end() && it->pid == rid.pid && it->sid == rid.sid){
+            prids[s].erase(it);
+            found = true;
+        }
+    }
+    if(!found) return 0;
+
+    if(--pcounts[s] == 0){
+        pkeys.erase(pkeys.begin() + s);
+        pcounts.erase(pcounts.begin() + s);
+        prids.erase(prids.begin() + s);
+        pheads.erase(pheads.begin() + s);
+        ptails.erase(ptails.begin() + s);
+        n--;
+    }
+    DEBUG('i',"remove pid[%d] : key[%d] <- slot[%d]\n",pid, key, s);
+
+    if(ctx.cache) ctx.cache->invalidate(pid);
+    if( (rc = write(pf)) != 0) goto ERROR;
+    return 0;
+ERROR:
+    printf("postingRemove error:%d\n",rc);
+    return rc;
+}
+
+/*
+ * Move the inline rids of the s-th key to a new chain of overflow pages.
+ * @param s[IN] the index of the key
+ * @param ctx[IN/OUT] page allocation of the tree
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::spillPostings(int s, TreeContext& ctx, PageFile& pf)
+{
+    RC rc;
+    BTNode page;
+    vector<RecordId> chunk;
+    PageId next = -1;
+    int j, size = 0;
+    const int capacity = POSTING_BYTES - sizeof(KeyType);
+
+    // fill the pages from the last rid backwards, so that every page
+    // can be written with its next page known. Each page gets about
+    // half full, which leaves room for inserts in between.
+    page.setFormat(NODE_OVERFLOW);
+    page.pkeys.assign(1, pkeys[s]);
+    page.prids.resize(1);
+    for(j = (int)prids[s].size() - 1; j >= -1; j--){
+        if(j >= 0){
+            chunk.insert(chunk.begin(), prids[s][j]);
+            size = ridListBytes(chunk);
+            if(size <= capacity/2 && j > 0) continue;
+        }
+        if(chunk.empty()) break;
+        page.prids[0].swap(chunk);
+        chunk.clear();
+        if( (rc = allocPage(ctx, pf, page.pid)) != 0) return rc;
+        page.setNextNodePtr(next);
+        if( (rc = page.write(pf)) != 0) return rc;
+        if(next == -1) ptails[s] = page.pid;
+        next = page.pid;
+    }
+    pheads[s] = next;
+    prids[s].clear();
+    DEBUG('i',"spill key[%d] : %d rids to overflow pages %d..%d\n",pkeys[s], pcounts[s] + 1, pheads[s], ptails[s]);
+    return 0;
+}
+
+/*
+ * Insert a rid into the overflow pages of the s-th key.
+ * Appending a rid larger than all others reads the last page only.
+ * @param s[IN] the index of the key
+ * @param rid[IN] the RecordId to insert
+ * @param ctx[IN/OUT] page allocation of the tree
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::overflowInsert(int s, const RecordId& rid, TreeContext& ctx, PageFile& pf)
+{
+    RC rc;
+    BTNode page, next;
+    PageId p = ptails[s], q;
+    vector<RecordId>* list;
+    int half;
+
+    if( (rc = page.read(p, pf)) != 0) return rc;
+    if(rid < page.prids[0].front()){
+        // find the last page whose first rid is <= rid
+        p = pheads[s];
+        for(;;){
+            if( (rc = page.read(p, pf)) != 0) return rc;
+            if( (q = page.getNextNodePtr()) == -1) break;
+            if( (rc = next.read(q, pf)) != 0) return rc;
+            if(rid < next.prids[0].front()) break;
+            p = q;
+        }
+    }
+
+    list = &page.prids[0];
+    list->insert(upper_bound(list->begin(), list->end(), rid), rid);
+    if(ridListBytes(*list) <= POSTING_BYTES - (int)sizeof(KeyType))
+        return page.write(pf);
+
+    // split the page half and half with a new page after it
+    half = (int)list->size()/2;
+    next.setFormat(NODE_OVERFLOW);
+    next.pkeys.assign(1, pkeys[s]);
+    next.prids.assign(1, vector<RecordId>(list->begin() + half, list->end()));
+    list->resize(half);
+    if( (rc = allocPage(ctx, pf, next.pid)) != 0) return rc;
+    next.setNextNodePtr(page.getNextNodePtr());
+    page.setNextNodePtr(next.pid);
+    if(ptails[s] == page.pid) ptails[s] = next.pid;
+    if( (rc = next.write(pf)) != 0) return rc;
+    return page.write(pf);
+}
+
+/*
+ * Remove a rid from the overflow pages of the s-th key.
+ * A page left empty is unlinked and freed.
+ * @param s[IN] the index of the key
+ * @param rid[IN] the RecordId to remove
+ * @param ctx[IN/OUT] page allocation of the tree
+ * @param pf[IN] PageFile to write to
+ * @param found[OUT] whether the rid was found and removed
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::overflowRemove(int s, const RecordId& rid, TreeContext& ctx, PageFile& pf, bool& found)
+{
+    RC rc;
+    BTNode page, prev;
+    PageId p = pheads[s], last = -1;
+    vector<RecordId>::iterator it;
+
+    found = false;
+    while(p != -1){
+        if( (rc = page.read(p, pf)) != 0) return rc;
+        vector<RecordId>& list = page.prids[0];
+        it = lower_bound(list.begin(), list.end(), rid);
+        if(it != list.end() && it->pid == rid.pid && it->sid == rid.sid){
+            list.erase(it);
+            found = true;
+            if(!list.empty()) return page.write(pf);
+
+            if(last == -1){
+                pheads[s] = page.getNextNodePtr();
+            }else{
+                if( (rc = prev.read(last, pf)) != 0) return rc;
+                prev.setNextNodePtr(page.getNextNodePtr());
+                if( (rc = prev.write(pf)) != 0) return rc;
+            }
+            if(ptails[s] == p) ptails[s] = last;
+            return freePage(p, ctx, pf);
+        }
+        // the pages are in RecordId order
+        if(it != list.end()) return 0;
+        last = p;
+        p = page.getNextNodePtr();
+    }
+    return 0;
+}
+
+/*
+ * Read all rids of the s-th key of a NODE_POSTING leaf.
+ * @param s[IN] the index of the key
+ * @param pf[IN] the page file
+ * @param rids[OUT] the rids in RecordId order
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::readPostings(int s, const PageFile& pf, vector<RecordId>& rids)
+{
+    RC rc;
+    BTNode page;
+    PageId p;
+
+    if(pheads[s] == -1){
+        rids = prids[s];
+        return 0;
+    }
+    rids.clear();
+    rids.reserve(pcounts[s]);
+    for(p = pheads[s]; p != -1; p = page.getNextNodePtr()){
+        if( (rc = page.read(p, pf)) != 0) return rc;
+        rids.insert(rids.end(), page.prids[0].begin(), page.prids[0].end());
+    }
+    return 0;
+}
+
+/*
+ * NODE_CLUSTERED leaves store every key once with its value:
+ *   key (4 bytes), varint (value length << 1 | 1 if the value is in value pages),
+ *   then either the first value page (4 bytes) or the value bytes.
+ * The value pages (NODE_CLUSTERED | NODE_OVERFLOW) hold n bytes of the
+ * value each, in order along nextPage.
+ */
+void BTNode::decodeValues()
+{
+    const unsigned char* p = (const unsigned char *)keys;
+    unsigned v;
+    int s;
+
+    pkeys.resize(n);
+    pcounts.resize(n);
+    pheads.resize(n);
+    pvalues.resize(n);
+    for(s=0; s<n; s++){
+        memcpy(&pkeys[s], p, sizeof(KeyType));
+        p = getVarint(p + sizeof(KeyType), v);
+        pcounts[s] = (int)(v >> 1);
+        if(v & 1){
+            memcpy(&pheads[s], p, sizeof(PageId));
+            p += sizeof(PageId);
+            pvalues[s].clear();
+        }else{
+            pheads[s] = -1;
+            pvalues[s].assign((const char *)p, pcounts[s]);
+            p += pcounts[s];
+        }
+    }
+}
+
+void BTNode::encodeValues()
+{
+    unsigned char* p = (unsigned char *)keys;
+    int s;
+
+    n = (int)pkeys.size();
+    for(s=0; s<n; s++){
+        memcpy(p, &pkeys[s], sizeof(KeyType));
+        p = putVarint(p + sizeof(KeyType), ((unsigned)pcounts[s] << 1) | (pheads[s] != -1 ? 1 : 0));
+        if(pheads[s] != -1){
+            memcpy(p, &pheads[s], sizeof(PageId));
+            p += sizeof(PageId);
+        }else{
+            memcpy(p, pvalues[s].data(), pcounts[s]);
+            p += pcounts[s];
+        }
+    }
+}
+
+/*
+ * Insert the (key, value) pair to the subtree of this NODE_CLUSTERED
+ * node, or replace the value of the key.
+ * @param key[IN] the key to insert
+ * @param value[IN] the value to store with the key
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
+ * @param replaced[OUT] whether the key was there already
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::insertValue(KeyType key, const string& value, TreeContext& ctx, PageFile& pf, bool& replaced)
+{
+    RC rc = 0;
+    int i = n - 1, s;
+    PageId head = -1, old = -1;
+
+    replaced = false;
+    if(!(format & NODE_CLUSTERED)) { rc = RC_UNSUPPORTED_MODE; goto ERROR; }
+    if(!isLeaf){
+        // the same descent as insertNonFull(): an equal key goes right,
+        // where a key equal to the separator is kept
+        BTNode node;
+        while(i>=0 && key < keys[i]) i--;
+        i++;
+        if( (rc = node.read(pids[i], pf)) != 0) goto ERROR;
+        node.level = level - 1;
+        if(node.isFull()){
+            if( (rc = splitChild(i, ctx, pf)) != 0) goto ERROR;
+            if( key >= keys[i])  i++;
+            if( (rc = node.read(pids[i], pf)) != 0) goto ERROR;
+            node.level = level - 1;
+        }
+        if( (rc = node.insertValue(key, value, ctx, pf, replaced)) != 0) goto ERROR;
+        return 0;
+    }
+
+    // a long value is written to its pages before the leaf points to them
+    if((int)value.size() > VALUE_INLINE_BYTES && (rc = writeValue(value, ctx, pf, head)) != 0) goto ERROR;
+    s = findSlot(key);
+    if(s < n && pkeys[s] == key){
+        old = pheads[s];
+        replaced = true;
+    }else{
+        pkeys.insert(pkeys.begin() + s, key);
+        pcounts.insert(pcounts.begin() + s, 0);
+        pheads.insert(pheads.begin() + s, -1);
+        pvalues.insert(pvalues.begin() + s, string());
+        n++;
+    }
+    pcounts[s] = (int)value.size();
+    pheads[s] = head;
+    if(head == -1) pvalues[s] = value;
+    else pvalues[s].clear();
+    DEBUG('i',"insert pid[%d] : key[%d] -> slot[%d] value:%d bytes\n",pid, key, s, pcounts[s]);
+
+    if(ctx.cache) ctx.cache->invalidate(pid);
+    if( (rc = write(pf)) != 0) goto ERROR;
+    if(old != -1 && (rc = freeValue(old, ctx, pf)) != 0) goto ERROR;
+    return 0;
+ERROR:
+    printf("insertValue error:%d\n",rc);
+    return rc;
+}
+
+/*
+ * Remove a key and its value from a NODE_CLUSTERED leaf.
+ * @param key[IN] the key to remove
+ * @param ctx[IN/OUT] page allocation and statistics of the tree
+ * @param pf[IN] PageFile to write to
+ * @param found[OUT] whether the key was found and removed
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::valueRemove(KeyType key, TreeContext& ctx, PageFile& pf, bool& found)
+{
+    RC rc = 0;
+    int s = findSlot(key);
+    PageId head;
+
+    found = false;
+    if(s == n || pkeys[s] != key) return 0;
+    head = pheads[s];
+    pkeys.erase(pkeys.begin() + s);
+    pcounts.erase(pcounts.begin() + s);
+    pheads.erase(pheads.begin() + s);
+    pvalues.erase(pvalues.begin() + s);
+    n--;
+    found = true;
+    DEBUG('i',"remove pid[%d] : key[%d] <- slot[%d]\n",pid, key, s);
+
+    if(ctx.cache) ctx.cache->invalidate(pid);
+    if( (rc = write(pf)) != 0) goto ERROR;
+    if(head != -1 && (rc = freeValue(head, ctx, pf)) != 0) goto ERROR;
+    return 0;
+ERROR:
+    printf("valueRemove error:%d\n",rc);
+    return rc;
+}
+
+/*
+ * Write a long value to new value pages. The pages are taken first, so
+ * every page is written once with its next page known, and a value
+ * written to new pages at the end of the file is read forward.
+ * @param value[IN] the value
+ * @param ctx[IN/OUT] page allocation of the tree
+ * @param pf[IN] PageFile to write to
+ * @param head[OUT] the first value page
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::writeValue(const string& value, TreeContext& ctx, PageFile& pf, PageId& head)
+{
+    RC rc;
+    BTNode page;
+    int j, size = (int)value.size();
+    vector<PageId> pages((size + VALUE_BYTES_PER_PAGE - 1)/VALUE_BYTES_PER_PAGE);
+
+    for(j = 0; j < (int)pages.size(); j++)
+        if( (rc = allocPage(ctx, pf, pages[j])) != 0) return rc;
+    page.setFormat(NODE_CLUSTERED | NODE_OVERFLOW);
+    for(j = 0; j < (int)pages.size(); j++){
+        page.pid = pages[j];
+        page.n = size - j*VALUE_BYTES_PER_PAGE;
+        if(page.n > VALUE_BYTES_PER_PAGE) page.n = VALUE_BYTES_PER_PAGE;
+        memcpy(page.keys, value.data() + j*VALUE_BYTES_PER_PAGE, page.n);
+        page.setNextNodePtr(j + 1 < (int)pages.size() ? pages[j+1] : -1);
+        if( (rc = page.write(pf)) != 0) return rc;
+    }
+    head = pages.empty() ? -1 : pages[0];
+    return 0;
+}
+
+/*
+ * Put the value pages starting at head on the free list.
+ * @param head[IN] the first value page
+ * @param ctx[IN/OUT] page allocation of the tree
+ * @param pf[IN] PageFile to write to
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::freeValue(PageId head, TreeContext& ctx, PageFile& pf)
+{
+    RC rc;
+    BTNode page;
+    PageId p, next;
+
+    for(p = head; p != -1; p = next){
+        if( (rc = page.read(p, pf)) != 0) return rc;
+        if(page.isLeaf || page.format != (NODE_CLUSTERED | NODE_OVERFLOW)) return RC_INVALID_FILE_FORMAT;
+        next = page.getNextNodePtr();
+        if( (rc = freePage(p, ctx, pf)) != 0) return rc;
+    }
+    return 0;
+}
+
+/*
+ * Read the value of the s-th key of a NODE_CLUSTERED leaf.
+ * @param s[IN] the index of the key
+ * @param pf[IN] the page file
+ * @param value[OUT] the value
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::readValue(int s, const PageFile& pf, string& value)
+{
+    RC rc;
+    BTNode page;
+    PageId p;
+
+    if(!isLeaf || !(format & NODE_CLUSTERED) || s < 0 || s >= n) return RC_INVALID_CURSOR;
+    if(pheads[s] == -1){
+        value = pvalues[s];
+        return 0;
+    }
+    value.clear();
+    value.reserve(pcounts[s]);
+    for(p = pheads[s]; p != -1 && (int)value.size() < pcounts[s]; p = page.getNextNodePtr()){
+        if( (rc = page.read(p, pf)) != 0) return rc;
+        if(page.isLeaf || page.format != (NODE_CLUSTERED | NODE_OVERFLOW)) return RC_INVALID_FILE_FORMAT;
+        if(page.n < 0 || page.n > VALUE_BYTES_PER_PAGE) return RC_INVALID_FILE_FORMAT;
+        value.append((const char *)page.keys, page.n);
+    }
+    if((int)value.size() != pcounts[s]) return RC_INVALID_FILE_FORMAT;
+    return 0;
+}
+
 int BTNode::getT()
 {
     int t = -1;
     if(isLeaf )    t = (KEYS_PER_LEAF_PAGE+1)/2;
+    else if(format & NODE_COUNTED)  t = (KEYS_PER_COUNTED_NONLEAF_PAGE+1)/2;
+    else if(format & NODE_BUFFERED)  t = (KEYS_PER_BUFFERED_NONLEAF_PAGE+1)/2;
     else  t = (KEYS_PER_NONLEAF_PAGE+1)/2;
     return t;
 }
@@ -245,13 +1549,29 @@ RC BTNode::locate(KeyType searchKey, const PageFile &pf,  IndexCursor& cursor)
     RC rc = 0;
     BTNode node;
     if(DebugIsEnabled('s')) printNode();
-    while( i < n && searchKey > keys[i] ){ //loop until keys[i] >= searchKey or until the end of keys list
-        i++;
+    if(isLeaf && (format & (NODE_POSTING | NODE_CLUSTERED))){
+        i = findSlot(searchKey);
+    }else{
+        while( i < n && searchKey > keys[i] ){ //loop until keys[i] >= searchKey or until the end of keys list
+            i++;
+        }
     }
     if(isLeaf){
         if(i < n) {
             cursor.pid = pid;
             cursor.eid = i;
+            if(format & NODE_POSTING){
+                // entry number of the first rid of the i-th key
+                cursor.eid = 0;
+                for(int s=0; s<i; s++)
+                    cursor.eid += (pheads[s] == -1) ? pcounts[s] : 1;
+            }
+        }else if(nextPage != -1){
+            // every key in this leaf is smaller than searchKey (a key equal to
+            // a separator is routed to the left child), so the first entry
+            // >= searchKey is the first entry of the next leaf.
+            cursor.pid = nextPage;
+            cursor.eid = 0;
         }else{
             cursor.pid = -1;
             cursor.eid = -1;
@@ -269,6 +1589,97 @@ ERROR:
     return rc;
 }
 
+/*
+ * Return the number of entries in the subtree of this node.
+ * @return the number of (key, rid) entries, -1 if not known
+ */
+int BTNode::getEntryCount()
+{
+    int i, sum = 0;
+    if(isLeaf && (format & NODE_POSTING)){
+        for(i=0; i<n; i++)
+            sum += pcounts[i];
+        return sum;
+    }
+    if(isLeaf) return n;
+    if(!(format & NODE_COUNTED)) return -1;
+    for(i=0; i<=n; i++)
+        sum += counts[i];
+    return sum;
+}
+
+/*
+ * Count the entries in the subtree whose key is smaller than searchKey
+ * (or smaller than or equal to, if inclusive).
+ * Every child left of the one we descend into only holds smaller keys,
+ * so its whole count is added without reading it.
+ * @param searchKey[IN] the key to rank
+ * @param inclusive[IN] also count the entries equal to searchKey
+ * @param pf[IN] the page file
+ * @param rank[IN/OUT] incremented by the number of entries
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::rank(KeyType searchKey, bool inclusive, const PageFile& pf, int& rank)
+{
+    int i = 0, j;
+    RC rc = 0;
+    BTNode node;
+    while( i < n && (inclusive ? keys[i] <= searchKey : keys[i] < searchKey) ) i++;
+    if(isLeaf){
+        rank += i;
+        return 0;
+    }
+    if(!(format & NODE_COUNTED)) return RC_UNSUPPORTED_MODE;
+    for(j=0; j<i; j++)
+        rank += counts[j];
+    rc = node.read(pids[i], pf);
+    if(rc != 0) goto ERROR;
+    rc = node.rank(searchKey, inclusive, pf, rank);
+    if(rc != 0) goto ERROR;
+    return 0;
+ERROR:
+    printf("rank error\n");
+    return rc;
+}
+
+/*
+ * Find the k-th entry (counting from 0) of the subtree.
+ * @param k[IN] the position of the entry in key order
+ * @param pf[IN] the page file
+ * @param cursor[OUT] the cursor pointing to the entry.
+ *                    Return cursor.pid = -1 if there are not enough entries.
+ * @return 0 if successful. Return an error code if there is an error.
+ */
+RC BTNode::select(int k, const PageFile& pf, IndexCursor& cursor)
+{
+    int i = 0;
+    RC rc = 0;
+    BTNode node;
+    if(isLeaf){
+        if(k >= 0 && k < n){
+            cursor.pid = pid;
+            cursor.eid = k;
+        }else{
+            cursor.pid = -1;
+            cursor.eid = -1;
+        }
+        return 0;
+    }
+    if(!(format & NODE_COUNTED)) return RC_UNSUPPORTED_MODE;
+    while( i < n && k >= counts[i] ){
+        k -= counts[i];
+        i++;
+    }
+    rc = node.read(pids[i], pf);
+    if(rc != 0) goto ERROR;
+    rc = node.select(k, pf, cursor);
+    if(rc != 0) goto ERROR;
+    return 0;
+ERROR:
+    printf("select error\n");
+    return rc;
+}
+
 /*
  * Read the (key, rid) pair from the eid entry.
  * @param eid[IN] the entry number to read the (key, rid) pair from
@@ -279,10 +1690,30 @@ ERROR:
 RC BTNode::readEntry(int eid, KeyType& key, RecordId& rid)
 {
     RC rc;
-    if(!isLeaf || eid > n || eid <0){
+    if(!isLeaf || eid >= getPositionCount() || eid <0){
         rc = -1;
         goto ERROR;
     }
+    if(format & NODE_CLUSTERED){
+        key = pkeys[eid];
+        rid.pid = -1;
+        rid.sid = -1;
+        return 0;
+    }
+    if(format & NODE_POSTING){
+        for(int s=0; s<n; s++){
+            if(pheads[s] != -1){
+                if(eid == 0) { rc = RC_INVALID_CURSOR; goto ERROR; } // see getOverflowPage()
+                eid--;
+            }else if(eid < pcounts[s]){
+                key = pkeys[s];
+                rid = prids[s][eid];
+                return 0;
+            }else{
+                eid -= pcounts[s];
+            }
+        }
+    }
     key = keys[eid];
     rid.pid = rids[eid].pid;
     rid.sid = rids[eid].sid;
@@ -292,6 +1723,51 @@ ERROR:
     return rc;
 }
 
+/*
+ * Return the key of the eid entry of a leaf node, or the eid separator
+ * key of a non-leaf node.
+ * @param eid[IN] the entry number
+ * @return the key
+ */
+KeyType BTNode::getKey(int eid)
+{
+    if(isLeaf && (format & (NODE_POSTING | NODE_CLUSTERED))) return pkeys[eid];
+    return keys[eid];
+}
+
+/*
+ * Return the # entry numbers of a leaf.
+ * @return the end for readEntry()
+ */
+int BTNode::getPositionCount()
+{
+    int s, count = 0;
+    if(!(isLeaf && (format & NODE_POSTING))) return n;
+    for(s=0; s<n; s++)
+        count += (pheads[s] == -1) ? pcounts[s] : 1;
+    return count;
+}
+
+/*
+ * Return the first overflow page of the eid entry of a NODE_POSTING leaf.
+ * @param eid[IN] the entry number
+ * @return the PageId of the overflow page, -1 if the rids are inline
+ */
+PageId BTNode::getOverflowPage(int eid)
+{
+    int s;
+    if(!(isLeaf && (format & NODE_POSTING))) return -1;
+    for(s=0; s<n && eid >= 0; s++){
+        if(pheads[s] != -1){
+            if(eid == 0) return pheads[s];
+            eid--;
+        }else{
+            eid -= pcounts[s];
+        }
+    }
+    return -1;
+}
+
 /*
  * Return the pid of the next slibling node.
  * @return the PageId of the next sibling node 
@@ -331,7 +1807,25 @@ RC BTNode::initializeRoot(PageId pid1, KeyType key, PageId pid2)
 void BTNode::printNode()
 {
     int i;
-    if(isLeaf){
+    if(isLeaf && (format & NODE_POSTING)){
+        printf("pid:%d n:%d bytes:%d/%d nextPage:%d\n", pid, n, postingBytes(), POSTING_BYTES, nextPage);
+        for(i=0; i<n; i++){
+            printf("position:%d\t\tkey:%d\t\trids:%d", i, pkeys[i], pcounts[i]);
+            if(pheads[i] != -1) printf("\t\toverflow:%d..%d", pheads[i], ptails[i]);
+            printf("\n");
+        }
+    }else if(isLeaf && (format & NODE_CLUSTERED)){
+        printf("pid:%d n:%d bytes:%d/%d nextPage:%d\n", pid, n, postingBytes(), POSTING_BYTES, nextPage);
+        for(i=0; i<n; i++){
+            printf("position:%d\t\tkey:%d\t\tvalue:%d bytes", i, pkeys[i], pcounts[i]);
+            if(pheads[i] != -1) printf("\t\tpages from:%d", pheads[i]);
+            printf("\n");
+        }
+    }else if(format & NODE_CLUSTERED){
+        printf("pid:%d value page n:%d nextPage:%d\n", pid, n, nextPage);
+    }else if(format & NODE_OVERFLOW){
+        printf("pid:%d overflow key:%d n:%d nextPage:%d\n", pid, pkeys[0], n, nextPage);
+    }else if(isLeaf){
         printf("pid:%d n:%d Max_n:%d t:%d nextPage:%d\n", pid, n, KEYS_PER_LEAF_PAGE, getT(), nextPage);
         for(i=0; i<n; i++){
             printf("position:%d\t\tkey:%d\t\trid:{%d,%d}\n",i, keys[i], rids[i].pid, rids[i].sid);
@@ -340,9 +1834,14 @@ void BTNode::printNode()
         printf("pid:%d n:%d Max_n:%d t:%d\n", pid, n, KEYS_PER_NONLEAF_PAGE, getT());
         for(i=0; i<n; i++){
             printf("position:%d\tpid:%d\n",i, pids[i]);
+            if(format & NODE_COUNTED) printf("position:%d\tcount:%d\n",i, counts[i]);
             printf("position:%d\t\tkey:%d\n",i, keys[i]);
         }
         printf("position:%d\tpid:%d\n",i, pids[i]);
+        if(format & NODE_COUNTED) printf("position:%d\tcount:%d\n",i, counts[i]);
+        for(i=0; i<m; i++){
+            printf("message:%d\t\tkey:%d\t\top:%d\trid:{%d,%d}\n",i, msgs[i].key, msgs[i].op, msgs[i].rid.pid, msgs[i].rid.sid);
+        }
     }
     printf("\n");
 }
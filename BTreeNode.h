@@ -3,6 +3,8 @@
 
 #include "RecordFile.h"
 #include "PageFile.h"
+#include <vector>
+#include <string>
 typedef int KeyType;
 /**
  * The data structure to point to a particular entry at a b+tree leaf node.
@@ -17,6 +19,50 @@ typedef struct {
   int     eid;
 } IndexCursor;
 
+class KeyCache;
+class InnerLevels;
+
+// the number of tree levels the header page keeps statistics for
+const int MAX_TREE_HEIGHT = 16;
+
+/**
+ * Statistics of a b+tree, kept in the index header page.
+ * levelPages[0] is the number of leaf nodes, levelPages[1] the number of
+ * non leaf nodes right above the leaves, and so on up to the root.
+ */
+typedef struct {
+  KeyType minKey;                      // smallest key in the tree
+  KeyType maxKey;                      // largest key in the tree
+  int     entryCount;                  // # (key, rid) entries
+  int     levelPages[MAX_TREE_HEIGHT]; // # nodes on every level
+  int     freePages;                   // # pages on the free list
+} TreeStats;
+
+/**
+ * Tree-wide state handed down the insert and remove paths. Nodes take
+ * their new pages from it (see BTNode::allocPage), return freed pages to
+ * it and count their splits and merges in it, so that the index can
+ * keep the header page up to date without reading the tree again.
+ * Leaves changed on the way are invalidated in the lookup cache.
+ */
+typedef struct {
+  PageId    newPid;   // the next unused page id
+  PageId    freeHead; // the first page of the free list, 0 if it is empty
+  TreeStats stats;
+  KeyCache* cache;    // the point lookup cache, NULL if there is none
+  InnerLevels* inner; // the resident non leaf nodes, NULL if there are none
+} TreeContext;
+
+
+/**
+ * A pending update kept in the buffer of a NODE_BUFFERED non leaf node
+ * until it is flushed down towards the leaves.
+ */
+typedef struct {
+  KeyType  key;
+  RecordId rid;
+  int      op;    // BTNode::MSG_*
+} BTMessage;
 
 /**
  * BTLeafNode: The class representing a B+tree leaf node.
@@ -28,12 +74,61 @@ private:
     
     RecordId * rids;
     PageId nextPage;
+    void setLayout();
+    void leafInsert(KeyType key, const RecordId& rid);
+    RC rebalance(int i, BTNode& child, TreeContext& ctx, PageFile& pf);
+
+    //NODE_POSTING leaves and NODE_OVERFLOW pages
+    void decodePostings();
+    void encodePostings();
+    int slotBytes(int s);
+    int postingBytes();
+    int findSlot(KeyType key);
+    void splitPostings(BTNode& right);
+    void movePostings(BTNode& to);
+    RC postingInsert(KeyType key, const RecordId& rid, TreeContext& ctx, PageFile& pf);
+    RC postingRemove(KeyType key, const RecordId& rid, TreeContext& ctx, PageFile& pf, bool& found);
+    RC spillPostings(int s, TreeContext& ctx, PageFile& pf);
+    RC overflowInsert(int s, const RecordId& rid, TreeContext& ctx, PageFile& pf);
+    RC overflowRemove(int s, const RecordId& rid, TreeContext& ctx, PageFile& pf, bool& found);
+
+    //NODE_CLUSTERED leaves and their value pages
+    void decodeValues();
+    void encodeValues();
+    RC valueRemove(KeyType key, TreeContext& ctx, PageFile& pf, bool& found);
+    RC writeValue(const std::string& value, TreeContext& ctx, PageFile& pf, PageId& head);
+    RC freeValue(PageId head, TreeContext& ctx, PageFile& pf);
 public:
     //key count
     int n;
     bool isLeaf;
+    //NODE_* format flags shared by all nodes of a tree
+    unsigned char format;
     PageId * pids;
+    //entry count of the subtree under pids[i], only in NODE_COUNTED non leaf nodes
+    int * counts;
+    //pending messages, oldest first, only in NODE_BUFFERED non leaf nodes
+    BTMessage * msgs;
+    //message count
+    int m;
+    //NODE_POSTING leaves are decoded into these by read() and encoded
+    //again by write(): the n distinct keys, the # rids of each key, the
+    //rids in RecordId order, and the first and last overflow page of a
+    //hot key whose rids moved out of the leaf (-1 if they are inline).
+    //A NODE_OVERFLOW page holds pkeys[0] and its n rids in prids[0].
+    //NODE_CLUSTERED leaves are decoded into pkeys, the length of every
+    //value in pcounts, and either the value in pvalues or the first page
+    //of its value pages in pheads (-1 if the value is inline).
+    std::vector<KeyType> pkeys;
+    std::vector<int> pcounts;
+    std::vector< std::vector<RecordId> > prids;
+    std::vector<PageId> pheads;
+    std::vector<PageId> ptails;
+    std::vector<std::string> pvalues;
     PageId pid;
+    //distance from the leaf level (0 for leaves), only known to nodes
+    //read on the way down from the root; it is not stored in the page
+    int level;
     /**
     * The main memory buffer for loading the content of the disk page 
     * that contains the node.
@@ -49,6 +144,39 @@ public:
     //first 1 byte store node type(1 leaf, 0 nonleaf), 4 bytes store # keys,  
     static const int KEYS_PER_NONLEAF_PAGE=(PageFile::PAGE_SIZE-sizeof(bool)-sizeof(int)-sizeof(PageId))/(sizeof(KeyType)+sizeof(PageId))-1;  
     static const int PIDS_PER_PAGE =  KEYS_PER_NONLEAF_PAGE + 1;
+    //NODE_COUNTED non leaf nodes also store one int count per pid
+    static const int KEYS_PER_COUNTED_NONLEAF_PAGE=(PageFile::PAGE_SIZE-sizeof(bool)-sizeof(int)-sizeof(PageId))/(sizeof(KeyType)+sizeof(PageId)+sizeof(int))-1;
+
+    //format flags, stored in the first byte together with the leaf flag
+    static const unsigned char NODE_LEAF    = 0x01;
+    static const unsigned char NODE_COUNTED = 0x02; //non leaf entries carry subtree entry counts
+    static const unsigned char NODE_BUFFERED = 0x04; //non leaf nodes buffer pending messages
+    static const unsigned char NODE_POSTING = 0x08; //leaves store every key once with its compressed rids
+    static const unsigned char NODE_CLUSTERED = 0x10; //leaves store every key once with its value instead of a rid
+    static const unsigned char NODE_OVERFLOW = 0x40; //page holds more compressed rids of a hot key, or a part of
+                                                     //a long value with NODE_CLUSTERED; nextPage links them
+    static const unsigned char NODE_FREE    = 0x80; //page is on the free list, nextPage links the list
+
+    //NODE_POSTING leaves: the bytes for the encoded keys and rids, the bytes
+    //an insert may need (a full leaf is split before an insert), and the size
+    //of the rid list of one key from which on it moves to overflow pages
+    static const int POSTING_BYTES = PageFile::PAGE_SIZE-sizeof(bool)-sizeof(int)-sizeof(PageId);
+    static const int POSTING_RESERVE = 32;
+    static const int POSTING_INLINE_BYTES = PageFile::PAGE_SIZE/8;
+
+    //NODE_CLUSTERED leaves: the longest value kept in the leaf (longer ones
+    //go to value pages), the bytes an insert may need, and the value bytes
+    //of one value page
+    static const int VALUE_INLINE_BYTES = PageFile::PAGE_SIZE/8;
+    static const int VALUE_RESERVE = sizeof(KeyType) + 5 + VALUE_INLINE_BYTES;
+    static const int VALUE_BYTES_PER_PAGE = POSTING_BYTES;
+
+    //NODE_BUFFERED non leaf nodes give up most of their fanout for the message buffer
+    static const int KEYS_PER_BUFFERED_NONLEAF_PAGE = 63;
+    static const int MESSAGES_PER_PAGE = (PageFile::PAGE_SIZE-sizeof(bool)-sizeof(int)-sizeof(PageId)-KEYS_PER_BUFFERED_NONLEAF_PAGE*sizeof(KeyType)-(KEYS_PER_BUFFERED_NONLEAF_PAGE+1)*sizeof(PageId)-sizeof(int))/sizeof(BTMessage);
+
+    //message operations
+    static const int MSG_INSERT = 1;
 
     BTNode();
     BTNode(const BTNode& n);
@@ -58,21 +186,96 @@ public:
     * Remember that all keys inside a B+tree node should be kept sorted.
     * @param key[IN] the key to insert
     * @param rid[IN] the RecordId to insert
+    * @param ctx[IN/OUT] page allocation and statistics of the tree
+    * @param pf[IN] PageFile to write to
     * @return 0 if successful. Return an error code if the node is full.
     */
-    RC insertNonFull(KeyType, const RecordId&, int&, PageFile&);
+    RC insertNonFull(KeyType, const RecordId&, TreeContext&, PageFile&);
+
+   /**
+    * Insert the (key, value) pair to the subtree of this NODE_CLUSTERED
+    * node, which must not be full, or replace the value if the key is
+    * there already. The full nodes on the way down are split first.
+    * @param key[IN] the key to insert
+    * @param value[IN] the value to store with the key
+    * @param ctx[IN/OUT] page allocation and statistics of the tree
+    * @param pf[IN] PageFile to write to
+    * @param replaced[OUT] whether the key was there already
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC insertValue(KeyType key, const std::string& value, TreeContext& ctx, PageFile& pf, bool& replaced);
    /**
-    * Insert the (key, rid) pair to the node
-    * and split the node half and half with sibling.
-    * The first key of the sibling node is returned in siblingKey.
+    * Split the full child pids[i] half and half with a new sibling
+    * taken from ctx.newPid, and insert the separator key into this node.
     * Remember that all keys inside a B+tree node should be kept sorted.
-    * @param key[IN] the key to insert.
-    * @param rid[IN] the RecordId to insert.
-    * @param sibling[IN] the sibling node to split with. This node MUST be EMPTY when this function is called.
-    * @param siblingKey[OUT] the first key in the sibling node after split.
+    * @param i[IN] the index of the child to split.
+    * @param ctx[IN/OUT] page allocation and statistics of the tree
+    * @param pf[IN] PageFile to write to
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC splitChild(int i, TreeContext&, PageFile&);
+
+   /**
+    * Remove the entry (key, rid) from the subtree of this node.
+    * Entries with an equal key may be spread over several children, so
+    * they are tried from left to right. Merging is lazy: only a child
+    * that drops below a quarter full (see isUnderfull()) is merged with a
+    * sibling, or refilled from it if the merged node would be more than
+    * three quarters full, so that a few inserts cannot split it again.
+    * The node is written if it changed. Needs the level of this node.
+    * A NODE_CLUSTERED leaf holds every key once, so there the rid is not
+    * compared, and the value pages of the key are freed.
+    * @param key[IN] the key of the entry
+    * @param rid[IN] the RecordId of the entry
+    * @param ctx[IN/OUT] page allocation and statistics of the tree
+    * @param pf[IN] PageFile to write to
+    * @param found[OUT] whether the entry was found and removed
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC remove(KeyType key, const RecordId& rid, TreeContext& ctx, PageFile& pf, bool& found);
+
+   /**
+    * @return true if the node is less than a quarter full
+    */
+    bool isUnderfull();
+
+   /**
+    * @return true if the node must be split before an insert
+    */
+    bool isFull();
+
+   /**
+    * Repack the leaf children of this bottom non leaf node into as few
+    * leaves as hold their entries at the given fill. The first leaves
+    * keep their pages, the pages of the others go to the free list, so
+    * the leaves left are pids[0..n] again. This node and the leaves are
+    * written. NODE_POSTING leaves are not repacked.
+    * @param fillFactor[IN] the fill of the repacked leaves, 0 < fillFactor <= 1
+    * @param ctx[IN/OUT] page allocation and statistics of the tree
+    * @param pf[IN] PageFile to write to
+    * @param freed[OUT] the # leaves that went away
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC compactLeaves(double fillFactor, TreeContext& ctx, PageFile& pf, int& freed);
+
+   /**
+    * Take a page for a new node: the first page of the free list, or a
+    * new page at the end of the file.
+    * @param ctx[IN/OUT] page allocation of the tree
+    * @param pf[IN] the page file
+    * @param pid[OUT] the page to use
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    static RC allocPage(TreeContext& ctx, const PageFile& pf, PageId& pid);
+
+   /**
+    * Put the page of a removed node on the free list.
+    * @param pid[IN] the page to free
+    * @param ctx[IN/OUT] page allocation of the tree
+    * @param pf[IN] PageFile to write to
     * @return 0 if successful. Return an error code if there is an error.
     */
-    RC splitChild(int i, int newPid, PageFile&);
+    static RC freePage(PageId pid, TreeContext& ctx, PageFile& pf);
 
     /*
      * Find the entry whose key value is larger than or equal to searchKey
@@ -88,6 +291,8 @@ public:
 
    /**
     * Read the (key, rid) pair from the eid entry.
+    * A NODE_CLUSTERED leaf has no rids, its entries give rid {-1, -1};
+    * see readValue().
     * @param eid[IN] the entry number to read the (key, rid) pair from
     * @param key[OUT] the key from the slot
     * @param rid[OUT] the RecordId from the slot
@@ -95,6 +300,59 @@ public:
     */
     RC readEntry(int eid, KeyType& key, RecordId& rid);
 
+   /**
+    * Return the # entry numbers of a leaf, i.e. the end for readEntry().
+    * In a NODE_POSTING leaf every inline rid has its own entry number,
+    * while a key whose rids are in overflow pages has just one. In a
+    * NODE_CLUSTERED leaf it is the index of the key.
+    * @return the # entry numbers
+    */
+    int getPositionCount();
+
+   /**
+    * Return the first overflow page of the eid entry of a NODE_POSTING
+    * leaf, where readEntry() cannot read the rids from.
+    * @param eid[IN] the entry number
+    * @return the PageId of the overflow page, -1 if the rids are inline
+    */
+    PageId getOverflowPage(int eid);
+
+   /**
+    * Read all rids of the s-th key of a NODE_POSTING leaf, from the
+    * leaf or by walking its overflow pages.
+    * @param s[IN] the index of the key, 0 <= s < n
+    * @param pf[IN] the page file
+    * @param rids[OUT] the rids in RecordId order
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC readPostings(int s, const PageFile& pf, std::vector<RecordId>& rids);
+
+   /**
+    * Read the value of the s-th key of a NODE_CLUSTERED leaf, from the
+    * leaf or by walking its value pages.
+    * @param s[IN] the index of the key, 0 <= s < n
+    * @param pf[IN] the page file
+    * @param value[OUT] the value
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC readValue(int s, const PageFile& pf, std::string& value);
+
+   /**
+    * Return the key of the eid entry of a leaf node, or the eid separator
+    * key of a non-leaf node. The caller must make sure 0 <= eid < n.
+    * For a NODE_POSTING leaf eid is the index of a distinct key.
+    * @param eid[IN] the entry number
+    * @return the key
+    */
+    KeyType getKey(int eid);
+
+   /**
+    * Return the # bytes of the page the node uses, its header included.
+    * A NODE_FREE page uses none.
+    * @return the # bytes used
+    */
+    int getUsedBytes();
+
    /**
     * Return the pid of the next slibling node.
     * @return the PageId of the next sibling node 
@@ -140,6 +398,73 @@ public:
     RC write(PageFile& pf);
 
 
+   /**
+    * Set the format flags of the node and rearrange the entry arrays.
+    * Must be called before the node is filled.
+    * @param f[IN] NODE_* format flags (without NODE_LEAF)
+    */
+    void setFormat(unsigned char f);
+
+   /**
+    * Return the index of the child whose subtree holds searchKey,
+    * following the same rule as locate(): an equal separator goes left.
+    * @param searchKey[IN] the key to route
+    * @return the index into pids
+    */
+    int searchChild(KeyType searchKey);
+
+   /**
+    * Move a batch of pending messages of this NODE_BUFFERED node one level
+    * down: the messages of the child that receives the most of them are
+    * applied to it if it is a leaf, or appended to its buffer otherwise
+    * (flushing that buffer first when it has no room). A full child is
+    * split first, so this node must not be full.
+    * @param ctx[IN/OUT] page allocation and statistics of the tree
+    * @param pf[IN] PageFile to write to
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC flush(TreeContext& ctx, PageFile& pf);
+
+   /**
+    * Find the most recent pending message for searchKey in the buffers on
+    * the path from this node down to the leaf level. Needs the level
+    * of this node.
+    * @param searchKey[IN] the key to find
+    * @param pf[IN] the page file
+    * @param msg[OUT] the message found
+    * @param found[OUT] whether a message was found
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC findMessage(KeyType searchKey, const PageFile& pf, BTMessage& msg, bool& found);
+
+   /**
+    * Return the number of entries in the subtree of this node.
+    * For a non leaf node this needs the NODE_COUNTED format.
+    * @return the number of (key, rid) entries below the node
+    */
+    int getEntryCount();
+
+   /**
+    * Count the entries in the subtree whose key is smaller than searchKey
+    * (or smaller than or equal to, if inclusive). Needs NODE_COUNTED.
+    * @param searchKey[IN] the key to rank
+    * @param inclusive[IN] also count the entries equal to searchKey
+    * @param pf[IN] the page file
+    * @param rank[OUT] the number of entries
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC rank(KeyType searchKey, bool inclusive, const PageFile& pf, int& rank);
+
+   /**
+    * Find the k-th entry (counting from 0) of the subtree. Needs NODE_COUNTED.
+    * @param k[IN] the position of the entry in key order
+    * @param pf[IN] the page file
+    * @param cursor[OUT] the cursor pointing to the entry.
+    *                    Return cursor.pid = -1 if there are not enough entries.
+    * @return 0 if successful. Return an error code if there is an error.
+    */
+    RC select(int k, const PageFile& pf, IndexCursor& cursor);
+
     int getT();
     void printNode();
         
@@ -0,0 +1,485 @@
+//Benchmark driver for BTreeIndex and RecordFile with YCSB style workloads
+//
+//usage: Benchmark [-n records] [-o ops] [-d seq|uniform|zipf] [-t theta]
+//                 [-w mix] [-L length] [-l bulk|incremental] [-v bytes]
+//                 [-c cold|warm|inner] [-f prefix] [-s seed]
+//
+//  -n  # records loaded before the run (default 100000)
+//  -o  # operations of the run (default 100000)
+//  -d  the keys: seq loads and inserts ascending keys and reads them in
+//      order, uniform and zipf scatter the keys over the key space and
+//      pick them uniformly or Zipfian (default uniform)
+//  -t  the skew of zipf (default 0.99)
+//  -w  the read/update/insert/scan percentages, e.g. 90/0/5/5, or a YCSB
+//      preset: a (50/50/0/0), b (95/5/0/0), c (100/0/0/0), e (0/0/5/95)
+//      (default b)
+//  -L  the longest scan; a scan reads 1..L entries and their records
+//      (default 100)
+//  -l  incremental loads the records one by one in key order of -d; bulk
+//      appends and inserts them sorted by key and packs the leaves with
+//      defragment() (default incremental)
+//  -v  the value size in bytes (default 100)
+//  -c  the page cache state at the start of the run: cold opens the files
+//      again, warm also reads every page once (into the OS cache), inner
+//      also keeps the non leaf levels in memory (default cold)
+//  -f  the files prefix.tbl and prefix.idx, replaced (default bench)
+//  -s  the random seed (default 1)
+//
+//Prints one "name value" pair per line, like IndexAnalyzer, so that two
+//runs can be compared by a script: the load and run throughput, for every
+//operation type the latency percentiles in microseconds and the page reads
+//and writes per operation, and the bytes on disk per key.
+//PageFile is built without its page cache (NOCACHE), so cold means cold
+//for this process only; drop the OS cache before the run for a cold disk.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <climits>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+using namespace std;
+
+#include "BTreeIndex.h"
+#include "RecordFile.h"
+
+enum { OP_READ, OP_UPDATE, OP_INSERT, OP_SCAN, OP_TYPES };
+static const char* opNames[OP_TYPES] = { "read", "update", "insert", "scan" };
+
+enum { KEYS_SEQ, KEYS_UNIFORM, KEYS_ZIPF };
+
+typedef struct {
+  long long records;
+  long long ops;
+  int       keys;        // KEYS_*
+  double    theta;
+  int       mix[OP_TYPES]; // percentages
+  int       scanLength;
+  bool      bulk;
+  int       valueBytes;
+  string    cache;
+  string    prefix;
+  unsigned long long seed;
+} BenchConfig;
+
+// the latencies and page counts of one operation type
+typedef struct {
+  vector<long long> nanos;
+  long long pageReads;
+  long long pageWrites;
+  long long errors;
+} OpStats;
+
+static unsigned long long rngState;
+
+// xorshift64*, the same sequence on every platform
+static unsigned long long nextRandom()
+{
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return rngState * 2685821657736338717ULL;
+}
+
+// uniform in [0, 1)
+static double nextDouble()
+{
+  return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long long nowNanos()
+{
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * One round of the Feistel network of keyOf(): mixes a 16 bit half with
+ * the round key.
+ */
+static unsigned feistelRound(unsigned half, unsigned long long seed, int round)
+{
+  unsigned x = half ^ (unsigned)(seed >> (round * 16)) ^ (unsigned)(seed * (round + 1));
+
+  x *= 0x9E3779B1u;
+  x ^= x >> 16;
+  x *= 0x85EBCA6Bu;
+  x ^= x >> 13;
+  return x & 0xffff;
+}
+
+/*
+ * The key of the item-th record. seq keeps the item number; the other
+ * distributions spread the items over the positive keys with a random
+ * permutation of the 31 bit numbers keyed by the seed, so the keys are
+ * unique and an incremental load inserts them in random order. The
+ * permutation is a 4 round Feistel network over 32 bits, walked again
+ * while the result has the top bit set.
+ */
+static KeyType keyOf(const BenchConfig& config, long long item)
+{
+  unsigned x = (unsigned)item & 0x7fffffff;
+  unsigned left, right, t;
+  int round;
+
+  if(config.keys == KEYS_SEQ) return (KeyType)item;
+  do {
+    left = x >> 16;
+    right = x & 0xffff;
+    for(round = 0; round < 4; round++){
+      t = right;
+      right = left ^ feistelRound(right, config.seed, round);
+      left = t;
+    }
+    x = (left << 16) | right;
+  } while(x > 0x7fffffff);
+  return (KeyType)x;
+}
+
+static string valueOf(const BenchConfig& config, KeyType key)
+{
+  return string(config.valueBytes, (char)('a' + (unsigned)key % 26));
+}
+
+/*
+ * The Zipfian generator of YCSB (after Gray et al., "Quickly generating
+ * billion-record synthetic databases"): item 0 is the most popular, over
+ * the items loaded before the run.
+ */
+typedef struct {
+  long long items;
+  double    theta;
+  double    zetan;
+  double    alpha;
+  double    eta;
+} Zipf;
+
+static void initZipf(Zipf& z, long long items, double theta)
+{
+  double zeta2 = 1 + pow(0.5, theta);
+
+  z.items = items;
+  z.theta = theta;
+  z.zetan = 0;
+  for(long long i = 1; i <= items; i++)
+    z.zetan += 1 / pow((double)i, theta);
+  z.alpha = 1 / (1 - theta);
+  z.eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / z.zetan);
+}
+
+static long long nextZipf(const Zipf& z)
+{
+  double u = nextDouble();
+  double uz = u * z.zetan;
+  long long item;
+
+  if(uz < 1) return 0;
+  if(uz < 1 + pow(0.5, z.theta)) return 1;
+  item = (long long)(z.items * pow(z.eta * u - z.eta + 1, z.alpha));
+  return item < z.items ? item : z.items - 1;
+}
+
+static bool keyItemLess(const pair<KeyType, long long>& a, const pair<KeyType, long long>& b)
+{
+  return a.first < b.first;
+}
+
+static RC openFiles(const BenchConfig& config, RecordFile& rf, BTreeIndex& index)
+{
+  RC rc;
+
+  if((rc = rf.open(config.prefix + ".tbl", 'w')) < 0) return rc;
+  if((rc = index.open(config.prefix + ".idx", 'w')) < 0){
+    rf.close();
+    return rc;
+  }
+  return 0;
+}
+
+/*
+ * Load the records before the run, and report the load.
+ */
+static RC load(const BenchConfig& config)
+{
+  RC rc;
+  RecordFile rf;
+  BTreeIndex index;
+  RecordId rid;
+  vector<pair<KeyType, long long> > order;
+  long long start, reads, writes, i;
+  bool done = false;
+
+  remove((config.prefix + ".tbl").c_str());
+  remove((config.prefix + ".idx").c_str());
+  if((rc = openFiles(config, rf, index)) < 0) return rc;
+
+  for(i = 0; i < config.records; i++)
+    order.push_back(make_pair(keyOf(config, i), i));
+  if(config.bulk) sort(order.begin(), order.end(), keyItemLess);
+
+  start = nowNanos();
+  reads = PageFile::getPageReadCount();
+  writes = PageFile::getPageWriteCount();
+  for(i = 0; i < config.records; i++){
+    KeyType key = order[i].first;
+    if((rc = rf.append(key, valueOf(config, key), rid)) < 0) goto ERROR;
+    if((rc = index.insert(key, rid)) < 0) goto ERROR;
+  }
+  // sorted inserts leave the leaves half full; pack them
+  while(config.bulk && !done)
+    if((rc = index.defragment(1.0, 0, done)) < 0) goto ERROR;
+  if((rc = rf.flush()) < 0) goto ERROR;
+  {
+    double seconds = (nowNanos() - start) / 1e9;
+    printf("load.mode %s\n", config.bulk ? "bulk" : "incremental");
+    printf("load.records %lld\n", config.records);
+    printf("load.seconds %.3f\n", seconds);
+    printf("load.ops_per_sec %.1f\n", seconds > 0 ? config.records / seconds : 0.0);
+    printf("load.page_reads %lld\n", (long long)PageFile::getPageReadCount() - reads);
+    printf("load.page_writes %lld\n", (long long)PageFile::getPageWriteCount() - writes);
+  }
+  index.close();
+  return rf.close();
+ERROR:
+  fprintf(stderr, "load error %d\n", rc);
+  index.close();
+  rf.close();
+  return rc;
+}
+
+/*
+ * Bring the page cache into the state of config.cache: read every page
+ * of both files once for warm and inner.
+ */
+static RC warmUp(const BenchConfig& config, RecordFile& rf, BTreeIndex& index)
+{
+  RC rc;
+  IndexCursor cursor;
+  KeyType key;
+  RecordId rid;
+  int records, usedBytes;
+  bool overflow;
+
+  if(config.cache == "cold") return 0;
+  if((rc = index.locate(INT_MIN, cursor)) < 0) return rc;
+  while(cursor.pid != -1)
+    if((rc = index.readForward(cursor, key, rid)) < 0) return rc;
+  for(PageId pid = 0; pid < rf.endPid(); pid++)
+    if((rc = rf.getPageUsage(pid, records, usedBytes, overflow)) < 0) return rc;
+  if(config.cache == "inner") return index.enableInnerLevels();
+  return 0;
+}
+
+static int pickOp(const BenchConfig& config)
+{
+  int r = (int)(nextRandom() % 100), op;
+
+  for(op = 0; op < OP_TYPES - 1; op++){
+    if(r < config.mix[op]) return op;
+    r -= config.mix[op];
+  }
+  return OP_SCAN;
+}
+
+static RC runOp(const BenchConfig& config, int op, KeyType key, long long& items,
+                RecordFile& rf, BTreeIndex& index)
+{
+  RC rc;
+  IndexCursor cursor;
+  RecordId rid;
+  KeyType k;
+  string value;
+  vector<RecordId> rids;
+  vector<int> keys;
+  vector<string> values;
+  int length;
+
+  switch(op){
+  case OP_READ:
+    if((rc = index.find(key, cursor, rid)) < 0) return rc;
+    return rf.read(rid, k, value);
+  case OP_UPDATE:
+    if((rc = index.find(key, cursor, rid)) < 0) return rc;
+    return rf.update(rid, key, valueOf(config, key + 1));
+  case OP_INSERT:
+    key = keyOf(config, items++);
+    if((rc = rf.append(key, valueOf(config, key), rid)) < 0) return rc;
+    return index.insert(key, rid);
+  default:
+    // a range scan reads its records with one batch fetch
+    length = 1 + (int)(nextRandom() % config.scanLength);
+    if((rc = index.locate(key, cursor)) < 0) return rc;
+    while(cursor.pid != -1 && (int)rids.size() < length){
+      if((rc = index.readForward(cursor, k, rid)) < 0) return rc;
+      rids.push_back(rid);
+    }
+    return rf.fetch(rids, keys, values);
+  }
+}
+
+static double percentile(const vector<long long>& sorted, double p)
+{
+  size_t i;
+
+  if(sorted.empty()) return 0;
+  i = (size_t)ceil(p * sorted.size());
+  if(i > 0) i--;
+  if(i >= sorted.size()) i = sorted.size() - 1;
+  return sorted[i] / 1000.0;
+}
+
+static RC run(const BenchConfig& config)
+{
+  RC rc;
+  RecordFile rf;
+  BTreeIndex index;
+  OpStats stats[OP_TYPES];
+  Zipf zipf = { 0, 0, 0, 0, 0 };
+  long long items = config.records, next = 0, start, end, i;
+
+  if((rc = openFiles(config, rf, index)) < 0) return rc;
+  if((rc = warmUp(config, rf, index)) < 0) goto ERROR;
+  if(config.keys == KEYS_ZIPF) initZipf(zipf, config.records, config.theta);
+  for(i = 0; i < OP_TYPES; i++){
+    stats[i].pageReads = stats[i].pageWrites = stats[i].errors = 0;
+    stats[i].nanos.reserve((size_t)(config.ops * config.mix[i] / 100 + 16));
+  }
+
+  start = nowNanos();
+  for(i = 0; i < config.ops; i++){
+    int op = pickOp(config);
+    long long item;
+    if(config.keys == KEYS_SEQ) item = next++ % items;
+    else if(config.keys == KEYS_ZIPF) item = nextZipf(zipf);
+    else item = (long long)(nextRandom() % (unsigned long long)items);
+
+    long long reads = PageFile::getPageReadCount(), writes = PageFile::getPageWriteCount();
+    long long t = nowNanos();
+    if(runOp(config, op, keyOf(config, item), items, rf, index) < 0) stats[op].errors++;
+    stats[op].nanos.push_back(nowNanos() - t);
+    stats[op].pageReads += PageFile::getPageReadCount() - reads;
+    stats[op].pageWrites += PageFile::getPageWriteCount() - writes;
+  }
+  end = nowNanos();
+
+  {
+    double seconds = (end - start) / 1e9;
+    long long reads = 0, writes = 0;
+    printf("run.keys %s\n", config.keys == KEYS_SEQ ? "seq" : config.keys == KEYS_ZIPF ? "zipf" : "uniform");
+    printf("run.mix %d/%d/%d/%d\n", config.mix[OP_READ], config.mix[OP_UPDATE], config.mix[OP_INSERT], config.mix[OP_SCAN]);
+    printf("run.cache %s\n", config.cache.c_str());
+    printf("run.ops %lld\n", config.ops);
+    printf("run.seconds %.3f\n", seconds);
+    printf("run.ops_per_sec %.1f\n", seconds > 0 ? config.ops / seconds : 0.0);
+    for(i = 0; i < OP_TYPES; i++){
+      OpStats& s = stats[i];
+      long long count = (long long)s.nanos.size(), sum = 0;
+      string prefix = string("run.") + opNames[i];
+      if(count == 0) continue;
+      for(size_t j = 0; j < s.nanos.size(); j++) sum += s.nanos[j];
+      sort(s.nanos.begin(), s.nanos.end());
+      printf("%s.ops %lld\n", prefix.c_str(), count);
+      printf("%s.errors %lld\n", prefix.c_str(), s.errors);
+      printf("%s.latency_us.mean %.2f\n", prefix.c_str(), sum / 1000.0 / count);
+      printf("%s.latency_us.p50 %.2f\n", prefix.c_str(), percentile(s.nanos, 0.50));
+      printf("%s.latency_us.p95 %.2f\n", prefix.c_str(), percentile(s.nanos, 0.95));
+      printf("%s.latency_us.p99 %.2f\n", prefix.c_str(), percentile(s.nanos, 0.99));
+      printf("%s.latency_us.p999 %.2f\n", prefix.c_str(), percentile(s.nanos, 0.999));
+      printf("%s.latency_us.max %.2f\n", prefix.c_str(), s.nanos.back() / 1000.0);
+      printf("%s.page_reads_per_op %.3f\n", prefix.c_str(), (double)s.pageReads / count);
+      printf("%s.page_writes_per_op %.3f\n", prefix.c_str(), (double)s.pageWrites / count);
+      reads += s.pageReads;
+      writes += s.pageWrites;
+    }
+    printf("run.page_reads_per_op %.3f\n", config.ops > 0 ? (double)reads / config.ops : 0.0);
+    printf("run.page_writes_per_op %.3f\n", config.ops > 0 ? (double)writes / config.ops : 0.0);
+  }
+
+  if((rc = rf.flush()) < 0) goto ERROR;
+  printf("size.records %lld\n", items);
+  printf("size.index_bytes_per_key %.2f\n", (double)index.getStoredBytes() / items);
+  printf("size.record_bytes_per_key %.2f\n", (double)rf.getStoredBytes() / items);
+  printf("size.bytes_per_key %.2f\n", (double)(index.getStoredBytes() + rf.getStoredBytes()) / items);
+  index.close();
+  return rf.close();
+ERROR:
+  fprintf(stderr, "run error %d\n", rc);
+  index.close();
+  rf.close();
+  return rc;
+}
+
+static bool parseMix(const char* arg, int* mix)
+{
+  if(strcmp(arg, "a") == 0) arg = "50/50/0/0";
+  else if(strcmp(arg, "b") == 0) arg = "95/5/0/0";
+  else if(strcmp(arg, "c") == 0) arg = "100/0/0/0";
+  else if(strcmp(arg, "e") == 0) arg = "0/0/5/95";
+  if(sscanf(arg, "%d/%d/%d/%d", &mix[0], &mix[1], &mix[2], &mix[3]) != 4) return false;
+  for(int i = 0; i < OP_TYPES; i++)
+    if(mix[i] < 0) return false;
+  return mix[0] + mix[1] + mix[2] + mix[3] == 100;
+}
+
+int main(int argc, char* argv[])
+{
+  BenchConfig config;
+  bool ok = true;
+  RC rc;
+
+  config.records = 100000;
+  config.ops = 100000;
+  config.keys = KEYS_UNIFORM;
+  config.theta = 0.99;
+  parseMix("b", config.mix);
+  config.scanLength = 100;
+  config.bulk = false;
+  config.valueBytes = 100;
+  config.cache = "cold";
+  config.prefix = "bench";
+  config.seed = 1;
+
+  for(int i = 1; i < argc && ok; i++){
+    const char* arg = (i + 1 < argc) ? argv[i + 1] : NULL;
+    ok = (arg != NULL);
+    if(!ok) break;
+    if(strcmp(argv[i], "-n") == 0) ok = (config.records = atoll(arg)) > 0;
+    else if(strcmp(argv[i], "-o") == 0) ok = (config.ops = atoll(arg)) >= 0;
+    else if(strcmp(argv[i], "-d") == 0){
+      if(strcmp(arg, "seq") == 0) config.keys = KEYS_SEQ;
+      else if(strcmp(arg, "uniform") == 0) config.keys = KEYS_UNIFORM;
+      else if(strcmp(arg, "zipf") == 0) config.keys = KEYS_ZIPF;
+      else ok = false;
+    }
+    else if(strcmp(argv[i], "-t") == 0) ok = (config.theta = atof(arg)) > 0 && config.theta < 1;
+    else if(strcmp(argv[i], "-w") == 0) ok = parseMix(arg, config.mix);
+    else if(strcmp(argv[i], "-L") == 0) ok = (config.scanLength = atoi(arg)) > 0;
+    else if(strcmp(argv[i], "-l") == 0){
+      config.bulk = (strcmp(arg, "bulk") == 0);
+      ok = config.bulk || strcmp(arg, "incremental") == 0;
+    }
+    else if(strcmp(argv[i], "-v") == 0) ok = (config.valueBytes = atoi(arg)) >= 0;
+    else if(strcmp(argv[i], "-c") == 0){
+      config.cache = arg;
+      ok = config.cache == "cold" || config.cache == "warm" || config.cache == "inner";
+    }
+    else if(strcmp(argv[i], "-f") == 0) config.prefix = arg;
+    else if(strcmp(argv[i], "-s") == 0) config.seed = strtoull(arg, NULL, 10);
+    else ok = false;
+    i++;
+  }
+  // the keys of seq and the scrambled keys are 31 bit numbers
+  if(config.records + config.ops > INT_MAX) ok = false;
+  if(!ok){
+    fprintf(stderr, "usage: %s [-n records] [-o ops] [-d seq|uniform|zipf] [-t theta] [-w mix]"
+            " [-L length] [-l bulk|incremental] [-v bytes] [-c cold|warm|inner] [-f prefix] [-s seed]\n", argv[0]);
+    return 2;
+  }
+
+  rngState = config.seed * 0x9E3779B97F4A7C15ULL + 1;
+  if((rc = load(config)) < 0) return 1;
+  if((rc = run(config)) < 0) return 1;
+  return 0;
+}
@@ -0,0 +1,156 @@
+#include "BloomFilter.h"
+
+using std::string;
+
+// the first page of a filter file stores these fields in this order
+static const int BLOOM_MAGIC = 0x424c4d31;
+static const int WORDS_PER_BLOCK = BloomFilter::BLOCK_BITS / 64;
+static const int WORDS_PER_PAGE = PageFile::PAGE_SIZE / sizeof(uint64_t);
+
+// 64-bit finalizer of MurmurHash3, spreads a 32-bit key over 64 bits
+static uint64_t hashKey(KeyType key)
+{
+  uint64_t h = (uint32_t)key;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+BloomFilter::BloomFilter()
+{
+  numBlocks = 0;
+  numProbes = 0;
+  capacity = 0;
+  bitsPerKey = 0;
+  keyCount = 0;
+  probeCount = 0;
+  negativeCount = 0;
+}
+
+RC BloomFilter::init(int cap, int bpk)
+{
+  if (cap <= 0 || bpk <= 0) return RC_INVALID_ATTRIBUTE;
+
+  capacity = cap;
+  bitsPerKey = bpk;
+  keyCount = 0;
+
+  // k = ln2 * bits/key minimizes the false positive rate
+  numProbes = (bitsPerKey * 69) / 100;
+  if (numProbes < 1) numProbes = 1;
+  if (numProbes > 16) numProbes = 16;
+
+  numBlocks = (int)(((int64_t)capacity * bitsPerKey + BLOCK_BITS - 1) / BLOCK_BITS);
+  if (numBlocks < 1) numBlocks = 1;
+  bits.assign((size_t)numBlocks * WORDS_PER_BLOCK, 0);
+  return 0;
+}
+
+void BloomFilter::clear()
+{
+  std::vector<uint64_t>().swap(bits);
+  numBlocks = 0;
+  capacity = 0;
+  keyCount = 0;
+}
+
+void BloomFilter::add(KeyType key)
+{
+  uint64_t h = hashKey(key);
+  // the high half picks the block, the low half drives double hashing
+  uint64_t* block = &bits[(size_t)(((h >> 32) * (uint64_t)numBlocks) >> 32) * WORDS_PER_BLOCK];
+  uint32_t h1 = (uint32_t)h;
+  uint32_t h2 = (h1 >> 17) | (h1 << 15);
+
+  for (int i = 0; i < numProbes; i++) {
+    uint32_t bit = (h1 + i * h2) % BLOCK_BITS;
+    block[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+  keyCount++;
+}
+
+bool BloomFilter::mayContain(KeyType key) const
+{
+  uint64_t h = hashKey(key);
+  const uint64_t* block = &bits[(size_t)(((h >> 32) * (uint64_t)numBlocks) >> 32) * WORDS_PER_BLOCK];
+  uint32_t h1 = (uint32_t)h;
+  uint32_t h2 = (h1 >> 17) | (h1 << 15);
+
+  probeCount++;
+  for (int i = 0; i < numProbes; i++) {
+    uint32_t bit = (h1 + i * h2) % BLOCK_BITS;
+    if ((block[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0) {
+      negativeCount++;
+      return false;
+    }
+  }
+  return true;
+}
+
+RC BloomFilter::save(const string& filename) const
+{
+  RC rc;
+  PageFile pf;
+  char page[PageFile::PAGE_SIZE];
+  int header[6] = { BLOOM_MAGIC, numBlocks, numProbes, capacity, bitsPerKey, keyCount };
+  size_t words = bits.size();
+
+  if ((rc = pf.open(filename, 'w')) < 0) return rc;
+
+  memset(page, 0, PageFile::PAGE_SIZE);
+  memcpy(page, header, sizeof(header));
+  if ((rc = pf.write(0, page)) < 0) goto DONE;
+
+  // the bits follow the header page, WORDS_PER_PAGE words per page
+  for (size_t w = 0; w < words; w += WORDS_PER_PAGE) {
+    size_t n = (words - w < (size_t)WORDS_PER_PAGE) ? words - w : WORDS_PER_PAGE;
+    memset(page, 0, PageFile::PAGE_SIZE);
+    memcpy(page, &bits[w], n * sizeof(uint64_t));
+    if ((rc = pf.write(1 + (PageId)(w / WORDS_PER_PAGE), page)) < 0) goto DONE;
+  }
+
+DONE:
+  pf.close();
+  return rc;
+}
+
+RC BloomFilter::load(const string& filename)
+{
+  RC rc;
+  PageFile pf;
+  char page[PageFile::PAGE_SIZE];
+  int header[6];
+  size_t words;
+
+  if ((rc = pf.open(filename, 'r')) < 0) return rc;
+
+  if ((rc = pf.read(0, page)) < 0) goto DONE;
+  memcpy(header, page, sizeof(header));
+  if (header[0] != BLOOM_MAGIC || header[1] <= 0) {
+    rc = RC_INVALID_FILE_FORMAT;
+    goto DONE;
+  }
+  numBlocks = header[1];
+  numProbes = header[2];
+  capacity = header[3];
+  bitsPerKey = header[4];
+  keyCount = header[5];
+
+  words = (size_t)numBlocks * WORDS_PER_BLOCK;
+  bits.assign(words, 0);
+  for (size_t w = 0; w < words; w += WORDS_PER_PAGE) {
+    size_t n = (words - w < (size_t)WORDS_PER_PAGE) ? words - w : WORDS_PER_PAGE;
+    if ((rc = pf.read(1 + (PageId)(w / WORDS_PER_PAGE), page)) < 0) {
+      clear();
+      goto DONE;
+    }
+    memcpy(&bits[w], page, n * sizeof(uint64_t));
+  }
+
+DONE:
+  pf.close();
+  return rc;
+}
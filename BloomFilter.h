@@ -0,0 +1,93 @@
+#ifndef BLOOMFILTER_H
+#define BLOOMFILTER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "BPBase.h"
+#include "PageFile.h"
+#include "BTreeNode.h"
+
+/**
+ * A blocked Bloom filter over index keys.
+ * Every key is hashed to one 64-byte block (one cache line) and all of
+ * its probe bits are set inside that block, so a membership test touches
+ * a single cache line. The filter answers "definitely absent" or
+ * "maybe present"; it never forgets a key, so removed keys only cost
+ * false positives.
+ */
+class BloomFilter {
+ public:
+  // bits in one block, one cache line
+  static const int BLOCK_BITS = 512;
+
+  BloomFilter();
+
+  /**
+   * (Re)initialize an empty filter.
+   * @param capacity[IN] the number of keys the filter is sized for
+   * @param bitsPerKey[IN] memory budget per key, ~1% false positives at 10
+   * @return error code. 0 if no error
+   */
+  RC init(int capacity, int bitsPerKey);
+
+  /**
+   * Drop the filter and free its memory.
+   */
+  void clear();
+
+  /**
+   * @return true if the filter has been initialized
+   */
+  bool isEnabled() const { return numBlocks > 0; }
+
+  /**
+   * Add a key to the filter.
+   * @param key[IN] the key to add
+   */
+  void add(KeyType key);
+
+  /**
+   * Test whether a key may have been added.
+   * @param key[IN] the key to test
+   * @return false if the key was definitely never added
+   */
+  bool mayContain(KeyType key) const;
+
+  /**
+   * Save the filter to its own file, one header page followed by the bits.
+   * @param filename[IN] the file to write
+   * @return error code. 0 if no error
+   */
+  RC save(const std::string& filename) const;
+
+  /**
+   * Load a filter written by save().
+   * @param filename[IN] the file to read
+   * @return error code. 0 if no error
+   */
+  RC load(const std::string& filename);
+
+  int getKeyCount() const   { return keyCount; }   // # keys added
+  int getCapacity() const   { return capacity; }   // # keys the filter is sized for
+  int getBitsPerKey() const { return bitsPerKey; }
+
+  /**
+   * @return the # mayContain() calls and how many of them said "absent"
+   */
+  int getProbeCount() const    { return probeCount; }
+  int getNegativeCount() const { return negativeCount; }
+
+ private:
+  std::vector<uint64_t> bits; // numBlocks * BLOCK_BITS bits
+  int numBlocks;
+  int numProbes;              // # bits set per key
+  int capacity;
+  int bitsPerKey;
+  int keyCount;
+
+  mutable int probeCount;
+  mutable int negativeCount;
+};
+
+#endif // BLOOMFILTER_H
@@ -0,0 +1,281 @@
+#include "DeltaIndex.h"
+#include <algorithm>
+using namespace std;
+
+// # entries the merge thread inserts per hold of indexMutex,
+// so that readers are not blocked for a whole merge
+static const size_t MERGE_CHUNK = 1024;
+
+typedef pair<KeyType, RecordId> Entry;
+
+static bool entryLess(const Entry& a, const Entry& b)
+{
+  return a.first < b.first;
+}
+
+static bool entryKeyLess(const Entry& a, KeyType key)
+{
+  return a.first < key;
+}
+
+static bool keyEntryLess(KeyType key, const Entry& a)
+{
+  return key < a.first;
+}
+
+DeltaIndex::DeltaIndex()
+{
+  readOnlyMode = true;
+  threshold = DEFAULT_MERGE_THRESHOLD;
+  merged = 0;
+  stopping = false;
+  mergeRc = 0;
+  mergeCount = 0;
+}
+
+DeltaIndex::~DeltaIndex()
+{
+  if(merger.joinable()) close();
+}
+
+/*
+ * Open the disk index and start the merge thread.
+ * @param indexname[IN] the name of the index file
+ * @param mode[IN] 'r' for read, 'w' for write
+ * @return error code. 0 if no error
+ */
+RC DeltaIndex::open(const string& indexname, char mode)
+{
+  RC rc;
+  if((rc = index.open(indexname, mode)) != 0) return rc;
+
+  readOnlyMode = (mode != 'w' && mode != 'W');
+  active.clear();
+  frozen.clear();
+  merged = 0;
+  stopping = false;
+  mergeRc = 0;
+  mergeCount = 0;
+  if(!readOnlyMode) merger = thread(&DeltaIndex::mergeLoop, this);
+  return 0;
+}
+
+/*
+ * Merge the entries in memory, stop the merge thread and close the index.
+ * @return error code. 0 if no error
+ */
+RC DeltaIndex::close()
+{
+  RC rc = 0, rc2;
+  if(merger.joinable()){
+      rc = flush();
+      {
+        lock_guard<mutex> lock(memMutex);
+        stopping = true;
+      }
+      mergeWanted.notify_one();
+      merger.join();
+  }
+  rc2 = index.close();
+  return rc != 0 ? rc : rc2;
+}
+
+void DeltaIndex::setMergeThreshold(int entries)
+{
+  lock_guard<mutex> lock(memMutex);
+  threshold = entries > 0 ? entries : 1;
+}
+
+/*
+ * Insert (key, RecordId) pair into the active in-memory table.
+ * @param key[IN] the key for the value inserted into the index
+ * @param rid[IN] the RecordId for the record being inserted into the index
+ * @return error code. 0 if no error
+ */
+RC DeltaIndex::insert(KeyType key, const RecordId& rid)
+{
+  if(readOnlyMode) return RC_FILE_READ_ONLY;
+
+  unique_lock<mutex> lock(memMutex);
+  if((int)active.size() >= threshold){
+      // the previous table is still being merged: wait for it, so that
+      // at most two tables are kept in memory
+      while(!frozen.empty() && mergeRc == 0)
+          mergeDone.wait(lock);
+      if(mergeRc == 0) freeze();
+  }
+  if(mergeRc != 0) return mergeRc;
+
+  // equal keys are kept in insert order
+  active.insert(active.end(), make_pair(key, rid));
+  return 0;
+}
+
+/*
+ * Point lookup: the in-memory tables first, then the disk index.
+ * An entry moves from memory into the index, never back, so an entry
+ * missed in memory has been merged before the index is searched.
+ * @param searchKey[IN] the key to find
+ * @param rid[OUT] the RecordId of an entry with the key
+ * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+ */
+RC DeltaIndex::find(KeyType searchKey, RecordId& rid)
+{
+  IndexCursor cursor;
+  {
+    lock_guard<mutex> lock(memMutex);
+    FrozenTable::const_iterator it;
+    MemTable::const_iterator mit = active.find(searchKey);
+    if(mit != active.end()){
+        rid = mit->second;
+        return 0;
+    }
+    it = lower_bound(frozen.begin() + merged, frozen.end(), searchKey, entryKeyLess);
+    if(it != frozen.end() && it->first == searchKey){
+        rid = it->second;
+        return 0;
+    }
+  }
+
+  lock_guard<mutex> indexLock(indexMutex);
+  return index.find(searchKey, cursor, rid);
+}
+
+/*
+ * Read all entries with lo <= key <= hi in key order.
+ * indexMutex is held for the whole scan, so that the merge thread cannot
+ * move entries from memory into the index behind the scan.
+ * @param lo[IN] the smallest key to read
+ * @param hi[IN] the largest key to read
+ * @param keys[OUT] the keys in range
+ * @param rids[OUT] the RecordIds
+ * @return error code. 0 if no error
+ */
+RC DeltaIndex::scan(KeyType lo, KeyType hi, vector<KeyType>& keys, vector<RecordId>& rids)
+{
+  RC rc;
+  vector<Entry> mem;
+  IndexCursor cursor;
+  KeyType key;
+  RecordId rid;
+  size_t i = 0, mid;
+
+  keys.clear();
+  rids.clear();
+  if(lo > hi) return 0;
+
+  lock_guard<mutex> indexLock(indexMutex);
+  {
+    // the frozen table is older than the active one, so its entries
+    // go first among equal keys
+    lock_guard<mutex> lock(memMutex);
+    mem.assign(lower_bound(frozen.begin() + merged, frozen.end(), lo, entryKeyLess),
+               upper_bound(frozen.begin() + merged, frozen.end(), hi, keyEntryLess));
+    mid = mem.size();
+    mem.insert(mem.end(), active.lower_bound(lo), active.upper_bound(hi));
+  }
+  inplace_merge(mem.begin(), mem.begin() + mid, mem.end(), entryLess);
+
+  if(index.getStats().entryCount > 0){
+      if((rc = index.locate(lo, cursor)) != 0) return rc;
+      while(cursor.pid != -1){
+          if((rc = index.readForward(cursor, key, rid)) != 0) return rc;
+          if(key > hi) break;
+          for(; i < mem.size() && mem[i].first < key; i++){
+              keys.push_back(mem[i].first);
+              rids.push_back(mem[i].second);
+          }
+          keys.push_back(key);
+          rids.push_back(rid);
+      }
+  }
+  for(; i < mem.size(); i++){
+      keys.push_back(mem[i].first);
+      rids.push_back(mem[i].second);
+  }
+  return 0;
+}
+
+/*
+ * Merge all entries in memory into the disk index and wait until done.
+ * @return error code. 0 if no error
+ */
+RC DeltaIndex::flush()
+{
+  if(readOnlyMode) return 0;
+
+  unique_lock<mutex> lock(memMutex);
+  for(;;){
+      while(!frozen.empty() && mergeRc == 0)
+          mergeDone.wait(lock);
+      if(mergeRc != 0) return mergeRc;
+      if(active.empty()) return 0;
+      freeze();
+  }
+}
+
+int DeltaIndex::getMemoryEntryCount()
+{
+  lock_guard<mutex> lock(memMutex);
+  return (int)(active.size() + frozen.size() - merged);
+}
+
+int DeltaIndex::getMergeCount()
+{
+  lock_guard<mutex> lock(memMutex);
+  return mergeCount;
+}
+
+/*
+ * Hand the active table over to the merge thread.
+ * Call with memMutex held and an empty frozen table.
+ */
+void DeltaIndex::freeze()
+{
+  frozen.assign(active.begin(), active.end());
+  active.clear();
+  merged = 0;
+  mergeWanted.notify_one();
+}
+
+/*
+ * Body of the merge thread: insert the frozen table into the disk index
+ * in key order, so that consecutive inserts go to the same leaf.
+ */
+void DeltaIndex::mergeLoop()
+{
+  unique_lock<mutex> lock(memMutex);
+  for(;;){
+      while(!stopping && frozen.empty())
+          mergeWanted.wait(lock);
+      if(frozen.empty()) break;
+
+      // frozen is only changed by this thread until it is merged,
+      // so it can be read without memMutex
+      size_t i = merged;
+      size_t end = min(frozen.size(), merged + MERGE_CHUNK);
+      RC rc = 0;
+      lock.unlock();
+      {
+        lock_guard<mutex> indexLock(indexMutex);
+        for(; i < end && rc == 0; i++)
+            rc = index.insert(frozen[i].first, frozen[i].second);
+        lock.lock();
+      }
+
+      if(rc != 0){
+          // the rest of the table is dropped, the error is returned
+          // by the next insert() or flush()
+          DEBUG('i', "DeltaIndex merge error %d\n", rc);
+          if(mergeRc == 0) mergeRc = rc;
+          end = frozen.size();
+      }
+      merged = end;
+      if(merged == frozen.size()){
+          frozen.clear();
+          merged = 0;
+          mergeCount++;
+          mergeDone.notify_all();
+      }
+  }
+}
@@ -0,0 +1,128 @@
+#ifndef DELTAINDEX_H
+#define DELTAINDEX_H
+
+#include "BPBase.h"
+#include "BTreeIndex.h"
+#include <map>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * An in-memory front end for BTreeIndex (the memtable of an LSM tree).
+ * insert() only adds the entry to a sorted in-memory table. When the
+ * table reaches the merge threshold it is frozen and a background thread
+ * inserts its entries into the disk tree in key order, while new inserts
+ * go to a fresh table. Reads merge both tables with the disk tree.
+ * Entries in memory are lost if the process dies before close()/flush().
+ */
+class DeltaIndex {
+ public:
+  // default # entries kept in memory before a merge starts
+  static const int DEFAULT_MERGE_THRESHOLD = 64 * 1024;
+
+  DeltaIndex();
+  ~DeltaIndex();
+
+  /**
+   * Open the disk index and start the merge thread.
+   * @param indexname[IN] the name of the index file
+   * @param mode[IN] 'r' for read, 'w' for write
+   * @return error code. 0 if no error
+   */
+  RC open(const std::string& indexname, char mode);
+
+  /**
+   * Merge all entries in memory into the disk index, stop the merge
+   * thread and close the index.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * Set the # entries kept in memory before they are merged into the
+   * disk index. Inserts wait when a second full table is waiting for
+   * the merge.
+   * @param entries[IN] the merge threshold
+   */
+  void setMergeThreshold(int entries);
+
+  /**
+   * Insert (key, RecordId) pair. No page is read or written.
+   * @param key[IN] the key for the value inserted into the index
+   * @param rid[IN] the RecordId for the record being inserted into the index
+   * @return error code. 0 if no error
+   */
+  RC insert(KeyType key, const RecordId& rid);
+
+  /**
+   * Point lookup over the in-memory tables and the disk index.
+   * @param searchKey[IN] the key to find
+   * @param rid[OUT] the RecordId of an entry with the key
+   * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+   */
+  RC find(KeyType searchKey, RecordId& rid);
+
+  /**
+   * Read all entries with lo <= key <= hi in key order, merging the
+   * in-memory tables with a locate()/readForward() scan of the disk index.
+   * Entries with equal keys come from the disk index first.
+   * @param lo[IN] the smallest key to read
+   * @param hi[IN] the largest key to read
+   * @param keys[OUT] the keys in range
+   * @param rids[OUT] the RecordIds, rids[i] belongs to keys[i]
+   * @return error code. 0 if no error
+   */
+  RC scan(KeyType lo, KeyType hi, std::vector<KeyType>& keys, std::vector<RecordId>& rids);
+
+  /**
+   * Merge all entries in memory into the disk index and wait until done.
+   * @return error code. 0 if no error
+   */
+  RC flush();
+
+  /**
+   * @return the # entries in memory, not merged into the disk index yet
+   */
+  int getMemoryEntryCount();
+
+  /**
+   * @return the # background merges done since open()
+   */
+  int getMergeCount();
+
+  /**
+   * @return the disk index. Do not use it while the index is open for
+   *         writing; the merge thread may be inserting into it.
+   */
+  BTreeIndex& getIndex() { return index; }
+
+ private:
+  typedef std::multimap<KeyType, RecordId> MemTable;
+  typedef std::vector<std::pair<KeyType, RecordId> > FrozenTable;
+
+  BTreeIndex index;
+  bool readOnlyMode;
+  int  threshold;
+
+  MemTable    active;    /// takes the new inserts
+  FrozenTable frozen;    /// full table, being merged into index in key order
+  size_t      merged;    /// # entries of frozen already in index
+  bool        stopping;  /// tells the merge thread to exit
+  RC          mergeRc;   /// the first error of the merge thread
+  int         mergeCount;
+
+  /// lock order: indexMutex before memMutex
+  std::mutex  indexMutex;  /// held while index is read or written
+  std::mutex  memMutex;    /// protects the fields above
+  std::condition_variable mergeWanted; /// frozen is filled or stopping is set
+  std::condition_variable mergeDone;   /// frozen is merged
+  std::thread merger;
+
+  void freeze();
+  void mergeLoop();
+};
+
+#endif /* DELTAINDEX_H */
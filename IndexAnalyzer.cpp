@@ -0,0 +1,296 @@
+//Layout analyzer for BTreeIndex and RecordFile files
+//
+//usage: IndexAnalyzer [-i indexfile] [-r recordfile]
+//
+//Prints one "name value" pair per line, e.g. "index.level.0.fill 0.684",
+//so that the output can be read by scripts. The index report covers the
+//fill of every level, the page counts and wasted bytes by page type, and
+//how the leaf chain runs through the file: every step from one leaf to the
+//next that is not to the very next page is an order break (and a seek for
+//a scan on a disk). Breaks are counted in a histogram by distance in pages.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "BTreeIndex.h"
+#include "RecordFile.h"
+
+// the histogram of leaf order breaks has one bucket per power of 2 of the
+// distance, up to 2^(JUMP_BUCKETS-1) pages and more
+static const int JUMP_BUCKETS = 24;
+
+static int jumpBucket(int distance)
+{
+  int b = 0;
+  while(distance > 1 && b < JUMP_BUCKETS - 1){
+    distance >>= 1;
+    b++;
+  }
+  return b;
+}
+
+static void printRatio(const string& name, double part, double whole)
+{
+  printf("%s %.4f\n", name.c_str(), whole > 0 ? part / whole : 0.0);
+}
+
+/*
+ * Walk the tree level by level from the root, then read the pages the
+ * walk did not reach: free pages and pages lost by a crash.
+ * @param name[IN] the name of the index file
+ * @return error code. 0 if no error
+ */
+static RC analyzeIndex(const string& name)
+{
+  RC rc;
+  BTreeIndex index;
+  PageFile pf;
+  PageId end;
+  vector<char> reached;
+  vector<PageId> level, next;
+  vector<PageId> leafPid, leafNext;
+  vector<KeyType> firstKey, lastKey;
+  vector<bool> hasKeys;
+  long long treeWaste = 0, overflowWaste = 0, freeWaste = 0, lostWaste = 0;
+  int leafPages = 0, nonLeafPages = 0, overflowPages = 0, freePages = 0, lostPages = 0;
+  int forward[JUMP_BUCKETS], backward[JUMP_BUCKETS];
+  int breaks = 0, backJumps = 0, keyJumps = 0, chainErrors = 0;
+
+  if((rc = index.open(name, 'r')) < 0){
+    fprintf(stderr, "cannot open index %s: %d\n", name.c_str(), rc);
+    return rc;
+  }
+  // a second handle for reading the pages, as parallelScan() does
+  if((rc = pf.open(name, 'r')) < 0){
+    index.close();
+    return rc;
+  }
+  end = pf.endPid();
+  reached.assign(end > 0 ? end : 0, 0);
+
+  const TreeStats& stats = index.getStats();
+  printf("index.file %s\n", name.c_str());
+  printf("index.page_size %d\n", PageFile::PAGE_SIZE);
+  printf("index.pages %d\n", end);
+  printf("index.compressed %d\n", pf.isCompressed() ? 1 : 0);
+  printf("index.stored_bytes %lld\n", pf.getStoredBytes());
+  printf("index.options %d\n", index.getOptions());
+  printf("index.height %d\n", index.getHeight());
+  printf("index.entries %d\n", stats.entryCount);
+  printf("index.min_key %d\n", stats.entryCount > 0 ? stats.minKey : 0);
+  printf("index.max_key %d\n", stats.entryCount > 0 ? stats.maxKey : 0);
+
+  if(index.getRoot() > 0 && index.getRoot() < end)
+    level.push_back(index.getRoot());
+  for(int h = index.getHeight(); h >= 0 && !level.empty(); h--){
+    long long used = 0, entries = 0, capacity = 0;
+    next.clear();
+    for(size_t j = 0; j < level.size(); j++){
+      BTNode node;
+      if((rc = node.read(level[j], pf)) < 0) goto ERROR;
+      reached[level[j]] = 1;
+      used += node.getUsedBytes();
+      if(!node.isLeaf){
+        for(int i = 0; i <= node.n; i++)
+          if(node.pids[i] > 0 && node.pids[i] < end) next.push_back(node.pids[i]);
+        entries += node.n;
+        capacity += 2*node.getT() - 1;
+        continue;
+      }
+
+      // a posting or clustered leaf is filled by bytes, not by # keys
+      if(node.format & (BTNode::NODE_POSTING | BTNode::NODE_CLUSTERED)){
+        entries += node.getUsedBytes();
+        capacity += PageFile::PAGE_SIZE;
+      }else{
+        entries += node.n;
+        capacity += 2*node.getT() - 1;
+      }
+      leafPid.push_back(node.pid);
+      leafNext.push_back(node.getNextNodePtr());
+      hasKeys.push_back(node.n > 0);
+      firstKey.push_back(node.n > 0 ? node.getKey(0) : 0);
+      lastKey.push_back(node.n > 0 ? node.getKey(node.n - 1) : 0);
+
+      // the overflow pages of hot keys hang off the posting leaves, the
+      // value pages of long values off the clustered leaves
+      for(size_t s = 0; s < node.pheads.size(); s++){
+        for(PageId p = node.pheads[s]; p > 0 && p < end && !reached[p]; ){
+          BTNode page;
+          if((rc = page.read(p, pf)) < 0) goto ERROR;
+          reached[p] = 1;
+          overflowPages++;
+          overflowWaste += PageFile::PAGE_SIZE - page.getUsedBytes();
+          p = page.getNextNodePtr();
+        }
+      }
+    }
+
+    string prefix = "index.level." + to_string(h);
+    printf("%s.nodes %d\n", prefix.c_str(), (int)level.size());
+    printf("%s.stats_nodes %d\n", prefix.c_str(), h < MAX_TREE_HEIGHT ? stats.levelPages[h] : -1);
+    printRatio(prefix + ".fill", (double)entries, (double)capacity);
+    printRatio(prefix + ".byte_fill", (double)used, (double)level.size() * PageFile::PAGE_SIZE);
+    printf("%s.wasted_bytes %lld\n", prefix.c_str(), (long long)level.size() * PageFile::PAGE_SIZE - used);
+    treeWaste += (long long)level.size() * PageFile::PAGE_SIZE - used;
+    if(h == 0) leafPages += level.size();
+    else nonLeafPages += level.size();
+    level.swap(next);
+  }
+
+  // the leaves of the walk are in key order; the leaf chain should link
+  // them in the same order, and a scan reads them in that order
+  memset(forward, 0, sizeof(forward));
+  memset(backward, 0, sizeof(backward));
+  for(size_t i = 0; i < leafPid.size(); i++){
+    if(leafNext[i] != (i + 1 < leafPid.size() ? leafPid[i+1] : -1)) chainErrors++;
+    if(i == 0) continue;
+    int d = leafPid[i] - leafPid[i-1];
+    if(d > 0) forward[jumpBucket(d)]++;
+    else backward[jumpBucket(-d)]++;
+    if(d != 1) breaks++;
+    if(d < 0) backJumps++;
+  }
+  // a key that is smaller than one in an earlier leaf means a broken tree
+  {
+    bool seen = false;
+    KeyType last = 0;
+    for(size_t i = 0; i < leafPid.size(); i++){
+      if(!hasKeys[i]) continue;
+      if(seen && firstKey[i] < last) keyJumps++;
+      last = lastKey[i];
+      seen = true;
+    }
+  }
+
+  printf("index.leaf.order_breaks %d\n", breaks);
+  printf("index.leaf.backward_jumps %d\n", backJumps);
+  printf("index.leaf.key_order_errors %d\n", keyJumps);
+  printf("index.leaf.chain_errors %d\n", chainErrors);
+  printf("index.scan.seeks %d\n", leafPid.empty() ? 0 : breaks + 1);
+  printRatio("index.scan.sequential_ratio", (double)(leafPid.size() > 1 ? leafPid.size() - 1 - breaks : 0),
+             (double)(leafPid.size() > 1 ? leafPid.size() - 1 : 0));
+  for(int b = 0; b < JUMP_BUCKETS; b++)
+    if(forward[b] > 0) printf("index.leaf.jump_hist.forward.%d %d\n", 1 << b, forward[b]);
+  for(int b = 0; b < JUMP_BUCKETS; b++)
+    if(backward[b] > 0) printf("index.leaf.jump_hist.backward.%d %d\n", 1 << b, backward[b]);
+
+  // the pages the walk did not reach: free pages and lost pages
+  for(PageId p = 1; p < end; p++){
+    if(reached[p]) continue;
+    BTNode node;
+    if((rc = node.read(p, pf)) < 0) goto ERROR;
+    if(node.format & BTNode::NODE_FREE){
+      freePages++;
+      freeWaste += PageFile::PAGE_SIZE;
+    }else{
+      lostPages++;
+      lostWaste += PageFile::PAGE_SIZE;
+    }
+  }
+
+  printf("index.pages.header %d\n", end > 0 ? 1 : 0);
+  printf("index.pages.nonleaf %d\n", nonLeafPages);
+  printf("index.pages.leaf %d\n", leafPages);
+  printf("index.pages.overflow %d\n", overflowPages);
+  printf("index.pages.free %d\n", freePages);
+  printf("index.pages.stats_free %d\n", stats.freePages);
+  printf("index.pages.unreachable %d\n", lostPages);
+  printf("index.wasted_bytes.tree %lld\n", treeWaste);
+  printf("index.wasted_bytes.overflow %lld\n", overflowWaste);
+  printf("index.wasted_bytes.free %lld\n", freeWaste);
+  printf("index.wasted_bytes.unreachable %lld\n", lostWaste);
+  printf("index.wasted_bytes.total %lld\n", treeWaste + overflowWaste + freeWaste + lostWaste);
+  printRatio("index.wasted_ratio", (double)(treeWaste + overflowWaste + freeWaste + lostWaste),
+             (double)end * PageFile::PAGE_SIZE);
+
+  pf.close();
+  index.close();
+  return 0;
+ERROR:
+  fprintf(stderr, "analyzeIndex error %d\n", rc);
+  pf.close();
+  index.close();
+  return rc;
+}
+
+/*
+ * Read every page and record of a RecordFile and report how the pages
+ * are used.
+ * @param name[IN] the name of the record file
+ * @return error code. 0 if no error
+ */
+static RC analyzeRecords(const string& name)
+{
+  RC rc;
+  RecordFile rf;
+  RecordId rid;
+  int key, records = 0, longRecords = 0, pages = 0, overflowPages = 0, count, used;
+  long long valueBytes = 0, usedBytes = 0;
+  bool overflow;
+  string value;
+
+  if((rc = rf.open(name, 'r')) < 0){
+    fprintf(stderr, "cannot open record file %s: %d\n", name.c_str(), rc);
+    return rc;
+  }
+  for(rid.pid = 0; rid.pid < rf.endPid(); rid.pid++){
+    if((rc = rf.getPageUsage(rid.pid, count, used, overflow)) < 0) goto ERROR;
+    usedBytes += used;
+    if(overflow){
+      overflowPages++;
+      continue;
+    }
+    pages++;
+    for(rid.sid = 0; rid.sid < count; rid.sid++){
+      if((rc = rf.read(rid, key, value)) < 0) goto ERROR;
+      records++;
+      valueBytes += value.size();
+      if((int)value.size() > RecordFile::MAX_INLINE_LENGTH) longRecords++;
+    }
+  }
+
+  printf("record.file %s\n", name.c_str());
+  printf("record.pages %d\n", pages);
+  printf("record.overflow_pages %d\n", overflowPages);
+  printf("record.stored_bytes %lld\n", rf.getStoredBytes());
+  printf("record.records %d\n", records);
+  printf("record.long_records %d\n", longRecords);
+  printf("record.value_bytes %lld\n", valueBytes);
+  printRatio("record.records_per_page", (double)records, (double)pages);
+  printRatio("record.page_util", (double)usedBytes, (double)(pages + overflowPages) * PageFile::PAGE_SIZE);
+  printf("record.wasted_bytes %lld\n", (long long)(pages + overflowPages) * PageFile::PAGE_SIZE - usedBytes);
+  rf.close();
+  return 0;
+ERROR:
+  fprintf(stderr, "analyzeRecords error %d\n", rc);
+  rf.close();
+  return rc;
+}
+
+int main(int argc, char* argv[])
+{
+  string indexName, recordName;
+  RC rc = 0;
+
+  for(int i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-i") == 0 && i + 1 < argc) indexName = argv[++i];
+    else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) recordName = argv[++i];
+    else{
+      indexName.clear();
+      recordName.clear();
+      break;
+    }
+  }
+  if(indexName.empty() && recordName.empty()){
+    fprintf(stderr, "usage: %s [-i indexfile] [-r recordfile]\n", argv[0]);
+    return 2;
+  }
+
+  if(!indexName.empty()) rc = analyzeIndex(indexName);
+  if(rc == 0 && !recordName.empty()) rc = analyzeRecords(recordName);
+  return rc == 0 ? 0 : 1;
+}
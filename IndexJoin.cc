@@ -0,0 +1,173 @@
+#include "IndexJoin.h"
+using namespace std;
+
+IndexJoin::IndexJoin()
+{
+  index[0] = index[1] = NULL;
+  method = MERGE_JOIN;
+  hi = 0;
+  valid[0] = valid[1] = false;
+  groupKey = 0;
+  gi = gj = 0;
+  descents = 0;
+}
+
+/*
+ * Start a join of the entries with lo <= key <= hi: both cursors are
+ * placed on the first entry >= lo.
+ * @param index1[IN] the first index (the outer one of a nested loop join)
+ * @param index2[IN] the second index (the inner one)
+ * @param method[IN] MERGE_JOIN or NESTED_LOOP_JOIN
+ * @param lo[IN] the smallest key to join
+ * @param hi[IN] the largest key to join
+ * @return error code. 0 if no error
+ */
+RC IndexJoin::open(const BTreeIndex& index1, const BTreeIndex& index2, int method, KeyType lo, KeyType hi)
+{
+  RC rc;
+  if(method != MERGE_JOIN && method != NESTED_LOOP_JOIN) return RC_INVALID_ATTRIBUTE;
+
+  index[0] = &index1;
+  index[1] = &index2;
+  this->method = method;
+  this->hi = hi;
+  group[0].clear();
+  group[1].clear();
+  gi = gj = 0;
+  descents = 0;
+  valid[0] = valid[1] = false;
+  if(lo > hi) return 0;
+  if((rc = seek(0, lo)) != 0) return rc;
+  return seek(1, lo);
+}
+
+/*
+ * Produce the next result pairs. The pairs of the current key are
+ * handed out first; then both sides are moved to the next key they
+ * have in common, and the entries of that key are read from both.
+ * @param batch[OUT] at most maxPairs pairs; empty when the join is over
+ * @param maxPairs[IN] the size of the batch
+ * @return error code. 0 if no error
+ */
+RC IndexJoin::next(JoinBatch& batch, int maxPairs)
+{
+  RC rc;
+  KeyType k;
+
+  batch.keys.clear();
+  batch.rids1.clear();
+  batch.rids2.clear();
+  if(maxPairs <= 0) return RC_INVALID_ATTRIBUTE;
+  if(index[0] == NULL) return 0;
+
+  while((int)batch.keys.size() < maxPairs){
+      if(gi < group[0].size()){
+          batch.keys.push_back(groupKey);
+          batch.rids1.push_back(group[0][gi]);
+          batch.rids2.push_back(group[1][gj]);
+          if(++gj == group[1].size()){
+              gj = 0;
+              gi++;
+          }
+          continue;
+      }
+
+      if(!valid[0] || key[0] > hi) break;
+      if(method == MERGE_JOIN){
+          if(!valid[1] || key[1] > hi) break;
+          if(key[0] < key[1]){
+              if((rc = advance(0, key[1])) != 0) return rc;
+              continue;
+          }
+          if(key[1] < key[0]){
+              if((rc = advance(1, key[0])) != 0) return rc;
+              continue;
+          }
+      }else{
+          if((rc = advance(1, key[0])) != 0) return rc;
+          if(!valid[1] || key[1] != key[0]){
+              // no match: skip the outer entries with this key
+              for(k = key[0]; valid[0] && key[0] == k; )
+                  if((rc = fetch(0)) != 0) return rc;
+              continue;
+          }
+      }
+
+      groupKey = key[0];
+      if((rc = readGroup(0, groupKey)) != 0) return rc;
+      if((rc = readGroup(1, groupKey)) != 0) return rc;
+      gi = gj = 0;
+  }
+  return 0;
+}
+
+/*
+ * Read the next entry of side s into key[s] and rid[s].
+ * valid[s] is false at the end of the index.
+ */
+RC IndexJoin::fetch(int s)
+{
+  RC rc;
+  valid[s] = false;
+  if(cursor[s].pid == -1) return 0;
+  if((rc = index[s]->readForward(cursor[s], key[s], rid[s])) != 0) return rc;
+  valid[s] = true;
+  return 0;
+}
+
+/*
+ * Descend from the root of side s to its first entry >= target.
+ */
+RC IndexJoin::seek(int s, KeyType target)
+{
+  RC rc;
+  valid[s] = false;
+  cursor[s].pid = -1;
+  if(index[s]->getStats().entryCount == 0) return 0;
+  if((rc = index[s]->locate(target, cursor[s])) != 0) return rc;
+  descents++;
+  return fetch(s);
+}
+
+/*
+ * Move side s to its first entry >= target.
+ * A merge join side reads forward, as the next key is usually close,
+ * but descends from the root once it has crossed SKIP_LEAVES leaves.
+ * A nested loop probe descends right away, unless the inner cursor is
+ * already at or past target, or the Bloom filter rules the key out.
+ */
+RC IndexJoin::advance(int s, KeyType target)
+{
+  RC rc;
+  PageId leaf;
+  int leaves = 0;
+
+  if(!valid[s] || key[s] >= target) return 0;
+  if(method == NESTED_LOOP_JOIN && s == 1){
+      const BloomFilter& bloom = index[1]->getBloomFilter();
+      if(bloom.isEnabled() && !bloom.mayContain(target)) return 0;
+      return seek(1, target);
+  }
+
+  while(valid[s] && key[s] < target){
+      leaf = cursor[s].pid;
+      if((rc = fetch(s)) != 0) return rc;
+      if(cursor[s].pid != leaf && ++leaves >= SKIP_LEAVES && valid[s] && key[s] < target)
+          return seek(s, target);
+  }
+  return 0;
+}
+
+/*
+ * Read the entries of side s with the key k, starting at the current one.
+ */
+RC IndexJoin::readGroup(int s, KeyType k)
+{
+  RC rc;
+  group[s].clear();
+  while(valid[s] && key[s] == k){
+      group[s].push_back(rid[s]);
+      if((rc = fetch(s)) != 0) return rc;
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef INDEXJOIN_H
+#define INDEXJOIN_H
+
+#include "BPBase.h"
+#include "BTreeIndex.h"
+#include <vector>
+
+/**
+ * The result pairs of a join, rids1[i] and rids2[i] are the entries of
+ * the two indexes joined on keys[i].
+ */
+typedef struct {
+  std::vector<KeyType>  keys;
+  std::vector<RecordId> rids1;
+  std::vector<RecordId> rids2;
+} JoinBatch;
+
+/**
+ * Equi-join of two BTreeIndex files on their keys, as an iterator that
+ * hands out the result a batch at a time. Neither input is read into
+ * memory; only the entries of the current key are kept, so a key with
+ * many duplicates on both sides produces all its pairs.
+ *
+ * MERGE_JOIN walks the leaf chains of both indexes in lockstep. A side
+ * that falls behind by more than a few leaves descends from the root to
+ * the other side's key instead of reading the leaves in between.
+ *
+ * NESTED_LOOP_JOIN scans the first (outer) index and probes the second
+ * (inner) index with its keys. The probes come in key order, so a probe
+ * whose key the inner cursor has already reached needs no descent, and
+ * the inner Bloom filter, when enabled, answers most misses.
+ *
+ * With BTNode::NODE_BUFFERED, call flushBuffers() on the inputs first.
+ * The indexes must not change while a join is open.
+ */
+class IndexJoin {
+ public:
+  static const int MERGE_JOIN       = 1;
+  static const int NESTED_LOOP_JOIN = 2;
+
+  // # leaves a merge join side reads past before it descends from the root
+  static const int SKIP_LEAVES = 2;
+
+  IndexJoin();
+
+  /**
+   * Start a join of the entries with lo <= key <= hi.
+   * @param index1[IN] the first index (the outer one of a nested loop join)
+   * @param index2[IN] the second index (the inner one)
+   * @param method[IN] MERGE_JOIN or NESTED_LOOP_JOIN
+   * @param lo[IN] the smallest key to join
+   * @param hi[IN] the largest key to join
+   * @return error code. 0 if no error
+   */
+  RC open(const BTreeIndex& index1, const BTreeIndex& index2, int method, KeyType lo, KeyType hi);
+
+  /**
+   * Produce the next result pairs, in key order.
+   * @param batch[OUT] at most maxPairs pairs; empty when the join is over
+   * @param maxPairs[IN] the size of the batch
+   * @return error code. 0 if no error
+   */
+  RC next(JoinBatch& batch, int maxPairs);
+
+  /**
+   * @return the # descents from the root made since open()
+   */
+  int getDescentCount() const { return descents; }
+
+ private:
+  const BTreeIndex* index[2];
+  int       method;
+  KeyType   hi;
+
+  // the next unread entry of each side, valid[s] is false at the end
+  IndexCursor cursor[2];
+  KeyType   key[2];
+  RecordId  rid[2];
+  bool      valid[2];
+
+  // the entries of both sides with the key being joined, and the next
+  // pair (group[0][gi], group[1][gj]) to output
+  KeyType   groupKey;
+  std::vector<RecordId> group[2];
+  size_t    gi, gj;
+
+  int       descents;
+
+  RC fetch(int s);
+  RC seek(int s, KeyType target);
+  RC advance(int s, KeyType target);
+  RC readGroup(int s, KeyType k);
+};
+
+#endif /* INDEXJOIN_H */
@@ -0,0 +1,188 @@
+#include "InnerLevels.h"
+#include <algorithm>
+
+using namespace std;
+
+InnerLevels::InnerLevels()
+{
+  top = NULL;
+  enabled = false;
+  liveCount = 0;
+  lookupCount = 0;
+  loadCount = 0;
+}
+
+InnerLevels::~InnerLevels()
+{
+  clear();
+}
+
+void InnerLevels::clear()
+{
+  unordered_map<PageId, InnerNode*>::iterator it;
+  for(it = nodes.begin(); it != nodes.end(); it++)
+    delete it->second;
+  nodes.clear();
+  top = NULL;
+  enabled = false;
+  liveCount = 0;
+}
+
+/*
+ * @return the node kept for pid, a new dead one if there is none
+ */
+InnerLevels::InnerNode* InnerLevels::nodeOf(PageId pid)
+{
+  InnerNode*& node = nodes[pid];
+  if(node == NULL){
+    node = new InnerNode;
+    node->pid = pid;
+    node->live = false;
+  }
+  return node;
+}
+
+/*
+ * Copy the keys and children of a page into its resident node. The
+ * children are swizzled when they are resident already; the others
+ * are swizzled by the first lookup that goes through them.
+ */
+void InnerLevels::copy(InnerNode* node, BTNode& page)
+{
+  unordered_map<PageId, InnerNode*>::iterator it;
+  int i;
+
+  if(!node->live) liveCount++;
+  node->live = true;
+  node->keys.resize(page.n);
+  node->pids.resize(page.n + 1);
+  node->children.resize(page.n + 1);
+  for(i = 0; i < page.n; i++)
+    node->keys[i] = page.getKey(i);
+  for(i = 0; i <= page.n; i++){
+    node->pids[i] = page.pids[i];
+    it = nodes.find(page.pids[i]);
+    node->children[i] = (it != nodes.end() && it->second->live) ? it->second : NULL;
+  }
+}
+
+/*
+ * Read the subtree of a non leaf node down to the level right above the
+ * leaves, swizzling every child on the way.
+ * @param level[IN] the level of pid, 1 for a node whose children are leaves
+ */
+RC InnerLevels::loadSubtree(PageId pid, int level, const PageFile& pf, InnerNode*& node)
+{
+  RC rc;
+  BTNode page;
+  int i;
+
+  if((rc = page.read(pid, pf)) != 0) return rc;
+  if(page.isLeaf) return RC_INVALID_FILE_FORMAT;
+  node = nodeOf(pid);
+  copy(node, page);
+  if(level <= 1) return 0;
+  for(i = 0; i <= page.n; i++)
+    if((rc = loadSubtree(page.pids[i], level - 1, pf, node->children[i])) != 0) return rc;
+  return 0;
+}
+
+RC InnerLevels::load(PageId rootPid, int height, const PageFile& pf)
+{
+  RC rc;
+
+  clear();
+  enabled = true;
+  if(rootPid == -1) return 0;
+  if((rc = loadSubtree(rootPid, height, pf, top)) != 0){
+    clear();
+    return rc;
+  }
+  return 0;
+}
+
+/*
+ * @param node[OUT] the resident node of pid, read from the page if it
+ * is not resident (e.g. a sibling that was split off after its parent
+ * was copied)
+ */
+RC InnerLevels::fetch(PageId pid, const PageFile& pf, InnerNode*& node)
+{
+  RC rc;
+  BTNode page;
+  unordered_map<PageId, InnerNode*>::iterator it = nodes.find(pid);
+
+  if(it != nodes.end() && it->second->live){
+    node = it->second;
+    return 0;
+  }
+  if((rc = page.read(pid, pf)) != 0) return rc;
+  if(page.isLeaf) return RC_INVALID_FILE_FORMAT;
+  loadCount++;
+  node = nodeOf(pid);
+  copy(node, page);
+  return 0;
+}
+
+/*
+ * Walk the resident nodes down to the leaf with the rule of
+ * BTNode::locate() (the first separator >= searchKey), then read the leaf.
+ */
+RC InnerLevels::locate(KeyType searchKey, PageId rootPid, int height, const PageFile& pf, IndexCursor& cursor)
+{
+  RC rc;
+  BTNode leaf;
+  InnerNode* node;
+  int i, level;
+
+  lookupCount++;
+  if(top == NULL || top->pid != rootPid || !top->live){
+    if((rc = fetch(rootPid, pf, top)) != 0) return rc;
+  }
+  node = top;
+  for(level = height; ; level--){
+    i = (int)(lower_bound(node->keys.begin(), node->keys.end(), searchKey) - node->keys.begin());
+    if(level <= 1) break;
+    InnerNode*& child = node->children[i];
+    if(child == NULL || !child->live){
+      if((rc = fetch(node->pids[i], pf, child)) != 0) return rc;
+    }
+    node = child;
+  }
+  if((rc = leaf.read(node->pids[i], pf)) != 0) return rc;
+  if(!leaf.isLeaf) return RC_INVALID_FILE_FORMAT;
+  return leaf.locate(searchKey, pf, cursor);
+}
+
+void InnerLevels::update(BTNode& node)
+{
+  if(!enabled || node.isLeaf || node.pid == -1) return;
+  copy(nodeOf(node.pid), node);
+}
+
+void InnerLevels::drop(PageId pid)
+{
+  unordered_map<PageId, InnerNode*>::iterator it;
+
+  if(!enabled || (it = nodes.find(pid)) == nodes.end() || !it->second->live) return;
+  // the parent is rewritten by the same change and stops pointing here
+  it->second->live = false;
+  it->second->keys.clear();
+  it->second->pids.clear();
+  it->second->children.clear();
+  liveCount--;
+}
+
+size_t InnerLevels::getMemoryBytes() const
+{
+  unordered_map<PageId, InnerNode*>::const_iterator it;
+  size_t bytes = 0;
+
+  for(it = nodes.begin(); it != nodes.end(); it++){
+    const InnerNode* node = it->second;
+    bytes += sizeof(InnerNode) + node->keys.capacity() * sizeof(KeyType)
+             + node->pids.capacity() * sizeof(PageId)
+             + node->children.capacity() * sizeof(InnerNode*);
+  }
+  return bytes;
+}
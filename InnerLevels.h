@@ -0,0 +1,114 @@
+#ifndef INNERLEVELS_H
+#define INNERLEVELS_H
+
+#include <vector>
+#include <unordered_map>
+#include "BPBase.h"
+#include "PageFile.h"
+#include "BTreeNode.h"
+
+/**
+ * An in-memory copy of the non leaf levels of a BTreeIndex.
+ * The non leaf nodes are few (a few hundred leaves per node), so all of
+ * them can be kept in memory while the leaves stay on disk. Every child
+ * PageId of a resident node is "swizzled" into a pointer to the resident
+ * child, so a lookup walks from the root to the leaf level without any
+ * page read or PageId lookup, and reads the leaf only.
+ *
+ * The pages themselves are still written by the BTNode code. Every write
+ * of a non leaf node on the insert and remove paths is handed to
+ * update(), and every freed page to drop() (see TreeContext::inner), so
+ * the copy never goes stale. A resident node is never deleted before
+ * clear(), only marked dead, so a pointer to it is always safe to follow;
+ * a dead or missing child is found again by its PageId on the next lookup.
+ */
+class InnerLevels {
+ public:
+  InnerLevels();
+  ~InnerLevels();
+
+  /**
+   * Read all non leaf nodes of a tree into memory and keep them up to
+   * date from now on.
+   * @param rootPid[IN] the root of the tree, -1 if it is empty
+   * @param height[IN] the # non leaf levels of the tree
+   * @param pf[IN] the PageFile of the index
+   * @return error code. 0 if no error
+   */
+  RC load(PageId rootPid, int height, const PageFile& pf);
+
+  /**
+   * Drop all nodes and disable the copy. The counters are kept.
+   */
+  void clear();
+
+  /**
+   * @return true if the non leaf levels are kept in memory
+   */
+  bool isEnabled() const { return enabled; }
+
+  /**
+   * Find the first entry >= searchKey, like BTNode::locate() from the
+   * root, reading the leaf only.
+   * @param searchKey[IN] the key to find
+   * @param rootPid[IN] the root of the tree
+   * @param height[IN] the # non leaf levels of the tree
+   * @param pf[IN] the PageFile of the index
+   * @param cursor[OUT] the first entry >= searchKey, pid -1 if there is none
+   * @return error code. 0 if no error
+   */
+  RC locate(KeyType searchKey, PageId rootPid, int height, const PageFile& pf, IndexCursor& cursor);
+
+  /**
+   * Copy a non leaf node that was just written to its page.
+   * @param node[IN] the node, with its pid set
+   */
+  void update(BTNode& node);
+
+  /**
+   * Forget a page that was freed.
+   * @param pid[IN] the page
+   */
+  void drop(PageId pid);
+
+  /**
+   * @return the # resident non leaf nodes
+   */
+  int getNodeCount() const { return liveCount; }
+
+  /**
+   * @return the memory used by the resident nodes in bytes
+   */
+  size_t getMemoryBytes() const;
+
+  /**
+   * @return the # lookups, and the # non leaf pages read because they
+   * were not resident (0 as long as every change went through update())
+   */
+  long long getLookupCount() const { return lookupCount; }
+  long long getLoadCount() const { return loadCount; }
+
+ private:
+  typedef struct InnerNode {
+    PageId pid;
+    bool   live;                        // false once the page was freed
+    std::vector<KeyType> keys;
+    std::vector<PageId>  pids;
+    std::vector<struct InnerNode*> children; // swizzled pids, NULL if not yet
+  } InnerNode;
+
+  std::unordered_map<PageId, InnerNode*> nodes;
+  InnerNode* top;    // the root as of the last lookup
+  bool enabled;
+  int  liveCount;
+
+  long long lookupCount;
+  long long loadCount;
+
+  InnerNode* nodeOf(PageId pid);
+  RC fetch(PageId pid, const PageFile& pf, InnerNode*& node);
+  RC loadSubtree(PageId pid, int level, const PageFile& pf, InnerNode*& node);
+  void copy(InnerNode* node, BTNode& page);
+};
+
+#endif // INNERLEVELS_H
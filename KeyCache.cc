@@ -0,0 +1,106 @@
+#include "KeyCache.h"
+
+using namespace std;
+
+// approximate memory of one cached key: the list node and the hash node
+// with its bucket, plus up to two version counters
+static const size_t BYTES_PER_ENTRY = 64 + 8 * sizeof(void*);
+
+KeyCache::KeyCache()
+{
+  capacity = 0;
+  hitCount = 0;
+  missCount = 0;
+}
+
+void KeyCache::init(size_t budget)
+{
+  clear();
+  capacity = (int)(budget / BYTES_PER_ENTRY);
+  // a power of 2 of counters, at least one per entry
+  if(capacity > 0){
+      size_t slots = 1;
+      while(slots < (size_t)capacity) slots <<= 1;
+      versions.assign(slots, 0);
+  }
+  hitCount = 0;
+  missCount = 0;
+}
+
+void KeyCache::clear()
+{
+  lru.clear();
+  entries.clear();
+  versions.clear();
+  capacity = 0;
+}
+
+/*
+ * Look up a key; a hit moves the entry to the front of the LRU list.
+ * @return true on a hit
+ */
+bool KeyCache::lookup(KeyType key, IndexCursor& cursor, RecordId& rid)
+{
+  unordered_map<KeyType, LruList::iterator>::iterator it = entries.find(key);
+  if(it == entries.end()){
+      missCount++;
+      return false;
+  }
+  LruList::iterator e = it->second;
+  if(e->version != versionOf(e->cursor.pid)){
+      // the leaf changed since the entry was cached
+      lru.erase(e);
+      entries.erase(it);
+      missCount++;
+      return false;
+  }
+  lru.splice(lru.begin(), lru, e);
+  cursor = e->cursor;
+  rid = e->rid;
+  hitCount++;
+  return true;
+}
+
+void KeyCache::put(KeyType key, const IndexCursor& cursor, const RecordId& rid)
+{
+  if(capacity == 0) return;
+
+  unordered_map<KeyType, LruList::iterator>::iterator it = entries.find(key);
+  if(it != entries.end()){
+      lru.erase(it->second);
+      entries.erase(it);
+  }else if((int)lru.size() >= capacity){
+      entries.erase(lru.back().key);
+      lru.pop_back();
+  }
+
+  Entry e;
+  e.key = key;
+  e.cursor = cursor;
+  e.rid = rid;
+  e.version = versionOf(cursor.pid);
+  lru.push_front(e);
+  entries[key] = lru.begin();
+}
+
+void KeyCache::invalidate(PageId leaf)
+{
+  if(capacity == 0) return;
+  versions[slotOf(leaf)]++;
+}
+
+double KeyCache::getHitRate() const
+{
+  long long lookups = hitCount + missCount;
+  return lookups == 0 ? 0.0 : (double)hitCount / lookups;
+}
+
+unsigned KeyCache::versionOf(PageId leaf) const
+{
+  return versions.empty() ? 0 : versions[slotOf(leaf)];
+}
+
+size_t KeyCache::slotOf(PageId leaf) const
+{
+  return ((unsigned)leaf * 2654435761u) & (versions.size() - 1);
+}
@@ -0,0 +1,95 @@
+#ifndef KEYCACHE_H
+#define KEYCACHE_H
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include "BPBase.h"
+#include "BTreeNode.h"
+
+/**
+ * An LRU cache for point lookups: key -> (leaf cursor, RecordId).
+ * The cache is kept consistent with cheap per-leaf versions: every time
+ * a leaf is changed on the insert path its version is bumped, and a
+ * cached entry taken from an older version of the leaf counts as a miss
+ * and is dropped. The versions are kept in a fixed table of counters
+ * hashed by leaf, so leaves that share a counter only cost extra misses.
+ * The cache is not thread-safe.
+ */
+class KeyCache {
+ public:
+  KeyCache();
+
+  /**
+   * (Re)initialize an empty cache.
+   * @param budget[IN] memory budget in bytes, 0 disables the cache
+   */
+  void init(size_t budget);
+
+  /**
+   * Drop all entries and disable the cache. The counters are kept.
+   */
+  void clear();
+
+  /**
+   * @return true if the cache has been initialized
+   */
+  bool isEnabled() const { return capacity > 0; }
+
+  /**
+   * Look up a key and count a hit or a miss.
+   * @param key[IN] the key to find
+   * @param cursor[OUT] the leaf entry holding the key
+   * @param rid[OUT] the RecordId of the entry
+   * @return true on a hit
+   */
+  bool lookup(KeyType key, IndexCursor& cursor, RecordId& rid);
+
+  /**
+   * Remember the result of a point lookup, evicting the least recently
+   * used entry when the cache is full.
+   * @param key[IN] the key found
+   * @param cursor[IN] the leaf entry holding the key
+   * @param rid[IN] the RecordId of the entry
+   */
+  void put(KeyType key, const IndexCursor& cursor, const RecordId& rid);
+
+  /**
+   * Invalidate all entries pointing into a leaf, e.g. because an entry
+   * was inserted into it or it was split.
+   * @param leaf[IN] the PageId of the leaf
+   */
+  void invalidate(PageId leaf);
+
+  int getEntryCount() const { return (int)lru.size(); }
+  int getCapacity() const   { return capacity; }   // # entries within the budget
+
+  /**
+   * @return the # lookups that were answered from the cache and that were not
+   */
+  long long getHitCount() const  { return hitCount; }
+  long long getMissCount() const { return missCount; }
+  double getHitRate() const;
+
+ private:
+  typedef struct {
+    KeyType     key;
+    IndexCursor cursor;
+    RecordId    rid;
+    unsigned    version;   // version of cursor.pid when cached
+  } Entry;
+  typedef std::list<Entry> LruList;
+
+  LruList lru;                                            // most recent first
+  std::unordered_map<KeyType, LruList::iterator> entries;
+  std::vector<unsigned> versions;   // leaf versions, hashed by PageId
+  int capacity;
+
+  long long hitCount;
+  long long missCount;
+
+  unsigned versionOf(PageId leaf) const;
+  size_t slotOf(PageId leaf) const;
+};
+
+#endif // KEYCACHE_H
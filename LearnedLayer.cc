@@ -0,0 +1,149 @@
+#include "LearnedLayer.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+LearnedLayer::LearnedLayer()
+{
+  leafCount = 0;
+  epsilon = 0;
+  maxKey = 0;
+  lookupCount = 0;
+  leafReadCount = 0;
+}
+
+void LearnedLayer::clear()
+{
+  segments.clear();
+  runs.clear();
+  leafCount = 0;
+}
+
+/*
+ * Cut the points (last key, first leaf with that last key) into
+ * segments greedily: a segment grows as long as some slope through its
+ * first point keeps every point within +-epsilon (the cone of allowed
+ * slopes only shrinks), and the middle of the cone is taken.
+ * @param lastKeys[IN] the last key of every non-empty leaf, in key order
+ * @param pids[IN] the PageId of every non-empty leaf, in key order
+ * @param epsilon[IN] the largest prediction error in leaves
+ */
+void LearnedLayer::build(const vector<KeyType>& lastKeys, const vector<PageId>& pids, int epsilon)
+{
+  vector<KeyType> xs;
+  vector<int> ys;
+  size_t i, j;
+
+  clear();
+  if(lastKeys.empty() || lastKeys.size() != pids.size()) return;
+  this->epsilon = epsilon < 1 ? 1 : epsilon;
+  leafCount = (int)lastKeys.size();
+  maxKey = lastKeys.back();
+
+  for(i = 0; i < lastKeys.size(); i++){
+    if(i == 0 || pids[i] != pids[i-1] + 1){
+      Run run = { (int)i, pids[i] };
+      runs.push_back(run);
+    }
+    // a key that fills several leaves is looked up in the first of them
+    if(i == 0 || lastKeys[i] != lastKeys[i-1]){
+      xs.push_back(lastKeys[i]);
+      ys.push_back((int)i);
+    }
+  }
+
+  for(i = 0; i < xs.size(); i = j){
+    double lo = 0, hi = HUGE_VAL;
+    for(j = i + 1; j < xs.size(); j++){
+      double dx = (double)xs[j] - xs[i];
+      double l = (ys[j] - this->epsilon - ys[i]) / dx;
+      double h = (ys[j] + this->epsilon - ys[i]) / dx;
+      if(l > hi || h < lo) break;
+      lo = max(lo, l);
+      hi = min(hi, h);
+    }
+    Segment seg = { xs[i], ys[i], hi == HUGE_VAL ? 0 : (lo + hi) / 2 };
+    segments.push_back(seg);
+  }
+}
+
+/*
+ * @return the predicted leaf of key, never beyond the first leaf of the
+ * next segment
+ */
+int LearnedLayer::predict(KeyType key) const
+{
+  size_t s, lo = 0, hi = segments.size();
+  double leaf;
+
+  if(key <= segments[0].key) return 0;
+  // the last segment with a first key <= key
+  while(hi - lo > 1){
+    s = (lo + hi) / 2;
+    if(segments[s].key <= key) lo = s;
+    else hi = s;
+  }
+  leaf = segments[lo].leaf + segments[lo].slope * ((double)key - segments[lo].key);
+  if(lo + 1 < segments.size() && leaf > segments[lo+1].leaf) leaf = segments[lo+1].leaf;
+  if(leaf > leafCount - 1) leaf = leafCount - 1;
+  return (int)(leaf + 0.5);
+}
+
+PageId LearnedLayer::pidOf(int leaf) const
+{
+  size_t r, lo = 0, hi = runs.size();
+  while(hi - lo > 1){
+    r = (lo + hi) / 2;
+    if(runs[r].leaf <= leaf) lo = r;
+    else hi = r;
+  }
+  return runs[lo].pid + (leaf - runs[lo].leaf);
+}
+
+/*
+ * Read the predicted leaf, then step to the first leaf whose last key
+ * is >= searchKey: to the right while the last key is smaller, to the
+ * left while the leaf before may hold keys >= searchKey.
+ * @param searchKey[IN] the key to find
+ * @param pf[IN] the PageFile of the index
+ * @param cursor[OUT] the first entry >= searchKey, pid -1 if there is none
+ * @return error code. 0 if no error
+ */
+RC LearnedLayer::locate(KeyType searchKey, const PageFile& pf, IndexCursor& cursor)
+{
+  RC rc;
+  BTNode node[2];   // the current leaf and the one before it
+  int c = 0, leaf;
+
+  cursor.pid = -1;
+  cursor.eid = -1;
+  if(leafCount == 0 || searchKey > maxKey) return 0;
+
+  lookupCount++;
+  leaf = predict(searchKey);
+  if((rc = node[c].read(pidOf(leaf), pf)) != 0) return rc;
+  leafReadCount++;
+
+  if(node[c].getKey(node[c].n - 1) < searchKey){
+    while(node[c].getKey(node[c].n - 1) < searchKey && leaf + 1 < leafCount){
+      if((rc = node[c].read(pidOf(++leaf), pf)) != 0) return rc;
+      leafReadCount++;
+    }
+  }else{
+    // a leaf whose first key is smaller follows all smaller keys
+    while(leaf > 0 && node[c].getKey(0) >= searchKey){
+      if((rc = node[1-c].read(pidOf(leaf - 1), pf)) != 0) return rc;
+      leafReadCount++;
+      if(node[1-c].getKey(node[1-c].n - 1) < searchKey) break;
+      c = 1 - c;
+      leaf--;
+    }
+  }
+  return node[c].locate(searchKey, pf, cursor);
+}
+
+size_t LearnedLayer::getMemoryBytes() const
+{
+  return segments.size() * sizeof(Segment) + runs.size() * sizeof(Run);
+}
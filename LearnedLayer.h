@@ -0,0 +1,94 @@
+#ifndef LEARNEDLAYER_H
+#define LEARNEDLAYER_H
+
+#include <vector>
+#include "BPBase.h"
+#include "PageFile.h"
+#include "BTreeNode.h"
+
+/**
+ * A read-only replacement for the non leaf levels of a BTreeIndex.
+ * The non-empty leaves are numbered 0, 1, ... in key order, and a
+ * piecewise linear function of the key is fit to the number of the first
+ * leaf whose last key is >= the key, within +-epsilon leaves (the
+ * segments are cut greedily, as in a FITing-tree / PGM index). A lookup
+ * computes the predicted leaf and walks from there to the right leaf,
+ * which is usually one or two leaf reads and never a non leaf node.
+ *
+ * Leaf numbers are mapped to PageIds by runs of leaves on consecutive
+ * pages, so the layer is small for an index whose leaves are in page
+ * order, e.g. after BTreeIndex::defragment(). The layer describes the
+ * leaves at the time it was built; the index drops it on any change.
+ */
+class LearnedLayer {
+ public:
+  LearnedLayer();
+
+  /**
+   * Fit the model over the leaves of an index.
+   * @param lastKeys[IN] the last key of every non-empty leaf, in key order
+   * @param pids[IN] the PageId of every non-empty leaf, in key order
+   * @param epsilon[IN] the largest prediction error in leaves (>= 1)
+   */
+  void build(const std::vector<KeyType>& lastKeys, const std::vector<PageId>& pids, int epsilon);
+
+  /**
+   * Drop the model and disable the layer. The counters are kept.
+   */
+  void clear();
+
+  /**
+   * @return true if the layer has been built over a non-empty index
+   */
+  bool isEnabled() const { return leafCount > 0; }
+
+  /**
+   * Find the first entry >= searchKey, like BTNode::locate() from the root.
+   * @param searchKey[IN] the key to find
+   * @param pf[IN] the PageFile of the index
+   * @param cursor[OUT] the first entry >= searchKey, pid -1 if there is none
+   * @return error code. 0 if no error
+   */
+  RC locate(KeyType searchKey, const PageFile& pf, IndexCursor& cursor);
+
+  /**
+   * @return the memory used by the model in bytes
+   */
+  size_t getMemoryBytes() const;
+
+  int getSegmentCount() const { return (int)segments.size(); }
+  int getRunCount() const     { return (int)runs.size(); }
+  int getEpsilon() const      { return epsilon; }
+
+  /**
+   * @return the # lookups and the # leaves they read
+   */
+  long long getLookupCount() const { return lookupCount; }
+  long long getLeafReadCount() const { return leafReadCount; }
+
+ private:
+  typedef struct {
+    KeyType key;     // the first key of the segment
+    int     leaf;    // the leaf predicted for key
+    double  slope;   // leaves per key
+  } Segment;
+
+  typedef struct {
+    int     leaf;    // the first leaf of the run
+    PageId  pid;     // its page, the following leaves are on pid+1, ...
+  } Run;
+
+  std::vector<Segment> segments;
+  std::vector<Run> runs;
+  int     leafCount;
+  int     epsilon;
+  KeyType maxKey;    // the last key of the last leaf
+
+  long long lookupCount;
+  long long leafReadCount;
+
+  int predict(KeyType key) const;
+  PageId pidOf(int leaf) const;
+};
+
+#endif // LEARNEDLAYER_H
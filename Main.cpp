@@ -2,7 +2,19 @@
 //this project is for MJoin B+ tree research
 
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 using namespace std;
 
 #include "BTreeIndex.h"
@@ -19,45 +31,295 @@ int main(int argc, char* argv[])
 	system("pause");
 }
 
+//
+// the ingest pipeline of GenerateBPlusTreeFromFile:
+// reader -> parse workers -> record append -> index build,
+// connected by bounded queues so a fast stage waits for a slow one
+// instead of buffering the whole file
+//
+
+// # bytes the reader takes from the data file at once
+static const size_t INGEST_CHUNK_BYTES = 4 << 20;
+
+// a queue of at most capacity items. pop() waits for an item and returns
+// false once the queue is closed and empty.
+template <class T>
+class BoundedQueue {
+public:
+	BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+	void push(T item)
+	{
+		unique_lock<mutex> lock(m);
+		while(items.size() >= capacity)
+			notFull.wait(lock);
+		items.push_back(item);
+		notEmpty.notify_one();
+	}
+
+	bool pop(T& item)
+	{
+		unique_lock<mutex> lock(m);
+		while(items.empty() && !closed)
+			notEmpty.wait(lock);
+		if(items.empty())
+			return false;
+		item = items.front();
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		lock_guard<mutex> lock(m);
+		closed = true;
+		notEmpty.notify_all();
+	}
+
+private:
+	mutex m;
+	condition_variable notFull, notEmpty;
+	deque<T> items;
+	size_t capacity;
+	bool closed;
+};
+
+// whole lines of the data file, seq-th chunk of the file
+typedef struct {
+	long long seq;
+	string data;
+} TextChunk;
+
+// the records of a chunk. last is set if the chunk has the empty line
+// that ends the data
+typedef struct {
+	long long seq;
+	bool last;
+	vector<KeyType> keys;
+	vector<string> values;
+	vector<RecordId> rids;
+} RecordChunk;
+
+typedef struct {
+	FILE* file;
+	int workers;
+	BoundedQueue<TextChunk*>* text;
+	BoundedQueue<RecordChunk*>* parsed;
+	BoundedQueue<RecordChunk*>* appended;
+	atomic<int> parsersLeft;
+	RecordFile* recordFile;
+	atomic<bool> done;    // the empty line that ends the data was appended
+	atomic<bool> failed;
+	long long count;
+} IngestJob;
+
+// read the file in large chunks; the part of a line at the end of a
+// chunk goes to the next one
+static void readChunks(IngestJob* job)
+{
+	string carry;
+	long long seq = 0;
+	size_t n, cut;
+
+	// stop early when the data ended or a later stage failed
+	while(!job->done && !job->failed){
+		TextChunk* chunk = new TextChunk;
+		chunk->seq = seq;
+		chunk->data.swap(carry);
+		size_t used = chunk->data.size();
+		chunk->data.resize(used + INGEST_CHUNK_BYTES);
+		n = fread(&chunk->data[used], 1, INGEST_CHUNK_BYTES, job->file);
+		chunk->data.resize(used + n);
+		if(n == 0){
+			// the last line may have no newline
+			if(chunk->data.empty()){
+				delete chunk;
+				break;
+			}
+			chunk->data.push_back('\n');
+		}else{
+			cut = chunk->data.find_last_of('\n');
+			cut = (cut == string::npos) ? 0 : cut + 1;
+			carry.assign(chunk->data, cut, string::npos);
+			chunk->data.resize(cut);
+			if(cut == 0){
+				// a line longer than a chunk keeps growing in carry
+				delete chunk;
+				continue;
+			}
+		}
+		seq++;
+		job->text->push(chunk);
+	}
+	job->text->close();
+}
+
+// the integer at the start of a line, like (int)atof() for plain
+// numbers: leading blanks, a sign and digits, anything after is ignored
+static KeyType parseKey(const char* p, const char* end)
+{
+	long long v = 0;
+	bool neg = false;
+
+	while(p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if(p < end && (*p == '-' || *p == '+'))
+		neg = (*p++ == '-');
+	for(; p < end && (unsigned)(*p - '0') < 10; p++){
+		v = v * 10 + (*p - '0');
+		if(v > (long long)INT_MAX + 1)
+			v = (long long)INT_MAX + 1;
+	}
+	if(neg)
+		v = -v;
+	if(v > INT_MAX)
+		v = INT_MAX;
+	return (KeyType)v;
+}
+
+static void parseChunks(IngestJob* job)
+{
+	TextChunk* chunk;
+
+	while(job->text->pop(chunk)){
+		RecordChunk* records = new RecordChunk;
+		const char* p = chunk->data.data();
+		const char* end = p + chunk->data.size();
+		const char* eol;
+		records->seq = chunk->seq;
+		records->last = false;
+		for(; p < end; p = eol + 1){
+			eol = (const char*)memchr(p, '\n', end - p);
+			const char* stop = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+			// an empty line ends the data
+			if(stop == p){
+				records->last = true;
+				break;
+			}
+			records->keys.push_back(parseKey(p, stop));
+			records->values.push_back(string(p, stop - p));
+		}
+		delete chunk;
+		job->parsed->push(records);
+	}
+	if(--job->parsersLeft == 0)
+		job->parsed->close();
+}
+
+// append the records to the record file in the order of the file. The
+// chunks come out of the parse workers in any order, so the ones ahead
+// wait in pending.
+static void appendChunks(IngestJob* job)
+{
+	map<long long, RecordChunk*> pending;
+	long long next = 0;
+	bool done = false;
+	RecordChunk* records;
+	RC rc;
+
+	while(job->parsed->pop(records)){
+		pending[records->seq] = records;
+		while(!pending.empty() && pending.begin()->first == next){
+			records = pending.begin()->second;
+			pending.erase(pending.begin());
+			next++;
+			if(done || job->failed){
+				delete records;
+				continue;
+			}
+			records->rids.resize(records->keys.size());
+			for(size_t i = 0; i < records->keys.size(); i++){
+				if((rc = job->recordFile->append(records->keys[i], records->values[i], records->rids[i])) < 0){
+					printf("RecordFile::append failed: %d\n", rc);
+					job->failed = true;
+					break;
+				}
+			}
+			done = records->last;
+			job->done = done;
+			records->values.clear();
+			job->appended->push(records);
+		}
+	}
+	for(map<long long, RecordChunk*>::iterator it = pending.begin(); it != pending.end(); it++)
+		delete it->second;
+	job->appended->close();
+}
+
+// build the index from the appended records, in the calling thread
+static void indexChunks(IngestJob* job, BTreeIndex& index)
+{
+	RecordChunk* records;
+	RC rc;
+
+	while(job->appended->pop(records)){
+		for(size_t i = 0; i < records->keys.size() && !job->failed; i++){
+			if((rc = index.insert(records->keys[i], records->rids[i])) < 0){
+				printf("BTreeIndex::insert failed: %d\n", rc);
+				job->failed = true;
+			}
+		}
+		if(!job->failed)
+			job->count += records->keys.size();
+		delete records;
+	}
+}
+
 void GenerateBPlusTreeFromFile(int argc, char* argv[])
 {
-	cout<<"argv: string:datafileName\n";
+	cout<<"argv: string:datafileName [number:parseWorkers]\n";
+	if(argc < 2){
+		cout<<"invalid argv...\nexit\n";
+		return;
+	}
 	string fileName(argv[1]);
 	cout<<"loading data from file...\n";
-	ifstream file(fileName, ios::in);
+	FILE* file = fopen(fileName.c_str(), "rb");
+	if(!file){
+		cout<<"File open failed.\n";
+		return;
+	}
 
 	RecordFile recordFile;
 	recordFile.open(fileName+".tbl",'w');
 	BTreeIndex btreeindex;
 	btreeindex.open(fileName+".idx",'w');
 
-	KeyType key;
-	string value;
-	RecordId rid;
-	
 	//create B+ tree from data file
-	string line;
-	if(!file){
-		cout<<"File open failed.\n";
-		return;
-	}
-		
-	while(getline(file, line)){
-		if(line.compare("")==0)
-			break;
-		key = atof(line.c_str());	
-		value = line;
-		recordFile.append(key, value, rid);
-		btreeindex.insert(key, rid);
-	}
+	IngestJob job;
+	job.file = file;
+	job.workers = (argc > 2) ? atoi(argv[2]) : (int)thread::hardware_concurrency();
+	if(job.workers < 1)
+		job.workers = 1;
+	BoundedQueue<TextChunk*> text(job.workers * 2);
+	BoundedQueue<RecordChunk*> parsed(job.workers * 2);
+	BoundedQueue<RecordChunk*> appended(4);
+	job.text = &text;
+	job.parsed = &parsed;
+	job.appended = &appended;
+	job.parsersLeft = job.workers;
+	job.recordFile = &recordFile;
+	job.done = false;
+	job.failed = false;
+	job.count = 0;
+
+	vector<thread> threads;
+	threads.push_back(thread(readChunks, &job));
+	for(int i = 0; i < job.workers; i++)
+		threads.push_back(thread(parseChunks, &job));
+	threads.push_back(thread(appendChunks, &job));
+	indexChunks(&job, btreeindex);
+	for(size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
 
 	btreeindex.close();
 	recordFile.close();
-	file.close();
+	fclose(file);
+	cout<<job.count<<" records loaded.\n";
 	cout<<"Done.\nTest index file...";
 
 	//search
-	BTreeIndex btreeindex;
 	btreeindex.open(fileName+".idx",'r');
 	
 	KeyType minkey = btreeindex.getMinimumKey();
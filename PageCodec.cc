@@ -0,0 +1,134 @@
+#include "PageCodec.h"
+#include <string.h>
+#include <stdint.h>
+
+// the match finder remembers the last position of every hashed 4 byte string
+static const int HASH_BITS = 12;
+static const int MAX_OFFSET = 65535;
+
+static uint32_t read32(const char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int hash32(uint32_t v)
+{
+  return (int)((v * 2654435761u) >> (32 - HASH_BITS));
+}
+
+// write the part of a length above 15 as 255, 255, ..., rest
+static int putLength(char* dst, int pos, int dstCap, int len)
+{
+  for(; len >= 255; len -= 255){
+    if(pos >= dstCap) return -1;
+    dst[pos++] = (char)255;
+  }
+  if(pos >= dstCap) return -1;
+  dst[pos++] = (char)len;
+  return pos;
+}
+
+/*
+ * Append one sequence: the literals src[anchor..anchor+lit) and, when
+ * mlen > 0, a match of mlen bytes at offset back.
+ * @return the new end of dst, -1 if it does not fit
+ */
+static int putSequence(const char* src, int anchor, int lit, int offset, int mlen, char* dst, int pos, int dstCap)
+{
+  int token = pos++;
+  int m = mlen > 0 ? mlen - PageCodec::MIN_MATCH : 0;
+
+  if(pos > dstCap) return -1;
+  dst[token] = (char)(((lit < 15 ? lit : 15) << 4) | (m < 15 ? m : 15));
+  if(lit >= 15 && (pos = putLength(dst, pos, dstCap, lit - 15)) < 0) return -1;
+  if(pos + lit > dstCap) return -1;
+  memcpy(dst + pos, src + anchor, lit);
+  pos += lit;
+  if(mlen == 0) return pos;
+
+  if(pos + 2 > dstCap) return -1;
+  dst[pos++] = (char)(offset & 0xff);
+  dst[pos++] = (char)(offset >> 8);
+  if(m >= 15 && (pos = putLength(dst, pos, dstCap, m - 15)) < 0) return -1;
+  return pos;
+}
+
+/*
+ * Greedy LZ77: look up the 4 bytes at every position in a hash table of
+ * earlier positions, and take a match as long as it goes.
+ * @return # bytes written to dst, 0 if they do not fit in dstCap
+ */
+int PageCodec::compress(const char* src, int srcLen, char* dst, int dstCap)
+{
+  int table[1 << HASH_BITS];
+  int ip = 0, anchor = 0, pos = 0;
+
+  for(int i = 0; i < (1 << HASH_BITS); i++) table[i] = -1;
+
+  while(ip + MIN_MATCH <= srcLen){
+    uint32_t seq = read32(src + ip);
+    int h = hash32(seq);
+    int ref = table[h];
+    table[h] = ip;
+    if(ref < 0 || ip - ref > MAX_OFFSET || read32(src + ref) != seq){
+      ip++;
+      continue;
+    }
+
+    int mlen = MIN_MATCH;
+    while(ip + mlen < srcLen && src[ref + mlen] == src[ip + mlen]) mlen++;
+    if((pos = putSequence(src, anchor, ip - anchor, ip - ref, mlen, dst, pos, dstCap)) < 0) return 0;
+    ip += mlen;
+    anchor = ip;
+  }
+  if((pos = putSequence(src, anchor, srcLen - anchor, 0, 0, dst, pos, dstCap)) < 0) return 0;
+  return pos;
+}
+
+// read a length continued by 255, 255, ..., rest
+static int getLength(const char* src, int& pos, int srcLen, int len)
+{
+  unsigned char b;
+  do{
+    if(pos >= srcLen) return -1;
+    b = (unsigned char)src[pos++];
+    len += b;
+  }while(b == 255);
+  return len;
+}
+
+/*
+ * Replay the sequences; every length and offset is checked against the
+ * buffers, so a corrupt page gives an error and not a crash.
+ * @return error code. RC_INVALID_FILE_FORMAT if src is corrupt
+ */
+RC PageCodec::decompress(const char* src, int srcLen, char* dst, int dstLen)
+{
+  int pos = 0, op = 0;
+
+  while(pos < srcLen){
+    int token = (unsigned char)src[pos++];
+    int lit = token >> 4;
+    int mlen = token & 15;
+
+    if(lit == 15 && (lit = getLength(src, pos, srcLen, lit)) < 0) return RC_INVALID_FILE_FORMAT;
+    if(pos + lit > srcLen || op + lit > dstLen) return RC_INVALID_FILE_FORMAT;
+    memcpy(dst + op, src + pos, lit);
+    pos += lit;
+    op += lit;
+    if(pos == srcLen) break;   // the last sequence has no match
+
+    if(pos + 2 > srcLen) return RC_INVALID_FILE_FORMAT;
+    int offset = (unsigned char)src[pos] | ((unsigned char)src[pos + 1] << 8);
+    pos += 2;
+    if(mlen == 15 && (mlen = getLength(src, pos, srcLen, mlen)) < 0) return RC_INVALID_FILE_FORMAT;
+    mlen += MIN_MATCH;
+    if(offset == 0 || offset > op || op + mlen > dstLen) return RC_INVALID_FILE_FORMAT;
+    // byte by byte, as the match may overlap the bytes it produces
+    for(int i = 0; i < mlen; i++, op++)
+      dst[op] = dst[op - offset];
+  }
+  return op == dstLen ? 0 : RC_INVALID_FILE_FORMAT;
+}
@@ -0,0 +1,40 @@
+#ifndef PAGECODEC_H
+#define PAGECODEC_H
+
+#include "BPBase.h"
+
+/**
+ * A small LZ77 codec for pages (LZ4 style sequences, no external library).
+ * A compressed page is a list of sequences, each a token byte (literal
+ * length in the high 4 bits, match length - MIN_MATCH in the low 4 bits),
+ * more length bytes when a nibble is 15, the literals, and the 2 byte
+ * offset of the match. The last sequence has literals only.
+ * Index and record pages are mostly zero padding and repeated key bytes,
+ * which the codec turns into a few long matches.
+ */
+class PageCodec {
+ public:
+  static const int MIN_MATCH = 4;
+
+  /**
+   * Compress src into dst.
+   * @param src[IN] the bytes to compress
+   * @param srcLen[IN] # bytes in src
+   * @param dst[OUT] the compressed bytes
+   * @param dstCap[IN] the size of dst
+   * @return # bytes written to dst, 0 if they do not fit in dstCap
+   */
+  static int compress(const char* src, int srcLen, char* dst, int dstCap);
+
+  /**
+   * Decompress src into exactly dstLen bytes.
+   * @param src[IN] the compressed bytes
+   * @param srcLen[IN] # bytes in src
+   * @param dst[OUT] the decompressed bytes
+   * @param dstLen[IN] the size of the original data
+   * @return error code. RC_INVALID_FILE_FORMAT if src is corrupt
+   */
+  static RC decompress(const char* src, int srcLen, char* dst, int dstLen);
+};
+
+#endif // PAGECODEC_H
@@ -2,10 +2,12 @@
 #define NOCACHE
 #include "BPBase.h"
 #include "PageFile.h"
+#include "PageCodec.h"
 #include <io.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <algorithm>
 //#include <fcntl.h>
 //#include <sys/stat.h>
 //#include <stdio.h>
@@ -15,21 +17,34 @@
 
 using std::string;
 
-int PageFile::readCount = 0;
-int PageFile::writeCount = 0;
+std::atomic<int> PageFile::readCount(0);
+std::atomic<int> PageFile::writeCount(0);
+std::atomic<long long> PageFile::byteReadCount(0);
+std::atomic<long long> PageFile::byteWriteCount(0);
 int PageFile::cacheClock = 1;
 struct PageFile::cacheStruct PageFile::readCache[PageFile::CACHE_COUNT];
 
+// the header block of a compressed file: magic, version, # map blocks
+// and the first sector of every map block
+static const int COMPRESSED_MAGIC = 0x5a504231;
+static const int COMPRESSED_VERSION = 1;
+static const int HEADER_INTS = 3;
+static const int MAX_MAP_BLOCKS = PageFile::PAGE_SIZE / sizeof(int) - HEADER_INTS;
+
 PageFile::PageFile() 
 { 
   fd = -1; 
   epid = 0; 
+  compressed = false;
+  sectorEnd = 0;
 }
 
 PageFile::PageFile(const string& filename, char mode)
 {
   fd = -1;
   epid = 0;
+  compressed = false;
+  sectorEnd = 0;
   open(filename.c_str(), mode);
 }
 
@@ -64,6 +79,22 @@ RC PageFile::open(const string& filename, char mode)
   if (rc < 0) { _close(fd); fd = -1; return RC_FILE_OPEN_FAILED; }
   epid = statbuf.st_size / PAGE_SIZE;
 
+  // a compressed file is recognized by the magic of its header block
+  compressed = false;
+  if (epid > 0) {
+    int magic = 0;
+    if (_lseek(fd, 0, SEEK_SET) < 0 || _read(fd, &magic, sizeof(magic)) < 0) {
+      _close(fd); fd = -1; return RC_FILE_READ_FAILED;
+    }
+    if (magic == COMPRESSED_MAGIC) {
+      compressed = true;
+      sectorEnd = (int)((statbuf.st_size + SECTOR_SIZE - 1) / SECTOR_SIZE);
+      if ((rc = loadMap()) < 0) {
+        _close(fd); fd = -1; compressed = false; return rc;
+      }
+    }
+  }
+
   return 0;
 }
 
@@ -88,6 +119,12 @@ RC PageFile::close()
   // set the fd and epid to the initial state
   fd = -1; 
   epid = 0;
+  compressed = false;
+  sectorEnd = 0;
+  extents.clear();
+  mapBlocks.clear();
+  freeRuns.clear();
+  freeSizes.clear();
   return 0;
 }
 
@@ -106,11 +143,16 @@ RC PageFile::write(PageId pid, const void* buffer)
   RC rc;
   if (pid < 0) return RC_INVALID_PID; 
 
-  // seek to the location of the page
-  if ((rc = seek(pid) < 0)) return rc;
+  if (compressed) {
+    if ((rc = writeCompressed(pid, (const char*)buffer)) < 0) return rc;
+  } else {
+    // seek to the location of the page
+    if ((rc = seek(pid) < 0)) return rc;
 
-  // write the buffer to the disk page
-  if (_write(fd, buffer, PAGE_SIZE) < 0) return RC_FILE_WRITE_FAILED;
+    // write the buffer to the disk page
+    if (_write(fd, buffer, PAGE_SIZE) < 0) return RC_FILE_WRITE_FAILED;
+    byteWriteCount += PAGE_SIZE;
+  }
 
 #ifndef NOCACHE
   // if the page is in read cache, invalidate it
@@ -140,10 +182,19 @@ RC PageFile::read(PageId pid, void* buffer) const
 	RC rc;
 	DEBUG('p',"Read file fd:%d pid:%d without cache\n",fd ,pid);
 	if (pid < 0 || pid >= epid) return RC_INVALID_PID; 
+	if (compressed) {
+		if ((rc = readCompressed(pid, (char*)buffer)) < 0) return rc;
+		readCount++;
+		return 0;
+	}
 	// seek to the page
 	if ((rc = seek(pid) < 0)) return rc;
 	if(_read(fd, buffer, PAGE_SIZE) < 0)
 		return RC_FILE_READ_FAILED;
+	byteReadCount += PAGE_SIZE;
+
+	// increase the page read count
+	readCount++;
 	return 0;
 #else
 	RC rc;
@@ -164,9 +215,6 @@ RC PageFile::read(PageId pid, void* buffer) const
 	}
 	DEBUG('p',"\n");
 
-	// seek to the page
-	if ((rc = seek(pid) < 0)) return rc;
-  
 	// find the cache slot to evict
 	int toEvict = 0; 
 	for (int i = 0; i < CACHE_COUNT; i++) {
@@ -182,10 +230,20 @@ RC PageFile::read(PageId pid, void* buffer) const
 	readCache[toEvict].pid = pid;
 	readCache[toEvict].lastAccessed = ++cacheClock;
  
-	// read the page to cache first and copy it to the buffer
+	// read (and decompress) the page to cache first and copy it to the buffer
+	if (compressed) {
+	if ((rc = readCompressed(pid, readCache[toEvict].buffer)) < 0) {
+		readCache[toEvict].lastAccessed = 0;
+		return rc;
+	}
+	} else {
+	// seek to the page
+	if ((rc = seek(pid) < 0)) return rc;
 	if (_read(fd, readCache[toEvict].buffer, PAGE_SIZE) < 0) {
 	return RC_FILE_READ_FAILED;
 	}
+	byteReadCount += PAGE_SIZE;
+	}
 	memcpy(buffer, readCache[toEvict].buffer, PAGE_SIZE);
 
 	// increase the page read count
@@ -193,4 +251,258 @@ RC PageFile::read(PageId pid, void* buffer) const
    
 	return 0;
 #endif
-}
\ No newline at end of file
+}
+RC PageFile::read(PageId pid, int count, void* buffer) const
+{
+  RC rc;
+  DEBUG('p',"Read file fd:%d pid:%d count:%d\n",fd ,pid, count);
+  if (count <= 0 || pid < 0 || pid + count > epid) return RC_INVALID_PID;
+  if (compressed) {
+    for (int i = 0; i < count; i++)
+      if ((rc = readCompressed(pid + i, (char*)buffer + i * PAGE_SIZE)) < 0) return rc;
+  } else {
+    if ((rc = seek(pid)) < 0) return rc;
+    if (_read(fd, buffer, count * PAGE_SIZE) != count * PAGE_SIZE)
+      return RC_FILE_READ_FAILED;
+    byteReadCount += (long long)count * PAGE_SIZE;
+  }
+  readCount += count;
+  return 0;
+}
+
+long long PageFile::getStoredBytes() const
+{
+  if (compressed) return (long long)sectorEnd * SECTOR_SIZE;
+  return (long long)epid * PAGE_SIZE;
+}
+
+RC PageFile::enableCompression()
+{
+  RC rc;
+  if (fd < 0) return RC_FILE_OPEN_FAILED;
+  if (compressed) return 0;
+  if (epid != 0) return RC_UNSUPPORTED_MODE;
+
+  compressed = true;
+  sectorEnd = PAGE_SECTORS;   // the header block
+  extents.clear();
+  mapBlocks.clear();
+  freeRuns.clear();
+  freeSizes.clear();
+  if ((rc = writeHeader()) < 0) {
+    compressed = false;
+    return rc;
+  }
+  return 0;
+}
+
+/*
+ * Write len bytes at the given byte offset of a sector.
+ */
+RC PageFile::writeAt(int sector, int offset, const void* data, int len)
+{
+  if (_lseek(fd, (long)sector * SECTOR_SIZE + offset, SEEK_SET) < 0) return RC_FILE_SEEK_FAILED;
+  if (_write(fd, data, len) != len) return RC_FILE_WRITE_FAILED;
+  byteWriteCount += len;
+  return 0;
+}
+
+RC PageFile::writeHeader()
+{
+  char block[PAGE_SIZE];
+  int header[HEADER_INTS] = { COMPRESSED_MAGIC, COMPRESSED_VERSION, (int)mapBlocks.size() };
+
+  memset(block, 0, PAGE_SIZE);
+  memcpy(block, header, sizeof(header));
+  if (!mapBlocks.empty())
+    memcpy(block + sizeof(header), &mapBlocks[0], mapBlocks.size() * sizeof(int));
+  return writeAt(0, 0, block, PAGE_SIZE);
+}
+
+/*
+ * Take count sectors from the smallest free run that is large enough,
+ * or from the end of the file.
+ * @return the first sector
+ */
+int PageFile::allocSectors(int count)
+{
+  std::multimap<int, int>::iterator it = freeSizes.lower_bound(count);
+  int sector, size;
+
+  if (it == freeSizes.end()) {
+    sector = sectorEnd;
+    sectorEnd += count;
+    return sector;
+  }
+  sector = it->second;
+  size = it->first;
+  removeFreeRun(freeRuns.find(sector));
+  if (size > count) freeSectors(sector + count, size - count);
+  return sector;
+}
+
+/*
+ * Give a run of sectors back, merged with the free runs next to it, so
+ * that pages that move around do not leave the file in small pieces.
+ */
+void PageFile::freeSectors(int sector, int count)
+{
+  std::map<int, int>::iterator next = freeRuns.lower_bound(sector);
+  std::map<int, int>::iterator prev;
+
+  if (next != freeRuns.end() && next->first == sector + count) {
+    count += next->second;
+    removeFreeRun(next);
+  }
+  next = freeRuns.lower_bound(sector);
+  if (next != freeRuns.begin()) {
+    prev = next;
+    --prev;
+    if (prev->first + prev->second == sector) {
+      sector = prev->first;
+      count += prev->second;
+      removeFreeRun(prev);
+    }
+  }
+  freeRuns[sector] = count;
+  freeSizes.insert(std::make_pair(count, sector));
+}
+
+void PageFile::removeFreeRun(std::map<int, int>::iterator run)
+{
+  std::pair<std::multimap<int, int>::iterator, std::multimap<int, int>::iterator> sizes =
+    freeSizes.equal_range(run->second);
+  for (std::multimap<int, int>::iterator it = sizes.first; it != sizes.second; ++it) {
+    if (it->second == run->first) {
+      freeSizes.erase(it);
+      break;
+    }
+  }
+  freeRuns.erase(run);
+}
+
+/*
+ * Read the header and the map blocks of a compressed file. The sectors
+ * that neither the header, a map block nor a page extent covers are free.
+ * @return error code. 0 if no error
+ */
+RC PageFile::loadMap()
+{
+  char block[PAGE_SIZE];
+  int header[HEADER_INTS];
+  std::vector< std::pair<int, int> > used;
+  int i, b, next;
+
+  if (_lseek(fd, 0, SEEK_SET) < 0) return RC_FILE_SEEK_FAILED;
+  if (_read(fd, block, PAGE_SIZE) != PAGE_SIZE) return RC_FILE_READ_FAILED;
+  memcpy(header, block, sizeof(header));
+  if (header[1] != COMPRESSED_VERSION || header[2] < 0 || header[2] > MAX_MAP_BLOCKS)
+    return RC_INVALID_FILE_FORMAT;
+  mapBlocks.resize(header[2]);
+  if (header[2] > 0) memcpy(&mapBlocks[0], block + sizeof(header), header[2] * sizeof(int));
+
+  extents.clear();
+  freeRuns.clear();
+  freeSizes.clear();
+  used.push_back(std::make_pair(0, (int)PAGE_SECTORS));
+  epid = 0;
+  for (b = 0; b < (int)mapBlocks.size(); b++) {
+    if (_lseek(fd, (long)mapBlocks[b] * SECTOR_SIZE, SEEK_SET) < 0) return RC_FILE_SEEK_FAILED;
+    if (_read(fd, block, PAGE_SIZE) != PAGE_SIZE) return RC_FILE_READ_FAILED;
+    used.push_back(std::make_pair(mapBlocks[b], (int)PAGE_SECTORS));
+    for (i = 0; i < EXTENTS_PER_BLOCK; i++) {
+      PageExtent e;
+      memcpy(&e, block + i * sizeof(PageExtent), sizeof(PageExtent));
+      if (e.length < 0 || e.length > PAGE_SIZE || e.sectors < 0 || e.sectors > PAGE_SECTORS ||
+          e.length > e.sectors * SECTOR_SIZE)
+        return RC_INVALID_FILE_FORMAT;
+      extents.push_back(e);
+      if (e.sectors == 0) continue;
+      used.push_back(std::make_pair(e.sector, (int)e.sectors));
+      epid = (PageId)extents.size();
+    }
+  }
+
+  std::sort(used.begin(), used.end());
+  for (next = 0, i = 0; i < (int)used.size(); i++) {
+    if (used[i].first > next) freeSectors(next, used[i].first - next);
+    if (used[i].first + used[i].second > next) next = used[i].first + used[i].second;
+  }
+  if (sectorEnd > next) freeSectors(next, sectorEnd - next);
+  if (sectorEnd < next) sectorEnd = next;
+  return 0;
+}
+
+/*
+ * Compress a page and write it to a new extent, then its map entry, and
+ * only then free the old extent. The old bytes are never overwritten, so
+ * a crash, or a handle that still has the old map, sees either the old or
+ * the new page, never the old length with the new bytes.
+ * A page that does not compress is stored as it is.
+ * @return error code. 0 if no error
+ */
+RC PageFile::writeCompressed(PageId pid, const char* buffer)
+{
+  RC rc;
+  char data[PAGE_SIZE];
+  int len, need, block = pid / EXTENTS_PER_BLOCK;
+  PageExtent e, old;
+
+  if (block >= MAX_MAP_BLOCKS) return RC_INVALID_PID;
+  len = PageCodec::compress(buffer, PAGE_SIZE, data, PAGE_SIZE - SECTOR_SIZE);
+  if (len == 0) {
+    memcpy(data, buffer, PAGE_SIZE);
+    len = PAGE_SIZE;
+  }
+
+  while ((int)mapBlocks.size() <= block) {
+    char zero[PAGE_SIZE];
+    int sector = allocSectors(PAGE_SECTORS);
+    memset(zero, 0, PAGE_SIZE);
+    if ((rc = writeAt(sector, 0, zero, PAGE_SIZE)) < 0) return rc;
+    mapBlocks.push_back(sector);
+    extents.resize(mapBlocks.size() * EXTENTS_PER_BLOCK);
+    if ((rc = writeHeader()) < 0) return rc;
+  }
+
+  old = extents[pid];
+  need = (len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  e.sectors = (short)need;
+  e.sector = allocSectors(need);
+  e.length = (short)len;
+
+  // the old extent is not free yet, so the new one never overlaps it
+  if ((rc = writeAt(e.sector, 0, data, len)) < 0 ||
+      (rc = writeAt(mapBlocks[block], (pid % EXTENTS_PER_BLOCK) * sizeof(PageExtent), &e, sizeof(e))) < 0) {
+    freeSectors(e.sector, e.sectors);
+    return rc;
+  }
+  extents[pid] = e;
+  if (old.sectors > 0) freeSectors(old.sector, old.sectors);
+  return 0;
+}
+
+/*
+ * Read the extent of a page and decompress it. A page of the file that
+ * was never written reads as zeros, like a hole in an uncompressed file.
+ * @return error code. 0 if no error
+ */
+RC PageFile::readCompressed(PageId pid, char* buffer) const
+{
+  char data[PAGE_SIZE];
+  const PageExtent& e = extents[pid];
+
+  if (e.length == 0) {
+    memset(buffer, 0, PAGE_SIZE);
+    return 0;
+  }
+  if (_lseek(fd, (long)e.sector * SECTOR_SIZE, SEEK_SET) < 0) return RC_FILE_SEEK_FAILED;
+  if (e.length == PAGE_SIZE) {
+    if (_read(fd, buffer, PAGE_SIZE) != PAGE_SIZE) return RC_FILE_READ_FAILED;
+    byteReadCount += PAGE_SIZE;
+    return 0;
+  }
+  if (_read(fd, data, e.length) != e.length) return RC_FILE_READ_FAILED;
+  byteReadCount += e.length;
+  return PageCodec::decompress(data, e.length, buffer, PAGE_SIZE);
+}
@@ -3,12 +3,23 @@
 #define PAGEFILE_H
 
 #include <string>
+#include <vector>
+#include <map>
+#include <atomic>
 #include "BPBase.h"
 
 typedef int PageId;
 
 /**
  * read/write a file in the unit of a page
+ *
+ * A file may also keep its pages compressed (see enableCompression()).
+ * Such a file starts with a header block, and every page is stored as an
+ * extent of SECTOR_SIZE byte sectors anywhere in the file. Map blocks of
+ * {sector, length, # sectors} entries, one per page, map the logical
+ * page ids to their extents; the header block lists the map blocks.
+ * read() and write() work on whole uncompressed pages either way, so the
+ * users of PageFile do not see the difference.
  */
 class PageFile {
  public:
@@ -41,6 +52,17 @@ class PageFile {
    * @return error code. 0 if no error
    */
   RC read(PageId pid, void *buffer) const;
+
+  /**
+   * read count consecutive disk pages into memory with one read, for
+   * runs of pages that are read together anyway. The pages do not go
+   * through the page cache. Compressed pages are read one by one.
+   * @param pid[IN] the first page to read
+   * @param count[IN] # pages to read
+   * @param buffer[OUT] pointer to memory buffer of count pages
+   * @return error code. 0 if no error
+   */
+  RC read(PageId pid, int count, void *buffer) const;
   /**
    * write the memory buffer to the disk page.
    * if (pid >= endPid()), the file is expanded such that
@@ -58,6 +80,24 @@ class PageFile {
    */
   PageId endPid() const;
 
+  /**
+   * Store the pages of this file compressed from now on. Only an empty
+   * file opened in 'w' mode can be switched; a compressed file is
+   * recognized by its header when it is opened again.
+   * @return error code. 0 if no error
+   */
+  RC enableCompression();
+
+  /**
+   * @return true if the pages of the file are stored compressed
+   */
+  bool isCompressed() const { return compressed; }
+
+  /**
+   * @return # bytes the file takes on disk
+   */
+  long long getStoredBytes() const;
+
   /**
    * @return the total # of disk reads
    */
@@ -68,6 +108,13 @@ class PageFile {
    */
   static int getPageWriteCount() { return writeCount; }
 
+  /**
+   * @return the total # of bytes read from and written to the disk,
+   * less than the # pages * PAGE_SIZE for compressed files
+   */
+  static long long getByteReadCount()  { return byteReadCount; }
+  static long long getByteWriteCount() { return byteWriteCount; }
+
  protected:
   /**
    * move the file cursor to the beginning of a page.
@@ -81,6 +128,37 @@ class PageFile {
   int     fd;     // file descriptor of the associated unix file
   PageId  epid;   // (last page id + 1) of the file
 
+  //
+  // the following members implement compressed files
+  //
+  static const int SECTOR_SIZE = 256;
+  static const int PAGE_SECTORS = PAGE_SIZE / SECTOR_SIZE;
+
+  // the extent of a page, length 0 if the page was never written
+  typedef struct {
+    int   sector;   // the first sector of the extent
+    short length;   // # bytes stored, PAGE_SIZE if not compressed
+    short sectors;  // # sectors allocated, >= the sectors of length
+  } PageExtent;
+
+  static const int EXTENTS_PER_BLOCK = PAGE_SIZE / sizeof(PageExtent);
+
+  bool    compressed;
+  int     sectorEnd;                  // # sectors in the file
+  std::vector<PageExtent> extents;    // the extent of every page
+  std::vector<int> mapBlocks;         // the first sector of every map block
+  std::map<int, int> freeRuns;        // first sector -> # sectors of free runs
+  std::multimap<int, int> freeSizes;  // the same runs by # sectors
+
+  RC readCompressed(PageId pid, char* buffer) const;
+  RC writeCompressed(PageId pid, const char* buffer);
+  RC loadMap();
+  RC writeHeader();
+  RC writeAt(int sector, int offset, const void* data, int len);
+  int allocSectors(int count);
+  void freeSectors(int sector, int count);
+  void removeFreeRun(std::map<int, int>::iterator run);
+
   //
   // the following set of members implement LRU caching 
   //
@@ -97,8 +175,11 @@ class PageFile {
     char buffer[PAGE_SIZE]; // the buffer used for caching
   } readCache[CACHE_COUNT];
 
-  static int readCount;  // total # of page reads 
-  static int writeCount; // total # of page writes 
+  // atomic, as indexes on separate threads read and write at once
+  static std::atomic<int> readCount;  // total # of page reads 
+  static std::atomic<int> writeCount; // total # of page writes 
+  static std::atomic<long long> byteReadCount;
+  static std::atomic<long long> byteWriteCount;
 };
   
 #endif // PAGEFILE_H
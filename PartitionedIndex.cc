@@ -0,0 +1,472 @@
+#include "PartitionedIndex.h"
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <utility>
+using namespace std;
+
+static const int PART_MAGIC = 0x50525431;
+static const char* BLOOM_SUFFIX = ".blm";
+
+typedef pair<KeyType, RecordId> Entry;
+
+static bool entryLess(const Entry& a, const Entry& b)
+{
+  return a.first < b.first;
+}
+
+static string partitionFile(const string& dirname, int part, int gen)
+{
+  return dirname + "." + to_string(part) + "." + to_string(gen);
+}
+
+static void removeIndexFile(const string& name)
+{
+  remove(name.c_str());
+  remove((name + BLOOM_SUFFIX).c_str());
+}
+
+/*
+ * Read the directory page: the header {magic, # partitions, options}
+ * and then {first key, generation} of every partition.
+ */
+static RC loadDirectory(const string& dirname, int& options, vector<KeyType>& lows, vector<int>& gens)
+{
+  RC rc;
+  PageFile pf;
+  char page[PageFile::PAGE_SIZE];
+  int header[3];
+
+  if ((rc = pf.open(dirname, 'r')) < 0) return rc;
+  if (pf.endPid() == 0) {
+    rc = RC_INVALID_FILE_FORMAT;
+    goto DONE;
+  }
+  if ((rc = pf.read(0, page)) < 0) goto DONE;
+  memcpy(header, page, sizeof(header));
+  if (header[0] != PART_MAGIC || header[1] <= 0 || header[1] > PartitionedIndex::MAX_PARTITIONS) {
+    rc = RC_INVALID_FILE_FORMAT;
+    goto DONE;
+  }
+  options = header[2];
+  lows.resize(header[1]);
+  gens.resize(header[1]);
+  for (int i = 0; i < header[1]; i++) {
+    char* entry = page + sizeof(header) + i * (sizeof(KeyType) + sizeof(int));
+    memcpy(&lows[i], entry, sizeof(KeyType));
+    memcpy(&gens[i], entry + sizeof(KeyType), sizeof(int));
+  }
+
+DONE:
+  pf.close();
+  return rc;
+}
+
+static RC saveDirectory(const string& dirname, int options, const vector<KeyType>& lows, const vector<int>& gens)
+{
+  RC rc;
+  PageFile pf;
+  char page[PageFile::PAGE_SIZE];
+  int header[3] = { PART_MAGIC, (int)lows.size(), options };
+
+  if ((rc = pf.open(dirname, 'w')) < 0) return rc;
+  memset(page, 0, PageFile::PAGE_SIZE);
+  memcpy(page, header, sizeof(header));
+  for (size_t i = 0; i < lows.size(); i++) {
+    char* entry = page + sizeof(header) + i * (sizeof(KeyType) + sizeof(int));
+    memcpy(entry, &lows[i], sizeof(KeyType));
+    memcpy(entry + sizeof(KeyType), &gens[i], sizeof(int));
+  }
+  rc = pf.write(0, page);
+  pf.close();
+  return rc;
+}
+
+PartitionedIndex::PartitionedIndex()
+{
+  readOnlyMode = true;
+  options = 0;
+}
+
+PartitionedIndex::~PartitionedIndex()
+{
+  if (!parts.empty()) close();
+}
+
+/*
+ * Write a new directory and remove the partition files of an earlier
+ * index of the same name.
+ * @param dirname[IN] the name of the directory file
+ * @param splitKeys[IN] the first keys of partitions 1, 2, ... in ascending order
+ * @param options[IN] the BTNode::NODE_* format options of the partitions
+ * @return error code. 0 if no error
+ */
+RC PartitionedIndex::create(const string& dirname, const vector<KeyType>& splitKeys, int options)
+{
+  int oldOptions;
+  vector<KeyType> lows;
+  vector<int> gens;
+
+  if ((int)splitKeys.size() + 1 > MAX_PARTITIONS) return RC_INVALID_ATTRIBUTE;
+  for (size_t i = 1; i < splitKeys.size(); i++)
+    if (splitKeys[i] <= splitKeys[i-1]) return RC_INVALID_ATTRIBUTE;
+
+  if (loadDirectory(dirname, oldOptions, lows, gens) == 0)
+    for (size_t i = 0; i < lows.size(); i++) removeIndexFile(partitionFile(dirname, i, gens[i]));
+
+  lows.assign(1, INT_MIN);
+  lows.insert(lows.end(), splitKeys.begin(), splitKeys.end());
+  gens.assign(lows.size(), 0);
+  for (size_t i = 0; i < lows.size(); i++) removeIndexFile(partitionFile(dirname, i, 0));
+  return saveDirectory(dirname, options, lows, gens);
+}
+
+/*
+ * Pick parts-1 split keys at the quantiles of the sample.
+ * @param sample[IN] some or all of the keys to be indexed
+ * @param parts[IN] the # partitions wanted
+ * @param splitKeys[OUT] ascending split keys, at most parts-1
+ */
+void PartitionedIndex::chooseSplitKeys(const vector<KeyType>& sample, int parts, vector<KeyType>& splitKeys)
+{
+  vector<KeyType> sorted(sample);
+  splitKeys.clear();
+  if (sorted.empty() || parts <= 1) return;
+  if (parts > MAX_PARTITIONS) parts = MAX_PARTITIONS;
+
+  sort(sorted.begin(), sorted.end());
+  for (int i = 1; i < parts; i++) {
+    KeyType k = sorted[(size_t)((double)sorted.size() * i / parts)];
+    // a split key must start a partition of its own, so a key that
+    // fills more than one range only splits once
+    if (k > sorted[0] && (splitKeys.empty() || k > splitKeys.back())) splitKeys.push_back(k);
+  }
+}
+
+/*
+ * Read the directory and open every partition.
+ * @param dirname[IN] the name of the directory file
+ * @param mode[IN] 'r' for read, 'w' for write
+ * @return error code. 0 if no error
+ */
+RC PartitionedIndex::open(const string& dirname, char mode)
+{
+  RC rc;
+  if (!parts.empty()) return RC_INVALID_FILE_FORMAT;
+  if ((rc = loadDirectory(dirname, options, lows, gens)) < 0) return rc;
+
+  dirName = dirname;
+  readOnlyMode = (mode != 'w' && mode != 'W');
+  for (size_t i = 0; i < lows.size(); i++) {
+    BTreeIndex* index = new BTreeIndex();
+    if ((rc = index->open(partitionFile(dirName, i, gens[i]), mode)) < 0) {
+      delete index;
+      goto ERROR;
+    }
+    parts.push_back(index);
+    if (!readOnlyMode && index->getRoot() == -1 && (rc = index->setOptions(options)) < 0) goto ERROR;
+  }
+  return 0;
+
+ERROR:
+  printf("PartitionedIndex::open %s error %d\n", dirname.c_str(), rc);
+  readOnlyMode = true;
+  close();
+  return rc;
+}
+
+/*
+ * Close every partition; under 'w' mode the directory is written again.
+ * @return error code. 0 if no error
+ */
+RC PartitionedIndex::close()
+{
+  RC rc = 0, rc2;
+  for (size_t i = 0; i < parts.size(); i++) {
+    if ((rc2 = parts[i]->close()) < 0 && rc == 0) rc = rc2;
+    delete parts[i];
+  }
+  if (!parts.empty() && !readOnlyMode && (rc2 = writeDirectory()) < 0 && rc == 0) rc = rc2;
+  parts.clear();
+  readOnlyMode = true;
+  return rc;
+}
+
+RC PartitionedIndex::writeDirectory() const
+{
+  return saveDirectory(dirName, options, lows, gens);
+}
+
+string PartitionedIndex::getPartitionName(int part) const
+{
+  return partitionFile(dirName, part, gens[part]);
+}
+
+/*
+ * @return the last partition whose first key is <= key
+ */
+int PartitionedIndex::partitionOf(KeyType key) const
+{
+  return (int)(upper_bound(lows.begin(), lows.end(), key) - lows.begin()) - 1;
+}
+
+/*
+ * Shared state of the workers of one build().
+ */
+typedef struct {
+  vector<BTreeIndex*>*    parts;
+  vector< vector<Entry> >* entries;  // the entries of every partition
+  atomic<int>             nextPart;  // the next partition to hand out
+  atomic<bool>            stop;      // set when a worker fails
+  atomic<int>             rc;        // the first error code
+} BuildJob;
+
+/*
+ * Worker thread body: sort and insert the entries of one partition at a
+ * time. Every partition has its own BTreeIndex and file handle, so the
+ * workers share nothing but the job.
+ */
+static void buildWorker(BuildJob* job)
+{
+  RC rc;
+  int part;
+  while (!job->stop && (part = job->nextPart++) < (int)job->parts->size()) {
+    vector<Entry>& entries = (*job->entries)[part];
+    BTreeIndex* index = (*job->parts)[part];
+    stable_sort(entries.begin(), entries.end(), entryLess);
+    for (size_t i = 0; i < entries.size() && !job->stop; i++) {
+      if ((rc = index->insert(entries[i].first, entries[i].second)) < 0) {
+        job->rc = rc;
+        job->stop = true;
+      }
+    }
+    vector<Entry>().swap(entries);
+  }
+}
+
+/*
+ * Insert many entries, one partition per worker at a time.
+ * @param keys[IN] the keys to insert
+ * @param rids[IN] the RecordIds, rids[i] belongs to keys[i]
+ * @param workers[IN] the number of worker threads (<= 0: one per core)
+ * @return error code. 0 if no error
+ */
+RC PartitionedIndex::build(const vector<KeyType>& keys, const vector<RecordId>& rids, int workers)
+{
+  vector< vector<Entry> > entries(parts.size());
+  vector<thread> pool;
+  BuildJob job;
+
+  if (readOnlyMode) return RC_FILE_READ_ONLY;
+  if (keys.size() != rids.size()) return RC_INVALID_ATTRIBUTE;
+  for (size_t i = 0; i < keys.size(); i++)
+    entries[partitionOf(keys[i])].push_back(make_pair(keys[i], rids[i]));
+
+  if (workers <= 0) workers = max(1, (int)thread::hardware_concurrency());
+  workers = min(workers, (int)parts.size());
+
+  job.parts = &parts;
+  job.entries = &entries;
+  job.nextPart = 0;
+  job.stop = false;
+  job.rc = 0;
+  for (int i = 0; i < workers; i++)
+    pool.push_back(thread(buildWorker, &job));
+  for (int i = 0; i < workers; i++)
+    pool[i].join();
+  return job.rc;
+}
+
+/*
+ * Insert (key, RecordId) pair into its partition.
+ * @param key[IN] the key for the value inserted into the index
+ * @param rid[IN] the RecordId for the record being inserted into the index
+ * @return error code. 0 if no error
+ */
+RC PartitionedIndex::insert(KeyType key, const RecordId& rid)
+{
+  if (readOnlyMode) return RC_FILE_READ_ONLY;
+  return parts[partitionOf(key)]->insert(key, rid);
+}
+
+/*
+ * Point lookup in the partition of searchKey.
+ * @param searchKey[IN] the key to find
+ * @param rid[OUT] the RecordId of an entry with the key
+ * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+ */
+RC PartitionedIndex::find(KeyType searchKey, RecordId& rid) const
+{
+  IndexCursor cursor;
+  if (parts.empty()) return RC_NO_SUCH_RECORD;
+  const BTreeIndex* index = parts[partitionOf(searchKey)];
+  if (index->getStats().entryCount == 0) return RC_NO_SUCH_RECORD;
+  return index->find(searchKey, cursor, rid);
+}
+
+RC PartitionedIndex::findAll(KeyType searchKey, vector<RecordId>& rids) const
+{
+  rids.clear();
+  if (parts.empty()) return RC_NO_SUCH_RECORD;
+  const BTreeIndex* index = parts[partitionOf(searchKey)];
+  if (index->getStats().entryCount == 0) return RC_NO_SUCH_RECORD;
+  return index->findAll(searchKey, rids);
+}
+
+/*
+ * Read the entries of one partition with lo <= key <= hi.
+ */
+static RC scanPartition(const BTreeIndex* index, KeyType lo, KeyType hi, ScanBatch& batch)
+{
+  RC rc;
+  IndexCursor cursor;
+  KeyType key;
+  RecordId rid;
+
+  if (index->getStats().entryCount == 0) return 0;
+  if ((rc = index->locate(lo, cursor)) < 0) return rc;
+  while (cursor.pid != -1) {
+    if ((rc = index->readForward(cursor, key, rid)) < 0) return rc;
+    if (key > hi) break;
+    batch.keys.push_back(key);
+    batch.rids.push_back(rid);
+  }
+  return 0;
+}
+
+/*
+ * Shared state of the workers of one scan().
+ */
+typedef struct {
+  const vector<BTreeIndex*>* parts;
+  int                     first;     // the first partition of the range
+  KeyType                 lo, hi;
+  vector<ScanBatch>*      batches;   // one batch per partition of the range
+  atomic<int>             nextPart;
+  atomic<bool>            stop;
+  atomic<int>             rc;
+} PartScanJob;
+
+static void partScanWorker(PartScanJob* job)
+{
+  RC rc;
+  int i;
+  while (!job->stop && (i = job->nextPart++) < (int)job->batches->size()) {
+    if ((rc = scanPartition((*job->parts)[job->first + i], job->lo, job->hi, (*job->batches)[i])) < 0) {
+      job->rc = rc;
+      job->stop = true;
+    }
+  }
+}
+
+/*
+ * Read all entries with lo <= key <= hi in key order, one partition per
+ * worker at a time; the partitions hold disjoint key ranges, so their
+ * results are simply concatenated.
+ * @param lo[IN] the smallest key to read
+ * @param hi[IN] the largest key to read
+ * @param workers[IN] the number of worker threads (<= 0: one per core)
+ * @param keys[OUT] the keys in range
+ * @param rids[OUT] the RecordIds, rids[i] belongs to keys[i]
+ * @return error code. 0 if no error
+ */
+RC PartitionedIndex::scan(KeyType lo, KeyType hi, int workers, vector<KeyType>& keys, vector<RecordId>& rids) const
+{
+  vector<ScanBatch> batches;
+  vector<thread> pool;
+  PartScanJob job;
+
+  keys.clear();
+  rids.clear();
+  if (parts.empty() || lo > hi) return 0;
+
+  job.parts = &parts;
+  job.first = partitionOf(lo);
+  job.lo = lo;
+  job.hi = hi;
+  job.batches = &batches;
+  job.nextPart = 0;
+  job.stop = false;
+  job.rc = 0;
+  batches.resize(partitionOf(hi) - job.first + 1);
+
+  if (workers <= 0) workers = max(1, (int)thread::hardware_concurrency());
+  workers = min(workers, (int)batches.size());
+  if (workers == 1) {
+    partScanWorker(&job);
+  } else {
+    for (int i = 0; i < workers; i++)
+      pool.push_back(thread(partScanWorker, &job));
+    for (int i = 0; i < workers; i++)
+      pool[i].join();
+  }
+  if (job.rc < 0) return job.rc;
+
+  for (size_t i = 0; i < batches.size(); i++) {
+    keys.insert(keys.end(), batches[i].keys.begin(), batches[i].keys.end());
+    rids.insert(rids.end(), batches[i].rids.begin(), batches[i].rids.end());
+  }
+  return 0;
+}
+
+/*
+ * Copy one partition into a file of the next generation. The directory
+ * is written before the old file is removed, so a crash in between
+ * leaves a stray file behind but never a directory without its files.
+ * @param part[IN] the partition to rebuild
+ * @return error code. 0 if no error
+ */
+RC PartitionedIndex::rebuildPartition(int part)
+{
+  RC rc;
+  BTreeIndex* fresh;
+  BTreeIndex* old;
+  ScanBatch batch;
+  string oldName, newName;
+
+  if (readOnlyMode) return RC_FILE_READ_ONLY;
+  if (part < 0 || part >= (int)parts.size()) return RC_INVALID_ATTRIBUTE;
+  old = parts[part];
+  oldName = getPartitionName(part);
+  newName = partitionFile(dirName, part, gens[part] + 1);
+
+  if ((rc = old->flushBuffers()) < 0) return rc;
+  if ((rc = scanPartition(old, INT_MIN, INT_MAX, batch)) < 0) return rc;
+
+  removeIndexFile(newName);
+  fresh = new BTreeIndex();
+  if ((rc = fresh->open(newName, 'w')) < 0) {
+    delete fresh;
+    return rc;
+  }
+  if ((rc = fresh->setOptions(old->getOptions())) < 0) goto ERROR;
+  for (size_t i = 0; i < batch.keys.size(); i++)
+    if ((rc = fresh->insert(batch.keys[i], batch.rids[i])) < 0) goto ERROR;
+  // the filter is sized for the copied keys when it is built afterwards
+  if (old->getBloomFilter().isEnabled() &&
+      (rc = fresh->enableBloomFilter(old->getBloomFilter().getBitsPerKey())) < 0) goto ERROR;
+  // close and open again, so that the new file is complete on disk
+  // before the directory points to it
+  if ((rc = fresh->close()) < 0 || (rc = fresh->open(newName, 'w')) < 0) goto ERROR;
+
+  gens[part]++;
+  if ((rc = writeDirectory()) < 0) {
+    gens[part]--;
+    goto ERROR;
+  }
+  parts[part] = fresh;
+  old->close();
+  delete old;
+  removeIndexFile(oldName);
+  return 0;
+
+ERROR:
+  printf("PartitionedIndex::rebuildPartition %d error %d\n", part, rc);
+  fresh->close();
+  delete fresh;
+  removeIndexFile(newName);
+  return rc;
+}
@@ -0,0 +1,160 @@
+#ifndef PARTITIONEDINDEX_H
+#define PARTITIONEDINDEX_H
+
+#include "BPBase.h"
+#include "BTreeIndex.h"
+#include <string>
+#include <vector>
+
+/**
+ * An index split by key range over several BTreeIndex files.
+ * A small directory file (dirname) holds the first key of every
+ * partition; partition i holds the keys lo[i] <= key < lo[i+1] in its
+ * own index file, dirname + "." + i + "." + generation.
+ *
+ * Every partition has its own file and file handle, so the partitions
+ * can be built and scanned on separate threads, and one partition can
+ * be rebuilt into a new file while the others are left alone. The
+ * generation in the file name is bumped by every rebuild, so the old
+ * file is only removed after the directory points to the new one.
+ *
+ * A PartitionedIndex is used by one thread at a time; build() and
+ * scan() start their own worker threads.
+ */
+class PartitionedIndex {
+ public:
+  // the directory is one page: a header and one entry per partition
+  static const int MAX_PARTITIONS = (PageFile::PAGE_SIZE - 3 * sizeof(int)) / (sizeof(KeyType) + sizeof(int));
+
+  PartitionedIndex();
+  ~PartitionedIndex();
+
+  /**
+   * Write a new directory and remove the partition files left by an
+   * earlier index of the same name. The index is not opened.
+   * @param dirname[IN] the name of the directory file
+   * @param splitKeys[IN] the first keys of partitions 1, 2, ..., in
+   *                      ascending order; n split keys give n+1 partitions
+   * @param options[IN] the BTNode::NODE_* format options of the partitions
+   * @return error code. 0 if no error
+   */
+  static RC create(const std::string& dirname, const std::vector<KeyType>& splitKeys, int options);
+
+  /**
+   * Pick split keys that cut a sample of the keys into parts ranges of
+   * about the same size. Keys with many duplicates may give fewer parts.
+   * @param sample[IN] some or all of the keys to be indexed, in any order
+   * @param parts[IN] the # partitions wanted
+   * @param splitKeys[OUT] the split keys to pass to create()
+   */
+  static void chooseSplitKeys(const std::vector<KeyType>& sample, int parts, std::vector<KeyType>& splitKeys);
+
+  /**
+   * Read the directory and open all partitions.
+   * @param dirname[IN] the name of the directory file
+   * @param mode[IN] 'r' for read, 'w' for write
+   * @return error code. 0 if no error
+   */
+  RC open(const std::string& dirname, char mode);
+
+  /**
+   * Close all partitions and, under 'w' mode, write the directory.
+   * @return error code. 0 if no error
+   */
+  RC close();
+
+  /**
+   * Insert many entries, each partition on a worker thread. The entries
+   * of a partition are inserted in key order (equal keys in input order),
+   * which keeps the new leaves in key order on disk.
+   * @param keys[IN] the keys to insert
+   * @param rids[IN] the RecordIds, rids[i] belongs to keys[i]
+   * @param workers[IN] the number of worker threads (<= 0: one per core)
+   * @return error code. 0 if no error
+   */
+  RC build(const std::vector<KeyType>& keys, const std::vector<RecordId>& rids, int workers);
+
+  /**
+   * Insert (key, RecordId) pair into its partition.
+   * @param key[IN] the key for the value inserted into the index
+   * @param rid[IN] the RecordId for the record being inserted into the index
+   * @return error code. 0 if no error
+   */
+  RC insert(KeyType key, const RecordId& rid);
+
+  /**
+   * Point lookup in the partition of searchKey.
+   * @param searchKey[IN] the key to find
+   * @param rid[OUT] the RecordId of an entry with the key
+   * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+   */
+  RC find(KeyType searchKey, RecordId& rid) const;
+
+  /**
+   * Find all entries with searchKey, see BTreeIndex::findAll().
+   * @param searchKey[IN] the key to find
+   * @param rids[OUT] the RecordIds of all entries with the key
+   * @return error code. RC_NO_SUCH_RECORD if the key is not in the index
+   */
+  RC findAll(KeyType searchKey, std::vector<RecordId>& rids) const;
+
+  /**
+   * Read all entries with lo <= key <= hi in key order. The partitions
+   * that overlap the range are read on worker threads.
+   * Like BTreeIndex::readForward(), this does not see the entries that
+   * BTNode::NODE_BUFFERED partitions still keep in message buffers.
+   * @param lo[IN] the smallest key to read
+   * @param hi[IN] the largest key to read
+   * @param workers[IN] the number of worker threads (<= 0: one per core)
+   * @param keys[OUT] the keys in range
+   * @param rids[OUT] the RecordIds, rids[i] belongs to keys[i]
+   * @return error code. 0 if no error
+   */
+  RC scan(KeyType lo, KeyType hi, int workers, std::vector<KeyType>& keys, std::vector<RecordId>& rids) const;
+
+  /**
+   * Copy the entries of one partition in key order into a new index
+   * file, which leaves its leaves full and in order on disk, and switch
+   * the directory over to it. The other partitions are not touched.
+   * @param part[IN] the partition to rebuild
+   * @return error code. 0 if no error
+   */
+  RC rebuildPartition(int part);
+
+  /**
+   * @return the partition that holds key
+   */
+  int partitionOf(KeyType key) const;
+
+  /**
+   * @return the # partitions
+   */
+  int getPartitionCount() const { return (int)parts.size(); }
+
+  /**
+   * @return the first key of partition part (INT_MIN for partition 0)
+   */
+  KeyType getPartitionLow(int part) const { return lows[part]; }
+
+  /**
+   * @return the index of partition part, e.g. for its statistics
+   */
+  const BTreeIndex& getPartition(int part) const { return *parts[part]; }
+
+  /**
+   * @return the name of the index file of partition part
+   */
+  std::string getPartitionName(int part) const;
+
+ private:
+  std::string dirName;
+  bool readOnlyMode;
+  int  options;                  /// BTNode::NODE_* format options of the partitions
+  std::vector<KeyType> lows;     /// the first key of every partition
+  std::vector<int>     gens;     /// the file generation of every partition
+  std::vector<BTreeIndex*> parts;
+
+  RC writeDirectory() const;
+};
+
+#endif /* PARTITIONEDINDEX_H */
@@ -1,7 +1,48 @@
 #include "BPBase.h"
 #include "RecordFile.h"
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <limits.h>
 
 using std::string;
+using std::vector;
+
+//
+// page formats
+//
+
+// the first four bytes of a page hold # records in the page, and the
+// format of the page in the high bits. The fixed slot pages of old files
+// have no format bits.
+static const int PAGE_SLOTTED  = 0x10000000;
+static const int PAGE_OVERFLOW = 0x20000000;
+static const int PAGE_COLUMNAR = 0x40000000;
+static const int COUNT_MASK    = 0x00ffffff;
+
+// a slotted page: the header (# records, start of the record data), the
+// slot directory growing up from the header, and the records packed down
+// from the end of the page. A slot is the offset and length of its value.
+static const int SLOTTED_HEADER = 2 * sizeof(int);
+static const int SLOT_SIZE = 2 * sizeof(unsigned short);
+
+// the slot length of a value stored in overflow pages. Its record is the
+// key, the value length and the first overflow page; shorter records are
+// padded to that size, so any record can be turned into a long one in place.
+static const int LONG_VALUE = 0xffff;
+static const int MIN_RECORD = 3 * sizeof(int);
+
+// a columnar (PAX) page: the header, the keys of all records, the slot
+// directory right after the keys, and the values packed down from the
+// end of the page. A record in the data area is its value only, or the
+// value length and first overflow page of a long value.
+static const int MIN_VALUE_RECORD = 2 * sizeof(int);
+
+// an overflow page: the header, the next page of the chain (-1 at the
+// end), the page appends went to when it was written (-1 for a new page),
+// and # value bytes in the page (0 if the page is no longer used)
+static const int OVERFLOW_HEADER = 4 * sizeof(int);
+static const int OVERFLOW_DATA = PageFile::PAGE_SIZE - OVERFLOW_HEADER;
 
 //
 // helper functions for page manipultation
@@ -10,9 +51,6 @@ using std::string;
 // compute the pointer to the n'th slot in a page
 static char* slotPtr(char* page, int n);
 
-// read the record in the n'th slot in the page
-static void readSlot(const char* page, int n, int& key, std::string& value);
-
 // write the record to the n'th slot in the page
 static void writeSlot(char* page, int n, int key, const std::string& value);
 
@@ -22,6 +60,65 @@ static int getRecordCount(const char* page);
 // update # records stored in the page
 static void setRecordCount(char* page, int count);
 
+// get the format bits of the page
+static int getPageFormat(const char* page);
+
+// initialize an empty slotted or columnar page
+static void initSlottedPage(char* page, int format);
+
+// whether the page has a slot directory (slotted or columnar)
+static bool isSlottedPage(const char* page);
+
+// the offset of the slot directory and of the byte right after it
+static int getSlotBase(const char* page);
+static int getSlotEnd(const char* page);
+
+// # bytes the key and slot of a record take outside the data area
+static int slotSize(const char* page);
+
+// read and write the n'th entry of the slot directory
+static void getSlot(const char* page, int n, int& offset, int& length);
+static void setSlot(char* page, int n, int offset, int length);
+
+// add the slot of a new record after the last one
+static void addSlot(char* page, int offset, int length);
+
+// the offset of the first record byte of a slotted page
+static int getDataStart(const char* page);
+static void setDataStart(char* page, int start);
+
+// # bytes the record of a value of the slot length takes in the data area
+static int recordSize(const char* page, int length);
+
+// # bytes between the slot directory and the records
+static int getFreeSpace(const char* page);
+
+// # bytes of a slotted page in use, holes left by update() not included
+static int getUsedSpace(const char* page);
+
+// move the records together at the end of the page, leaving out skip
+static void compactPage(char* page, int skip);
+
+// store the n'th record at offset: the key and the value, or the long
+// value stub. A columnar page keeps the key in its key column.
+static void writeRecord(char* page, int n, int offset, int key, const std::string& value, int length, PageId first);
+
+// the first overflow page of the long value of a record at offset
+static PageId getFirstOverflow(const char* page, int offset);
+
+// # overflow pages for a value of size bytes
+static int overflowPageCount(int size);
+
+// find the record in the n'th slot of a record page: the key and either
+// the value bytes in the page or, for a long value, its first overflow page
+static void getRecord(const char* page, int n, int& key, const char*& value, int& length, PageId& first);
+
+// copy the keys of all records of a record page to keys, in slot order
+// @return # records in the page
+static int getPageKeys(const char* page, int* keys);
+
+// read a long value from its chain of overflow pages in pf
+static RC readOverflowPages(const PageFile& pf, PageId first, int length, std::string& value);
 
 //
 // helper functions for RecordId manipulation
@@ -105,14 +202,52 @@ bool operator != (const RecordId& r1, const RecordId& r2)
 }
 
 
+
+typedef struct {
+  int    header;  // PAGE_OVERFLOW
+  PageId next;    // the next page of the chain, -1 at the end
+  PageId tail;    // the page appends went to when the page was written, -1 for a new page
+  int    length;  // # value bytes in the page, 0 if the page is no longer used
+} OverflowHeader;
+
+
+_KeyFilter::_KeyFilter()
+{
+  lo = INT_MIN;
+  hi = INT_MAX;
+}
+
+RecordGuard::RecordGuard()
+{
+  pid = -1;
+  file = NULL;
+  version = 0;
+}
+
+void RecordGuard::release()
+{
+  pid = -1;
+  file = NULL;
+}
+
 RecordFile::RecordFile()
 {
   erid.pid = 0;
   erid.sid = 0;
+  tailPid = -1;
+  tailDirty = false;
+  version = 0;
+  pageFormat = PAGE_SLOTTED;
+  freeOverflowLoaded = false;
 }
 
 RecordFile::RecordFile(const string& filename, char mode)
 {
+  tailPid = -1;
+  tailDirty = false;
+  version = 0;
+  pageFormat = PAGE_SLOTTED;
+  freeOverflowLoaded = false;
   open(filename, mode);
 }
 
@@ -123,7 +258,14 @@ RC RecordFile::open(const string& filename, char mode)
 
   // open the page file
   if ((rc = pf.open(filename, mode)) < 0) return rc;
+  fileName = filename;
   readOnlyMode = (mode == 'r' || mode == 'R')?true:false;
+  tailPid = -1;
+  tailDirty = false;
+  version++;
+  pageFormat = PAGE_SLOTTED;
+  freeOverflow.clear();
+  freeOverflowLoaded = false;
 
   //
   // in the rest of this function, we set the end record id
@@ -149,11 +291,32 @@ RC RecordFile::open(const string& filename, char mode)
     return rc;
   }
 
+  // the last page may be an overflow page of a long value; it knows the
+  // page the records were appended to at that time
+  if (getPageFormat(page) == PAGE_OVERFLOW) {
+    OverflowHeader h;
+    memcpy(&h, page, sizeof(h));
+    if (h.tail < 0 || h.tail >= erid.pid) {
+      erid.pid = pf.endPid();
+      erid.sid = 0;
+      return 0;
+    }
+    erid.pid = h.tail;
+    if ((rc = pf.read(erid.pid, page)) < 0) {
+      erid.pid = erid.sid = 0;
+      pf.close();
+      return rc;
+    }
+  }
+
+  // new pages continue in the layout of the last one
+  if (getPageFormat(page) == PAGE_COLUMNAR) pageFormat = PAGE_COLUMNAR;
+
   // get # records in the last page
   erid.sid = getRecordCount(page);
   if (erid.sid >= RECORDS_PER_PAGE) {
     // the last page is full. advance the end record id to the next page.
-    erid.pid++;
+    erid.pid = pf.endPid();
     erid.sid = 0;
   }
   
@@ -162,66 +325,522 @@ RC RecordFile::open(const string& filename, char mode)
 
 RC RecordFile::close()
 {
+  RC rc = flush();
+
   erid.pid = 0;
   erid.sid = 0;
+  tailPid = -1;
+  version++;
+  freeOverflow.clear();
+  freeOverflowLoaded = false;
 
+  if (rc < 0) {
+    pf.close();
+    return rc;
+  }
   return pf.close();
 }
 
-RC RecordFile::read(const RecordId& rid, int& key, string& value) const
+RC RecordFile::flush()
 {
-  RC   rc;
-  char page[PageFile::PAGE_SIZE];
-  
+  RC rc;
+
+  if (!tailDirty) return 0;
+  if ((rc = pf.write(tailPid, tail)) < 0) return rc;
+  tailDirty = false;
+  return 0;
+}
+
+/*
+ * Check a record id and find its page: the page in memory, or the page
+ * read into buffer.
+ * @param rid[IN] the id of the record
+ * @param buffer[OUT] a page frame to read into
+ * @param page[OUT] the page of the record
+ * @return error code. RC_INVALID_RID if there is no such record
+ */
+RC RecordFile::readPage(const RecordId& rid, char* buffer, const char*& page) const
+{
+  RC rc;
+
   // check whether the rid is in the valid range
   if (rid.pid < 0 || rid.pid > erid.pid) return RC_INVALID_RID;
   if (rid.sid < 0 || rid.sid >= RecordFile::RECORDS_PER_PAGE) return RC_INVALID_RID;
   if (rid >= erid) return RC_INVALID_RID;
   
-  // read the page containing the record
-  if ((rc = pf.read(rid.pid, page)) < 0) return rc;
+  // read the page containing the record, unless it is the page in memory
+  page = buffer;
+  if (rid.pid == tailPid) page = tail;
+  else if ((rc = pf.read(rid.pid, buffer)) < 0) return rc;
 
-  // read the record from the slot in the page
-  readSlot(page, rid.sid, key, value);
+  // a page may be closed before its last slot was used,
+  // and an overflow page has no slots at all
+  if (getPageFormat(page) == PAGE_OVERFLOW || rid.sid >= getRecordCount(page)) return RC_INVALID_RID;
+  return 0;
+}
+
+RC RecordFile::read(const RecordId& rid, int& key, string& value) const
+{
+  RC   rc;
+  char buffer[PageFile::PAGE_SIZE];
+  const char* page;
+  const char* ptr;
+  int  length;
+  PageId first;
+
+  if ((rc = readPage(rid, buffer, page)) < 0) return rc;
+  getRecord(page, rid.sid, key, ptr, length, first);
+  if (first == -1) {
+    value.assign(ptr, length);
+    return 0;
+  }
+  return readOverflow(first, length, value);
+}
 
+RC RecordFile::read(const RecordId& rid, RecordGuard& guard, RecordView& view) const
+{
+  RC rc;
+  const char* page;
+  PageId first;
+
+  if (guard.file != this || guard.pid != rid.pid || guard.version != version) {
+    guard.release();
+    if ((rc = readPage(rid, guard.page, page)) < 0) return rc;
+    // the page in memory is changed by the next append, so the guard
+    // takes a copy of it
+    if (page == tail) memcpy(guard.page, tail, PageFile::PAGE_SIZE);
+    guard.pid = rid.pid;
+    guard.file = this;
+    guard.version = version;
+  } else if (rid.sid < 0 || rid.sid >= getRecordCount(guard.page) || getPageFormat(guard.page) == PAGE_OVERFLOW) {
+    return RC_INVALID_RID;
+  }
+
+  getRecord(guard.page, rid.sid, view.key, view.value, view.length, first);
+  if (first == -1) return 0;
+  if ((rc = readOverflow(first, view.length, guard.longValue)) < 0) return rc;
+  view.value = guard.longValue.data();
   return 0;
 }
 
+RC RecordFile::visit(const vector<RecordId>& rids, RecordVisitor visitor, void* arg) const
+{
+  RC rc;
+  RecordGuard guard;
+  RecordView view;
+
+  for (size_t i = 0; i < rids.size(); i++) {
+    if ((rc = read(rids[i], guard, view)) < 0) return rc;
+    if ((rc = visitor(rids[i], view, arg)) != 0) return rc;
+  }
+  return 0;
+}
+
+/*
+ * A rid of a fetch() batch and its place in the batch.
+ */
+typedef struct {
+  RecordId rid;
+  int      pos;
+} FetchSlot;
+
+static bool fetchLess(const FetchSlot& a, const FetchSlot& b)
+{
+  return a.rid < b.rid;
+}
+
+RC RecordFile::fetch(const vector<RecordId>& rids, vector<int>& keys, vector<string>& values) const
+{
+  RC rc;
+  vector<FetchSlot> slots(rids.size());
+  vector<char> run;
+  size_t i, j, k;
+  PageId first, last, end;
+  const char* ptr;
+  int length;
+  PageId overflow;
+
+  keys.resize(rids.size());
+  values.resize(rids.size());
+  for (i = 0; i < rids.size(); i++) {
+    if (rids[i].pid < 0 || rids[i].sid < 0 || rids[i].sid >= RECORDS_PER_PAGE || rids[i] >= erid)
+      return RC_INVALID_RID;
+    slots[i].rid = rids[i];
+    slots[i].pos = (int)i;
+  }
+  std::sort(slots.begin(), slots.end(), fetchLess);
+
+  for (i = 0; i < slots.size(); i = j) {
+    // the run of pages first..last, every one of them with a record to read
+    first = last = slots[i].rid.pid;
+    for (j = i + 1; j < slots.size(); j++) {
+      PageId pid = slots[j].rid.pid;
+      if (pid != last && (pid != last + 1 || pid - first >= FETCH_RUN_PAGES)) break;
+      last = pid;
+    }
+    run.resize((size_t)(last - first + 1) * PageFile::PAGE_SIZE);
+    // the tail page may not be on the disk yet, or be older there
+    end = (tailPid >= first && tailPid <= last) ? tailPid : last + 1;
+    if (end > first && (rc = pf.read(first, end - first, &run[0])) < 0) return rc;
+    if (end <= last) {
+      memcpy(&run[(size_t)(end - first) * PageFile::PAGE_SIZE], tail, PageFile::PAGE_SIZE);
+      if (end < last && (rc = pf.read(end + 1, last - end, &run[(size_t)(end + 1 - first) * PageFile::PAGE_SIZE])) < 0) return rc;
+    }
+
+    for (k = i; k < j; k++) {
+      const FetchSlot& slot = slots[k];
+      const char* page = &run[(size_t)(slot.rid.pid - first) * PageFile::PAGE_SIZE];
+      // the same rid twice is read once
+      if (k > i && slot.rid == slots[k-1].rid) {
+        keys[slot.pos] = keys[slots[k-1].pos];
+        values[slot.pos] = values[slots[k-1].pos];
+        continue;
+      }
+      if (getPageFormat(page) == PAGE_OVERFLOW || slot.rid.sid >= getRecordCount(page)) return RC_INVALID_RID;
+      getRecord(page, slot.rid.sid, keys[slot.pos], ptr, length, overflow);
+      if (overflow == -1) values[slot.pos].assign(ptr, length);
+      else if ((rc = readOverflow(overflow, length, values[slot.pos])) < 0) return rc;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Shared state of the workers of one parallel scan.
+ */
+typedef struct {
+  const string*      fileName;
+  int                lo;        // the range of the filter
+  int                hi;
+  vector<int>        list;      // the IN-list of the filter, sorted
+  PageId             endPid;    // # pages to scan
+  PageId             tailPid;   // the page appends go to, read from tail
+  const char*        tail;
+  int                parts;     // # page ranges
+  RecordScanCallback callback;
+  void*              arg;
+  std::atomic<int>   nextPart;  // the next page range to hand out
+  std::atomic<bool>  stop;      // set when a worker fails or callback says stop
+  std::atomic<int>   rc;        // the first error code
+} RecordScanJob;
+
+// an IN-list up to this size is compared key by key without a branch,
+// a longer one is searched for the keys in range
+static const int SHORT_IN_LIST = 16;
+
+/*
+ * Find the keys of a page that pass the filter. The tests run over the
+ * whole key array into a 0/1 array without a branch, so the compiler
+ * turns them into vector compares; the range test is one unsigned
+ * compare (key - lo <= hi - lo).
+ * @param hits[OUT] the slots that passed
+ * @return # slots that passed
+ */
+static int filterKeys(const RecordScanJob* job, const int* keys, int n, unsigned char* match, int* hits)
+{
+  unsigned lo = (unsigned)job->lo, span = (unsigned)job->hi - lo;
+  int i, j, count = 0, m = (int)job->list.size();
+  const int* list = m > 0 ? &job->list[0] : NULL;
+
+  for (i = 0; i < n; i++)
+    match[i] = ((unsigned)keys[i] - lo) <= span;
+  if (m > 0 && m <= SHORT_IN_LIST) {
+    for (i = 0; i < n; i++) {
+      unsigned char in = 0;
+      for (j = 0; j < m; j++) in |= (keys[i] == list[j]);
+      match[i] &= in;
+    }
+  } else if (m > 0) {
+    for (i = 0; i < n; i++)
+      if (match[i]) match[i] = std::binary_search(list, list + m, keys[i]);
+  }
+  for (i = 0; i < n; i++) {
+    hits[count] = i;
+    count += match[i];
+  }
+  return count;
+}
+
+static bool emitBatch(RecordScanJob* job, int worker, RecordBatch& batch)
+{
+  if (batch.rids.empty()) return true;
+  if (job->callback(worker, batch, job->arg) != 0) {
+    job->stop = true;
+    return false;
+  }
+  batch.rids.clear();
+  batch.keys.clear();
+  batch.values.clear();
+  return true;
+}
+
+/*
+ * Scan the pages [first, last) with a private PageFile.
+ */
+static RC scanPages(RecordScanJob* job, const PageFile& pf, int worker, PageId first, PageId last, vector<char>& run)
+{
+  RC rc;
+  PageId pid, end;
+  RecordBatch batch;
+  int keys[RecordFile::RECORDS_PER_PAGE], hits[RecordFile::RECORDS_PER_PAGE];
+  unsigned char match[RecordFile::RECORDS_PER_PAGE];
+  const char* value;
+  int key, length, count, n, i;
+  PageId overflow;
+
+  for (pid = first; pid < last && !job->stop; pid = end) {
+    // a run of pages on the disk, or the tail page in memory
+    const char* pages = job->tail;
+    end = pid + 1;
+    if (pid != job->tailPid) {
+      end = std::min(last, pid + RecordFile::FETCH_RUN_PAGES);
+      if (job->tailPid > pid && job->tailPid < end) end = job->tailPid;
+      if (end > pf.endPid()) end = pf.endPid();
+      if (end <= pid) return RC_INVALID_PID;
+      if ((rc = pf.read(pid, end - pid, &run[0])) < 0) return rc;
+      pages = &run[0];
+    }
+
+    for (; pid < end; pid++, pages += PageFile::PAGE_SIZE) {
+      if (getPageFormat(pages) == PAGE_OVERFLOW) continue;
+      n = getPageKeys(pages, keys);
+      count = filterKeys(job, keys, n, match, hits);
+      for (i = 0; i < count; i++) {
+        getRecord(pages, hits[i], key, value, length, overflow);
+        batch.rids.push_back(RecordId(pid, hits[i]));
+        batch.keys.push_back(key);
+        batch.values.push_back(string());
+        if (overflow == -1) batch.values.back().assign(value, length);
+        else if ((rc = readOverflowPages(pf, overflow, length, batch.values.back())) < 0) return rc;
+        if ((int)batch.rids.size() >= RecordFile::SCAN_BATCH_RECORDS && !emitBatch(job, worker, batch)) return 0;
+      }
+    }
+  }
+  if (!job->stop) emitBatch(job, worker, batch);
+  return 0;
+}
+
+/*
+ * Worker thread body: take page ranges until none is left.
+ * PageFile::read seeks and reads on the file descriptor, so every
+ * worker needs its own handle on the file.
+ */
+static void scanWorker(RecordScanJob* job, int worker)
+{
+  RC rc;
+  PageFile pf;
+  vector<char> run((size_t)RecordFile::FETCH_RUN_PAGES * PageFile::PAGE_SIZE);
+  int part;
+
+  if ((rc = pf.open(*job->fileName, 'r')) != 0) {
+    job->rc = rc;
+    job->stop = true;
+    return;
+  }
+  while (!job->stop && (part = job->nextPart++) < job->parts) {
+    PageId first = (PageId)((long long)job->endPid * part / job->parts);
+    PageId last = (PageId)((long long)job->endPid * (part + 1) / job->parts);
+    if ((rc = scanPages(job, pf, worker, first, last, run)) != 0) {
+      job->rc = rc;
+      job->stop = true;
+    }
+  }
+  pf.close();
+}
+
+/*
+ * Scan all records using several threads. We make a few more page
+ * ranges than workers, so that a worker that finishes early can take
+ * over a range another one has not started.
+ */
+RC RecordFile::parallelScan(const KeyFilter& filter, int workers, RecordScanCallback callback, void* arg) const
+{
+  RecordScanJob job;
+  vector<std::thread> pool;
+  int i;
+
+  if (endPid() == 0 || filter.lo > filter.hi) return 0;
+  if (workers <= 0) workers = std::max(1, (int)std::thread::hardware_concurrency());
+
+  job.fileName = &fileName;
+  job.lo = filter.lo;
+  job.hi = filter.hi;
+  job.list = filter.list;
+  std::sort(job.list.begin(), job.list.end());
+  job.list.erase(std::unique(job.list.begin(), job.list.end()), job.list.end());
+  job.endPid = endPid();
+  job.tailPid = tailPid;
+  job.tail = tail;
+  job.parts = std::min(workers * 4, (int)job.endPid);
+  job.callback = callback;
+  job.arg = arg;
+  job.nextPart = 0;
+  job.stop = false;
+  job.rc = 0;
+  workers = std::min(workers, job.parts);
+
+  for (i = 0; i < workers; i++)
+    pool.push_back(std::thread(scanWorker, &job, i));
+  for (i = 0; i < workers; i++)
+    pool[i].join();
+  return job.rc;
+}
+
 RC RecordFile::append(int key, const std::string& value, RecordId& rid)
 {
   if(readOnlyMode)
 	  return RC_FILE_READ_ONLY;
 
   RC   rc;
-  char page[PageFile::PAGE_SIZE];
+  int  length = (int)value.size() > MAX_INLINE_LENGTH ? LONG_VALUE : (int)value.size();
+  int  offset, pages = 0;
+  PageId first = -1;
+
+  // a long value takes the unused overflow pages before new ones
+  if (length == LONG_VALUE) {
+    if ((rc = loadFreeOverflow()) < 0) return rc;
+    pages = overflowPageCount((int)value.size()) - (int)freeOverflow.size();
+    if (pages < 0) pages = 0;
+  }
 
   // unless we are writing to the the first slot of an empty page,
-  // we have to read the page first
+  // we have to read the page first. It stays in memory until it is full.
+  if (erid.sid > 0 && tailPid != erid.pid) {
+    if ((rc = pf.read(erid.pid, tail)) < 0) return rc;
+    tailPid = erid.pid;
+  }
   if (erid.sid > 0) {
-    if ((rc = pf.read(erid.pid, page)) < 0) return rc;
-  } else {
-    // if this is the first slot of an empty page
-    // we can simply initialize the page with zeros
-    memset(page, 0, PageFile::PAGE_SIZE);
+    // the fixed slot page at the end of an old file, a page in the other
+    // layout, or a page without room for the record, is closed and a new
+    // page is started
+    if (getPageFormat(tail) != pageFormat || getFreeSpace(tail) < slotSize(tail) + recordSize(tail, length)) {
+      if ((rc = flush()) < 0) return rc;
+      erid.pid = pf.endPid();
+      erid.sid = 0;
+    }
+  }
+  if (erid.sid == 0) {
+    // a new page goes after the new overflow pages of its value
+    erid.pid = pf.endPid() + pages;
+    initSlottedPage(tail, pageFormat);
+    tailPid = erid.pid;
   }
+
+  if (length == LONG_VALUE &&
+      (rc = writeOverflow(value, vector<PageId>(), erid.pid, first)) < 0) return rc;
     
-  // write the record to the first empty slot 
+  // write the record below the others and its slot after the last one
   DEBUG('i',"Write to slot: (pid,sid)=(%d,%d)  RecordFile::RECORDS_PER_PAGE=%d\n",erid.pid, erid.sid,  RecordFile::RECORDS_PER_PAGE);
-  writeSlot(page, erid.sid, key, value);
-
-  // the first four bytes in the page stores # records in the page.
-  // update this number.
-  setRecordCount(page, erid.sid + 1);
-
-  // write the page to the disk
-  if ((rc = pf.write(erid.pid, page)) < 0) return rc;
+  // (addSlot() also updates # records in the first four bytes of the page)
+  offset = getDataStart(tail) - recordSize(tail, length);
+  addSlot(tail, offset, length);
+  writeRecord(tail, erid.sid, offset, key, value, length, first);
+  setDataStart(tail, offset);
+  tailDirty = true;
+  version++;
     
   // we need to output the rid of the record slot
   rid = erid;
 
-  // advance the end record id by one to the next empty slot
-  ++erid;
+  // advance the end record id by one to the next empty slot.
+  // A page whose slots are used up is written now.
+  if ((++erid).sid == 0) {
+    if ((rc = flush()) < 0) return rc;
+    tailPid = -1;
+  }
+
+  return 0;
+}
+
+RC RecordFile::update(const RecordId& rid, int key, const std::string& value)
+{
+  RC   rc;
+  char buffer[PageFile::PAGE_SIZE];
+  char* page = buffer;
+  int  offset, oldLength, length, size;
+  PageId first = -1;
+  vector<PageId> chain;
+
+  if (readOnlyMode) return RC_FILE_READ_ONLY;
+  version++;
+  if (rid.pid < 0 || rid.pid > erid.pid) return RC_INVALID_RID;
+  if (rid.sid < 0 || rid.sid >= RecordFile::RECORDS_PER_PAGE) return RC_INVALID_RID;
+  if (rid >= erid) return RC_INVALID_RID;
+
+  // the page appends go to is changed in memory
+  if (rid.pid == tailPid) page = tail;
+  else if ((rc = pf.read(rid.pid, buffer)) < 0) return rc;
+  if (getPageFormat(page) == PAGE_OVERFLOW || rid.sid >= getRecordCount(page)) return RC_INVALID_RID;
+
+  if (!isSlottedPage(page)) {
+    // a fixed slot would truncate a longer value
+    if ((int)value.size() >= MAX_VALUE_LENGTH) return RC_UNSUPPORTED_MODE;
+    writeSlot(page, rid.sid, key, value);
+    if (page == tail) {
+      tailDirty = true;
+      return 0;
+    }
+    return pf.write(rid.pid, page);
+  }
+
+  getSlot(page, rid.sid, offset, oldLength);
+  if (oldLength == LONG_VALUE) {
+    first = getFirstOverflow(page, offset);
+    if ((rc = readChain(first, chain)) < 0) return rc;
+  }
+
+  length = (int)value.size() > MAX_INLINE_LENGTH ? LONG_VALUE : (int)value.size();
+  size = recordSize(page, length);
+  if (size > recordSize(page, oldLength)) {
+    // the old record is left as a hole. The holes are reclaimed by
+    // compacting the page only when the new record does not fit, and
+    // a record that still does not fit moves its value out of the page.
+    if (getFreeSpace(page) < size) compactPage(page, rid.sid);
+    if (getFreeSpace(page) < size) {
+      length = LONG_VALUE;
+      size = recordSize(page, LONG_VALUE);
+    }
+    offset = getDataStart(page) - size;
+    setDataStart(page, offset);
+  }
+
+  // the overflow pages of the old value are written again first
+  if (length == LONG_VALUE || !chain.empty()) {
+    if ((rc = writeOverflow(length == LONG_VALUE ? value : string(), chain,
+                            erid.sid > 0 ? erid.pid : -1, first)) < 0) return rc;
+  }
+  writeRecord(page, rid.sid, offset, key, value, length, first);
+  setSlot(page, rid.sid, offset, length);
+  if (page == tail) {
+    tailDirty = true;
+    return 0;
+  }
+  return pf.write(rid.pid, page);
+}
+
+RC RecordFile::getPageUsage(PageId pid, int& records, int& usedBytes, bool& overflow) const
+{
+  RC   rc;
+  char buffer[PageFile::PAGE_SIZE];
+  const char* page = buffer;
+
+  if (pid < 0 || pid >= endPid()) return RC_INVALID_PID;
+  if (pid == tailPid) page = tail;
+  else if ((rc = pf.read(pid, buffer)) < 0) return rc;
 
+  overflow = (getPageFormat(page) == PAGE_OVERFLOW);
+  if (overflow) {
+    OverflowHeader h;
+    memcpy(&h, page, sizeof(h));
+    records = 0;
+    usedBytes = OVERFLOW_HEADER + h.length;
+  } else if (isSlottedPage(page)) {
+    records = getRecordCount(page);
+    usedBytes = getUsedSpace(page);
+  } else {
+    records = getRecordCount(page);
+    usedBytes = sizeof(int) + records * (sizeof(int) + MAX_VALUE_LENGTH);
+  }
   return 0;
 }
 
@@ -230,19 +849,165 @@ const RecordId& RecordFile::endRid() const
   return erid;
 }
 
+RC RecordFile::enableCompression()
+{
+  if (readOnlyMode) return RC_FILE_READ_ONLY;
+  if (erid.pid != 0 || erid.sid != 0) return RC_UNSUPPORTED_MODE;
+  return pf.enableCompression();
+}
+
+RC RecordFile::setColumnar(bool columnar)
+{
+  if (readOnlyMode) return RC_FILE_READ_ONLY;
+  pageFormat = columnar ? PAGE_COLUMNAR : PAGE_SLOTTED;
+  return 0;
+}
+
+bool RecordFile::isColumnar() const
+{
+  return pageFormat == PAGE_COLUMNAR;
+}
+
+/*
+ * Read a long value from its chain of overflow pages.
+ * @param first[IN] the first page of the chain
+ * @param length[IN] the length of the value
+ * @param value[OUT] the value
+ * @return error code. RC_INVALID_FILE_FORMAT if the chain is broken
+ */
+RC RecordFile::readOverflow(PageId first, int length, string& value) const
+{
+  return readOverflowPages(pf, first, length, value);
+}
+
+/*
+ * Collect the pages of a chain of overflow pages.
+ * @param first[IN] the first page of the chain
+ * @param pids[OUT] the pages in chain order
+ * @return error code. RC_INVALID_FILE_FORMAT if the chain is broken
+ */
+RC RecordFile::readChain(PageId first, vector<PageId>& pids) const
+{
+  RC   rc;
+  char page[PageFile::PAGE_SIZE];
+  OverflowHeader h;
+
+  pids.clear();
+  for (PageId pid = first; pid != -1; pid = h.next) {
+    if (pid < 0 || pid >= pf.endPid() || (int)pids.size() >= pf.endPid()) return RC_INVALID_FILE_FORMAT;
+    if ((rc = pf.read(pid, page)) < 0) return rc;
+    if (getPageFormat(page) != PAGE_OVERFLOW) return RC_INVALID_FILE_FORMAT;
+    memcpy(&h, page, sizeof(h));
+    pids.push_back(pid);
+  }
+  return 0;
+}
+
+/*
+ * Write a value to a chain of overflow pages: the pages of reuse first,
+ * then the unused overflow pages of the file, then new pages at the end
+ * of the file. The pages of reuse that are left over are marked unused
+ * and kept for the next long value.
+ * @param value[IN] the value
+ * @param reuse[IN] the pages of an old value of the record
+ * @param tail[IN] the page appends go to, for open()
+ * @param first[OUT] the first page of the chain, -1 for an empty value
+ * @return error code. 0 if no error
+ */
+RC RecordFile::writeOverflow(const string& value, const vector<PageId>& reuse, PageId tail, PageId& first)
+{
+  RC   rc;
+  char page[PageFile::PAGE_SIZE];
+  OverflowHeader h;
+  int  i, size = (int)value.size(), pages = overflowPageCount(size);
+  vector<PageId> pids(reuse.begin(), reuse.begin() + (pages < (int)reuse.size() ? pages : (int)reuse.size()));
+  PageId pid;
+
+  if ((int)pids.size() < pages && (rc = loadFreeOverflow()) < 0) return rc;
+  while ((int)pids.size() < pages && !freeOverflow.empty()) {
+    pids.push_back(freeOverflow.back());
+    freeOverflow.pop_back();
+  }
+
+  // the new pages go to the end of the file, which is after the page
+  // in memory if that page is not on the disk yet
+  if ((int)pids.size() < pages && tailPid == pf.endPid() && (rc = flush()) < 0) return rc;
+  pid = pf.endPid();
+  while ((int)pids.size() < pages) pids.push_back(pid++);
+  for (i = 0; i < pages || i < (int)reuse.size(); i++) {
+    memset(page, 0, PageFile::PAGE_SIZE);
+    h.header = PAGE_OVERFLOW;
+    h.tail = tail;
+    h.next = (i + 1 < pages) ? pids[i + 1] : -1;
+    h.length = 0;
+    if (i < pages) {
+      h.length = (size - i * OVERFLOW_DATA < OVERFLOW_DATA) ? size - i * OVERFLOW_DATA : OVERFLOW_DATA;
+      memcpy(page + OVERFLOW_HEADER, value.data() + i * OVERFLOW_DATA, h.length);
+    }
+    memcpy(page, &h, sizeof(h));
+    if ((rc = pf.write(i < pages ? pids[i] : reuse[i], page)) < 0) return rc;
+    // until loadFreeOverflow() runs, it finds the page in the file
+    if (i >= pages && freeOverflowLoaded) freeOverflow.push_back(reuse[i]);
+  }
+  first = pages > 0 ? pids[0] : -1;
+  return 0;
+}
+
+/*
+ * Collect the overflow pages that no value uses, once after open(). It
+ * reads every page of the file, so it waits for the first long value to
+ * write rather than slowing down open().
+ * @return error code. 0 if no error
+ */
+RC RecordFile::loadFreeOverflow()
+{
+  RC   rc;
+  vector<char> run((size_t)FETCH_RUN_PAGES * PageFile::PAGE_SIZE);
+  OverflowHeader h;
+  PageId pid, end;
+  int  i;
+
+  if (freeOverflowLoaded) return 0;
+  freeOverflow.clear();
+  for (pid = 0; pid < pf.endPid(); pid = end) {
+    end = std::min(pf.endPid(), pid + FETCH_RUN_PAGES);
+    if ((rc = pf.read(pid, end - pid, &run[0])) < 0) return rc;
+    for (i = 0; i < end - pid; i++) {
+      const char* page = &run[(size_t)i * PageFile::PAGE_SIZE];
+      if (getPageFormat(page) != PAGE_OVERFLOW) continue;
+      memcpy(&h, page, sizeof(h));
+      if (h.length == 0) freeOverflow.push_back(pid + i);
+    }
+  }
+  freeOverflowLoaded = true;
+  return 0;
+}
+
 static int getRecordCount(const char* page)
 {
   int count;
 
   // the first four bytes of a page contains # records in the page
   memcpy(&count, page, sizeof(int));
-  return count;
+  return count & COUNT_MASK;
 }
 
 static void setRecordCount(char* page, int count)
 {
-  // the first four bytes of a page contains # records in the page
-  memcpy(page, &count, sizeof(int));
+  int header;
+
+  // the first four bytes of a page contains # records in the page,
+  // next to the format bits
+  memcpy(&header, page, sizeof(int));
+  header = (header & ~COUNT_MASK) | count;
+  memcpy(page, &header, sizeof(int));
+}
+
+static int getPageFormat(const char* page)
+{
+  int header;
+  memcpy(&header, page, sizeof(int));
+  return header & ~COUNT_MASK;
 }
 
 static char* slotPtr(char* page, int n) 
@@ -254,18 +1019,6 @@ static char* slotPtr(char* page, int n)
   return (page+sizeof(int)) + (sizeof(int)+RecordFile::MAX_VALUE_LENGTH)*n;
 }
 
-static void readSlot(const char* page, int n, int& key, std::string& value)
-{
-  // compute the location of the record
-  char *ptr = slotPtr(const_cast<char*>(page), n);
-
-  // read the key 
-  memcpy(&key, ptr, sizeof(int));
-
-  // read the value
-  value.assign(ptr + sizeof(int));
-}
-
 static void writeSlot(char* page, int n, int key, const std::string& value)
 {
   // compute the location of the record
@@ -283,3 +1036,221 @@ static void writeSlot(char* page, int n, int key, const std::string& value)
     strcpy(ptr + sizeof(int), value.c_str());
   }
 }
+
+static void getRecord(const char* page, int n, int& key, const char*& value, int& length, PageId& first)
+{
+  int offset;
+
+  first = -1;
+  if (!isSlottedPage(page)) {
+    // a fixed slot holds the key and a 0 terminated value
+    const char* ptr = slotPtr(const_cast<char*>(page), n);
+    memcpy(&key, ptr, sizeof(int));
+    value = ptr + sizeof(int);
+    for (length = 0; length < RecordFile::MAX_VALUE_LENGTH && value[length] != 0; length++);
+    return;
+  }
+  getSlot(page, n, offset, length);
+  if (getPageFormat(page) == PAGE_COLUMNAR) {
+    memcpy(&key, page + SLOTTED_HEADER + n * sizeof(int), sizeof(int));
+  } else {
+    memcpy(&key, page + offset, sizeof(int));
+    offset += sizeof(int);
+  }
+  value = page + offset;
+  if (length == LONG_VALUE) {
+    memcpy(&length, page + offset, sizeof(int));
+    memcpy(&first, page + offset + sizeof(int), sizeof(PageId));
+    value = NULL;
+  }
+}
+
+static void initSlottedPage(char* page, int format)
+{
+  int header = format;
+  memset(page, 0, PageFile::PAGE_SIZE);
+  memcpy(page, &header, sizeof(int));
+  setDataStart(page, PageFile::PAGE_SIZE);
+}
+
+static bool isSlottedPage(const char* page)
+{
+  int format = getPageFormat(page);
+  return format == PAGE_SLOTTED || format == PAGE_COLUMNAR;
+}
+
+static int getSlotBase(const char* page)
+{
+  if (getPageFormat(page) == PAGE_COLUMNAR) return SLOTTED_HEADER + getRecordCount(page) * sizeof(int);
+  return SLOTTED_HEADER;
+}
+
+static int getSlotEnd(const char* page)
+{
+  return getSlotBase(page) + getRecordCount(page) * SLOT_SIZE;
+}
+
+static int slotSize(const char* page)
+{
+  return getPageFormat(page) == PAGE_COLUMNAR ? SLOT_SIZE + sizeof(int) : SLOT_SIZE;
+}
+
+static void getSlot(const char* page, int n, int& offset, int& length)
+{
+  unsigned short slot[2];
+  memcpy(slot, page + getSlotBase(page) + n * SLOT_SIZE, SLOT_SIZE);
+  offset = slot[0];
+  length = slot[1];
+}
+
+static void setSlot(char* page, int n, int offset, int length)
+{
+  unsigned short slot[2] = { (unsigned short)offset, (unsigned short)length };
+  memcpy(page + getSlotBase(page) + n * SLOT_SIZE, slot, SLOT_SIZE);
+}
+
+static void addSlot(char* page, int offset, int length)
+{
+  int count = getRecordCount(page), base = getSlotBase(page);
+
+  // the slot directory of a columnar page moves up to make room for
+  // one more key; the caller made sure the free space holds both
+  if (getPageFormat(page) == PAGE_COLUMNAR) {
+    memmove(page + base + sizeof(int), page + base, count * SLOT_SIZE);
+    memset(page + base, 0, sizeof(int));
+  }
+  setRecordCount(page, count + 1);
+  setSlot(page, count, offset, length);
+}
+
+static int getDataStart(const char* page)
+{
+  int start;
+  memcpy(&start, page + sizeof(int), sizeof(int));
+  return start;
+}
+
+static void setDataStart(char* page, int start)
+{
+  memcpy(page + sizeof(int), &start, sizeof(int));
+}
+
+static int recordSize(const char* page, int length)
+{
+  if (getPageFormat(page) == PAGE_COLUMNAR) {
+    if (length == LONG_VALUE || length < MIN_VALUE_RECORD) return MIN_VALUE_RECORD;
+    return length;
+  }
+  if (length == LONG_VALUE || (int)sizeof(int) + length < MIN_RECORD) return MIN_RECORD;
+  return sizeof(int) + length;
+}
+
+static int getFreeSpace(const char* page)
+{
+  return getDataStart(page) - getSlotEnd(page);
+}
+
+static int getUsedSpace(const char* page)
+{
+  int n, offset, length, count = getRecordCount(page);
+  int used = SLOTTED_HEADER + count * slotSize(page);
+
+  for (n = 0; n < count; n++) {
+    getSlot(page, n, offset, length);
+    used += recordSize(page, length);
+  }
+  return used;
+}
+
+static void compactPage(char* page, int skip)
+{
+  char old[PageFile::PAGE_SIZE];
+  int  n, offset, length, size, count = getRecordCount(page);
+  int  start = PageFile::PAGE_SIZE;
+
+  memcpy(old, page, PageFile::PAGE_SIZE);
+  for (n = 0; n < count; n++) {
+    if (n == skip) continue;
+    getSlot(old, n, offset, length);
+    size = recordSize(old, length);
+    start -= size;
+    memcpy(page + start, old + offset, size);
+    setSlot(page, n, start, length);
+  }
+  // clear the free space, for page compression
+  memset(page + getSlotEnd(page), 0, start - getSlotEnd(page));
+  setDataStart(page, start);
+}
+
+static void writeRecord(char* page, int n, int offset, int key, const std::string& value, int length, PageId first)
+{
+  if (getPageFormat(page) == PAGE_COLUMNAR) {
+    memcpy(page + SLOTTED_HEADER + n * sizeof(int), &key, sizeof(int));
+  } else {
+    memcpy(page + offset, &key, sizeof(int));
+    offset += sizeof(int);
+  }
+  if (length == LONG_VALUE) {
+    int size = (int)value.size();
+    memcpy(page + offset, &size, sizeof(int));
+    memcpy(page + offset + sizeof(int), &first, sizeof(PageId));
+  } else {
+    memcpy(page + offset, value.data(), length);
+  }
+}
+
+static PageId getFirstOverflow(const char* page, int offset)
+{
+  PageId first;
+  if (getPageFormat(page) != PAGE_COLUMNAR) offset += sizeof(int);
+  memcpy(&first, page + offset + sizeof(int), sizeof(PageId));
+  return first;
+}
+
+static int overflowPageCount(int size)
+{
+  return (size + OVERFLOW_DATA - 1) / OVERFLOW_DATA;
+}
+
+static RC readOverflowPages(const PageFile& pf, PageId first, int length, string& value)
+{
+  RC   rc;
+  char page[PageFile::PAGE_SIZE];
+  OverflowHeader h;
+  PageId pid = first;
+
+  value.clear();
+  value.reserve(length);
+  while ((int)value.size() < length) {
+    if (pid < 0 || pid >= pf.endPid()) return RC_INVALID_FILE_FORMAT;
+    if ((rc = pf.read(pid, page)) < 0) return rc;
+    memcpy(&h, page, sizeof(h));
+    if (getPageFormat(page) != PAGE_OVERFLOW || h.length <= 0 || h.length > OVERFLOW_DATA)
+      return RC_INVALID_FILE_FORMAT;
+    value.append(page + OVERFLOW_HEADER, h.length);
+    pid = h.next;
+  }
+  return (int)value.size() == length ? 0 : RC_INVALID_FILE_FORMAT;
+}
+
+static int getPageKeys(const char* page, int* keys)
+{
+  int n = getRecordCount(page), offset, length, i;
+
+  if (n > RecordFile::RECORDS_PER_PAGE) n = RecordFile::RECORDS_PER_PAGE;
+  if (getPageFormat(page) == PAGE_COLUMNAR) {
+    // the key column is copied as it is
+    memcpy(keys, page + SLOTTED_HEADER, n * sizeof(int));
+    return n;
+  }
+  if (getPageFormat(page) != PAGE_SLOTTED) {
+    for (i = 0; i < n; i++)
+      memcpy(&keys[i], slotPtr(const_cast<char*>(page), i), sizeof(int));
+    return n;
+  }
+  for (i = 0; i < n; i++) {
+    getSlot(page, i, offset, length);
+    memcpy(&keys[i], page + offset, sizeof(int));
+  }
+  return n;
+}
@@ -2,6 +2,7 @@
 #define RECORDFILE_H
 
 #include <string>
+#include <vector>
 #include "PageFile.h"
 
 /**
@@ -31,20 +32,135 @@ bool operator<= (const RecordId& r1, const RecordId& r2);
 bool operator== (const RecordId& r1, const RecordId& r2);
 bool operator!= (const RecordId& r1, const RecordId& r2);
 
+class RecordFile;
+
+/**
+ * A record read in place: the key and the value bytes, which stay in the
+ * page frame of a RecordGuard. The value is not 0 terminated.
+ */
+typedef struct {
+  int         key;
+  const char* value;   // the value bytes, valid while the guard holds the page
+  int         length;  // # value bytes
+} RecordView;
+
+/**
+ * Holds the page frame that RecordViews point into. The frame keeps the
+ * page that was read last, so records read one after the other from the
+ * same page cost one page read and no copy at all. A view is valid until
+ * the next read with the same guard or release().
+ * A guard is meant to live on the stack, so reading needs no heap
+ * allocation (except for the values kept in overflow pages).
+ */
+class RecordGuard {
+ public:
+  RecordGuard();
+
+  /**
+   * drop the page, e.g. to see the changes made to it since it was read.
+   */
+  void release();
+
+  /**
+   * @return the page held by the guard, -1 if none
+   */
+  PageId getPid() const { return pid; }
+
+ private:
+  friend class RecordFile;
+  char   page[PageFile::PAGE_SIZE];  // the page frame
+  PageId pid;                        // the page in the frame
+  const RecordFile* file;            // the file the page was read from
+  unsigned int version;              // the version of the file at that time
+  std::string longValue;             // a value read from overflow pages
+};
+
+/**
+ * Called by RecordFile::visit for every record of a batch, in the order
+ * of the RecordIds.
+ * @param rid[IN] the id of the record
+ * @param view[IN] the record, valid during the call only
+ * @param arg[IN] the user argument passed to visit
+ * @return 0 to continue. Any other value stops the visit and is returned.
+ */
+typedef RC (*RecordVisitor)(const RecordId& rid, const RecordView& view, void* arg);
+
+/**
+ * A predicate on the record key for RecordFile::parallelScan(): a key
+ * qualifies if lo <= key <= hi and, when list is not empty, it is one of
+ * the keys in list. The default takes every key; an equality predicate
+ * is lo == hi, an IN-list predicate fills list.
+ */
+typedef struct _KeyFilter {
+  _KeyFilter();
+  int lo;
+  int hi;
+  std::vector<int> list;
+} KeyFilter;
+
+/**
+ * Records of a parallel scan that passed the filter, in RecordId order.
+ */
+typedef struct {
+  std::vector<RecordId>    rids;
+  std::vector<int>         keys;
+  std::vector<std::string> values;
+} RecordBatch;
+
+/**
+ * Callback used by RecordFile::parallelScan to hand a batch of records
+ * to the caller. It is called from the worker threads, so it must be
+ * safe to call concurrently for different worker ids.
+ * @param worker[IN] the id of the worker thread (0 .. workers-1)
+ * @param batch[IN] the records, valid during the call only
+ * @param arg[IN] the user argument passed to parallelScan
+ * @return 0 to continue. Any other value stops the whole scan.
+ */
+typedef RC (*RecordScanCallback)(int worker, const RecordBatch& batch, void* arg);
+
 /**
  * read/write a record to a file
+ *
+ * Records are appended to slotted pages: a slot directory at the front
+ * of the page points to the records, which are packed from the end of
+ * the page, so a page holds many short records or a few long ones. A
+ * value longer than MAX_INLINE_LENGTH is kept in a chain of overflow
+ * pages and the record holds its length and first page only. The
+ * overflow pages a value no longer needs are reused by the next long
+ * values before the file grows.
+ * A record keeps its RecordId (page, slot number) for its whole life,
+ * also when update() moves it within its page.
+ *
+ * Files written before the slotted format have pages of fixed slots of
+ * MAX_VALUE_LENGTH bytes. They are still read, and appends continue on
+ * a new slotted page.
+ *
+ * Pages may also be columnar (see setColumnar()): the keys of all records
+ * of the page are stored together in front of the slot directory, and the
+ * values alone are packed from the end of the page. The RecordId and the
+ * API are the same for both layouts, and a file may mix them.
  */
 class RecordFile {
  public:
 
-  // maximum length of the value field
+  // maximum length of the value field of the fixed slots of old files
   static const int MAX_VALUE_LENGTH = 10;  
 
-  // number of record slots per page
+  // maximum number of record slots per page, so that operator++ steps
+  // over the slots of any page
   static const int RECORDS_PER_PAGE = (PageFile::PAGE_SIZE - sizeof(int))/ (sizeof(int) + MAX_VALUE_LENGTH);  
     // Note that we subtract sizeof(int) from PAGE_SIZE because the first
     // four bytes in the page is used to store # records in the page.
 
+  // longer values are stored in overflow pages
+  static const int MAX_INLINE_LENGTH = PageFile::PAGE_SIZE / 4;
+
+  // the most pages fetch() and parallelScan() read with one read
+  static const int FETCH_RUN_PAGES = 32;
+
+  // the most records parallelScan() hands to the callback at once
+  static const int SCAN_BATCH_RECORDS = 1024;
+
   RecordFile();
   RecordFile(const std::string& filename, char mode);
   
@@ -58,7 +174,7 @@ class RecordFile {
   RC open(const std::string& filename, char mode);
 
   /**
-   * close the file.
+   * close the file, after writing the records still kept in memory.
    * @return error code. 0 if no error
    */
   RC close();
@@ -72,6 +188,55 @@ class RecordFile {
    */
   RC read(const RecordId& rid, int& key, std::string& value) const;
 
+  /**
+   * read a record without copying it: view points into the page frame
+   * of guard. The page is only read if the guard does not hold it yet.
+   * @param rid[IN] the id of the record to read
+   * @param guard[IN/OUT] holds the page of the record
+   * @param view[OUT] the record
+   * @return error code. 0 if no error
+   */
+  RC read(const RecordId& rid, RecordGuard& guard, RecordView& view) const;
+
+  /**
+   * read a batch of records in place and hand them to a visitor. Every
+   * run of rids on the same page reads that page once.
+   * @param rids[IN] the ids of the records to read
+   * @param visitor[IN] called for every record, see RecordVisitor
+   * @param arg[IN] passed through to visitor
+   * @return error code. 0 if no error
+   */
+  RC visit(const std::vector<RecordId>& rids, RecordVisitor visitor, void* arg) const;
+
+  /**
+   * read a batch of records, e.g. the rids of an index range scan, which
+   * come in key order and so in random page order. The rids are sorted
+   * by page, every page is read once, and runs of consecutive pages
+   * (up to FETCH_RUN_PAGES) are read with one read.
+   * @param rids[IN] the ids of the records to read, in any order
+   * @param keys[OUT] the record keys, keys[i] of rids[i]
+   * @param values[OUT] the record values, values[i] of rids[i]
+   * @return error code. RC_INVALID_RID if a rid has no record
+   */
+  RC fetch(const std::vector<RecordId>& rids, std::vector<int>& keys, std::vector<std::string>& values) const;
+
+  /**
+   * scan all records of the file with several threads, without an index.
+   * The pages are cut into ranges that are handed out to a pool of
+   * worker threads; each worker opens its own read handle on the file,
+   * reads its pages in runs of FETCH_RUN_PAGES, gathers the keys of a
+   * page into an array and tests them against the filter all at once.
+   * The records that pass are handed to callback in batches of up to
+   * SCAN_BATCH_RECORDS; the batches of one page range come from one
+   * worker, in RecordId order.
+   * @param filter[IN] the predicate on the key
+   * @param workers[IN] the number of worker threads (<= 0: one per core)
+   * @param callback[IN] called for every batch, see RecordScanCallback
+   * @param arg[IN] passed through to callback
+   * @return error code. 0 if no error
+   */
+  RC parallelScan(const KeyFilter& filter, int workers, RecordScanCallback callback, void* arg) const;
+
   /**
    * append a new record at the end of the file.
    * note that RecordFile does not have write() function.
@@ -83,16 +248,99 @@ class RecordFile {
    */
   RC append(int key, const std::string& value, RecordId& rid);
 
+  /**
+   * write the records appended since the last flush to the disk.
+   * append() fills the last page of the file in memory and writes it
+   * only when it is full, so a run of appends costs one page write per
+   * page. read() and update() see the appended records before the flush;
+   * close() flushes as well.
+   * @return error code. 0 if no error
+   */
+  RC flush();
+
+  /**
+   * replace the key and value of a record, keeping its RecordId.
+   * The record is moved within its page (which is compacted if needed),
+   * or its value is moved to overflow pages when the page is full.
+   * A record in a fixed slot of an old file can only get a value shorter
+   * than MAX_VALUE_LENGTH.
+   * @param rid[IN] the id of the record to replace
+   * @param key[IN] the new record key
+   * @param value[IN] the new record value
+   * @return error code. 0 if no error
+   */
+  RC update(const RecordId& rid, int key, const std::string& value);
+
+  /**
+   * report how a page of the file is used.
+   * @param pid[IN] the page, 0 <= pid < endPid()
+   * @param records[OUT] # records in the page, 0 for an overflow page
+   * @param usedBytes[OUT] # bytes of the page in use
+   * @param overflow[OUT] whether the page holds part of a long value
+   * @return error code. 0 if no error
+   */
+  RC getPageUsage(PageId pid, int& records, int& usedBytes, bool& overflow) const;
+
   /**
    * note the +1 part. The rid of the last record is endRid()-1.
    * @return (last record id + 1) of the RecordFile
    */
   const RecordId& endRid() const;
 
+  /**
+   * @return # pages in the file, the overflow pages included
+   */
+  PageId endPid() const { return tailPid >= pf.endPid() ? tailPid + 1 : pf.endPid(); }
+
+  /**
+   * Store the pages of a new (empty) record file compressed, see
+   * PageFile::enableCompression().
+   * @return error code. 0 if no error
+   */
+  RC enableCompression();
+
+  /**
+   * Store the records of the pages started from now on in columns:
+   * the keys of a page in one array, then the values. A scan that looks
+   * at the keys only (e.g. parallelScan()) reads a few cache lines per
+   * page instead of every record. The page appends go to is closed when
+   * the layout changes. open() continues in the layout of the last page
+   * of the file.
+   * @param columnar[IN] true for columnar pages, false for slotted pages
+   * @return error code. 0 if no error
+   */
+  RC setColumnar(bool columnar);
+
+  /**
+   * @return true if new pages are columnar
+   */
+  bool isColumnar() const;
+
+  /**
+   * @return # bytes the record file takes on disk
+   */
+  long long getStoredBytes() const { return pf.getStoredBytes(); }
+
  private:
   bool readOnlyMode;
   PageFile pf;     // the PageFile used to store the records
+  std::string fileName; // the name of the file, for the handles of scan workers
   RecordId erid;   // the last record id of the file + 1
+
+  char   tail[PageFile::PAGE_SIZE]; // the page appends go to
+  PageId tailPid;  // the page in tail, -1 if none
+  bool   tailDirty; // tail has records that are not on the disk yet
+  unsigned int version; // bumped by every change, for RecordGuard
+  int    pageFormat; // the format of new record pages, slotted or columnar
+  std::vector<PageId> freeOverflow; // the overflow pages no value uses
+  bool   freeOverflowLoaded; // freeOverflow was collected since open()
+
+  RC readPage(const RecordId& rid, char* buffer, const char*& page) const;
+
+  RC readOverflow(PageId first, int length, std::string& value) const;
+  RC readChain(PageId first, std::vector<PageId>& pids) const;
+  RC writeOverflow(const std::string& value, const std::vector<PageId>& reuse, PageId tail, PageId& first);
+  RC loadFreeOverflow();
 };
 
 #endif // RECORDFILE_H
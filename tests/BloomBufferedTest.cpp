@@ -0,0 +1,80 @@
+//Regression test: Bloom filter rebuilds of a NODE_BUFFERED index
+//
+//usage: BloomBufferedTest [indexfile]
+//
+//Inserts random keys into a buffered index with a Bloom filter, so that
+//the filter is rebuilt several times while keys still wait in the message
+//buffers, and checks that find() sees every key inserted, before and
+//after the index is closed and opened again. findAll() does not look into
+//the message buffers, so it is checked after flushBuffers().
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "BTreeIndex.h"
+
+static const int KEYS = 20000;
+static const int BITS_PER_KEY = 10;
+
+static int checkKeys(BTreeIndex& index, const vector<KeyType>& keys, bool all, const char* phase)
+{
+  IndexCursor cursor;
+  RecordId rid;
+  vector<RecordId> rids;
+  int failures = 0;
+
+  for(size_t i = 0; i < keys.size(); i++){
+    if(index.find(keys[i], cursor, rid) != 0 || (all && index.findAll(keys[i], rids) != 0)){
+      if(failures < 10) fprintf(stderr, "%s: key %d not found\n", phase, keys[i]);
+      failures++;
+    }
+  }
+  printf("%s: %d of %d keys not found\n", phase, failures, (int)keys.size());
+  return failures;
+}
+
+int main(int argc, char* argv[])
+{
+  string name = argc > 1 ? argv[1] : "bloom_buffered_test.idx";
+  BTreeIndex index;
+  vector<KeyType> keys;
+  int failures = 0;
+  RC rc;
+
+  remove(name.c_str());
+  remove((name + ".blm").c_str());
+  srand(1);
+  if((rc = index.open(name, 'w')) < 0 ||
+     (rc = index.setOptions(BTNode::NODE_BUFFERED)) < 0 ||
+     (rc = index.enableBloomFilter(BITS_PER_KEY)) < 0){
+    fprintf(stderr, "setup error %d\n", rc);
+    return 1;
+  }
+  for(int i = 0; i < KEYS; i++){
+    KeyType key = rand() % (4 * KEYS) - 2 * KEYS;
+    RecordId rid(i / 100, i % 100);
+    if((rc = index.insert(key, rid)) < 0){
+      fprintf(stderr, "insert error %d\n", rc);
+      return 1;
+    }
+    keys.push_back(key);
+  }
+  failures += checkKeys(index, keys, false, "buffered");
+  // a rebuild with every message still in the buffers
+  if((rc = index.enableBloomFilter(BITS_PER_KEY)) < 0) return 1;
+  failures += checkKeys(index, keys, false, "rebuilt");
+  index.close();
+
+  if((rc = index.open(name, 'w')) < 0) return 1;
+  failures += checkKeys(index, keys, false, "reopened");
+  if((rc = index.flushBuffers()) < 0) return 1;
+  failures += checkKeys(index, keys, true, "flushed");
+  index.close();
+
+  remove(name.c_str());
+  remove((name + ".blm").c_str());
+  return failures == 0 ? 0 : 1;
+}